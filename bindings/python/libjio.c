@@ -211,20 +211,31 @@ The buffers must be objects that support slice assignment, like bytearray\n\
 Only available in Python >= 2.6.\n\
 It's a wrapper to jreadv().\n");
 
+/* preadv */
+PyDoc_STRVAR(jf_preadv__doc,
+"preadv([buf1, buf2, ...], offset)\n\
+\n\
+Reads the data from the file at the given offset into the different\n\
+buffers; returns the number of bytes read.\n\
+The buffers must be objects that support slice assignment, like bytearray\n\
+(but *not* str).\n\
+Only available in Python >= 2.6.\n\
+It's a wrapper to jpreadv().\n");
+
 /* readv requires the new Py_buffer interface, which is only available in
  * Python >= 2.6 */
 #if PY_MAJOR_VERSION >= 3 || (PY_MAJOR_VERSION == 2 && PY_MINOR_VERSION >= 6)
-static PyObject *jf_readv(jfile_object *fp, PyObject *args)
+
+/* common code for readv and preadv; a negative offset means to use jreadv() */
+static PyObject *readv_common(jfile_object *fp, PyObject *buffers,
+		long long offset)
 {
 	ssize_t rv;
-	PyObject *buffers, *buf;
+	PyObject *buf;
 	Py_buffer *views = NULL;
 	ssize_t len, pos = 0;
 	struct iovec *iov = NULL;
 
-	if (!PyArg_ParseTuple(args, "O:readv", &buffers))
-		return NULL;
-
 	len = PySequence_Length(buffers);
 	if (len < 0) {
 		PyErr_SetString(PyExc_TypeError, "iterable expected");
@@ -260,7 +271,10 @@ static PyObject *jf_readv(jfile_object *fp, PyObject *args)
 	}
 
 	Py_BEGIN_ALLOW_THREADS
-	rv = jreadv(fp->fs, iov, len);
+	if (offset < 0)
+		rv = jreadv(fp->fs, iov, len);
+	else
+		rv = jpreadv(fp->fs, iov, len, offset);
 	Py_END_ALLOW_THREADS
 
 	for (pos = 0; pos < len; pos++) {
@@ -289,6 +303,32 @@ error:
 	return NULL;
 }
 
+static PyObject *jf_readv(jfile_object *fp, PyObject *args)
+{
+	PyObject *buffers;
+
+	if (!PyArg_ParseTuple(args, "O:readv", &buffers))
+		return NULL;
+
+	return readv_common(fp, buffers, -1);
+}
+
+static PyObject *jf_preadv(jfile_object *fp, PyObject *args)
+{
+	PyObject *buffers;
+	long long offset;
+
+	if (!PyArg_ParseTuple(args, "OL:preadv", &buffers, &offset))
+		return NULL;
+
+	if (offset < 0) {
+		PyErr_SetString(PyExc_TypeError, "offset must be >= 0");
+		return NULL;
+	}
+
+	return readv_common(fp, buffers, offset);
+}
+
 #else
 
 static PyObject *jf_readv(jfile_object *fp, PyObject *args)
@@ -298,6 +338,13 @@ static PyObject *jf_readv(jfile_object *fp, PyObject *args)
 	return NULL;
 }
 
+static PyObject *jf_preadv(jfile_object *fp, PyObject *args)
+{
+	PyErr_SetString(PyExc_NotImplementedError,
+			"only supported in Python >= 2.6");
+	return NULL;
+}
+
 #endif /* python version >= 2.6 */
 
 /* write */
@@ -327,6 +374,33 @@ static PyObject *jf_write(jfile_object *fp, PyObject *args)
 	return Our_PyLong_FromSsize_t(rv);
 }
 
+/* replace */
+PyDoc_STRVAR(jf_replace__doc,
+"replace(buf)\n\
+\n\
+Atomically replace the whole contents of the file with the given buffer (a\n\
+string), returns the number of bytes written.\n\
+It's a wrapper to jreplace().\n");
+
+static PyObject *jf_replace(jfile_object *fp, PyObject *args)
+{
+	ssize_t rv;
+	unsigned char *buf;
+	ssize_t len;
+
+	if (!PyArg_ParseTuple(args, "s#:replace", &buf, &len))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	rv = jreplace(fp->fs, buf, len);
+	Py_END_ALLOW_THREADS
+
+	if (rv < 0)
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	return Our_PyLong_FromSsize_t(rv);
+}
+
 /* pwrite */
 PyDoc_STRVAR(jf_pwrite__doc,
 "pwrite(buf, offset)\n\
@@ -369,16 +443,16 @@ number of bytes written.\n\
 The buffers must be strings or string-alike objects, like str or bytes.\n\
 It's a wrapper to jwritev().\n");
 
-static PyObject *jf_writev(jfile_object *fp, PyObject *args)
+/* common code for writev and pwritev; a negative offset means to use
+ * jwritev() */
+static PyObject *writev_common(jfile_object *fp, PyObject *buffers,
+		long long offset)
 {
 	ssize_t rv;
-	PyObject *buffers, *buf;
+	PyObject *buf;
 	ssize_t len, pos;
 	struct iovec *iov;
 
-	if (!PyArg_ParseTuple(args, "O:writev", &buffers))
-		return NULL;
-
 	len = PySequence_Length(buffers);
 	if (len < 0) {
 		PyErr_SetString(PyExc_TypeError, "iterable expected");
@@ -403,7 +477,10 @@ static PyObject *jf_writev(jfile_object *fp, PyObject *args)
 	}
 
 	Py_BEGIN_ALLOW_THREADS
-	rv = jwritev(fp->fs, iov, len);
+	if (offset < 0)
+		rv = jwritev(fp->fs, iov, len);
+	else
+		rv = jpwritev(fp->fs, iov, len, offset);
 	Py_END_ALLOW_THREADS
 
 	free(iov);
@@ -414,6 +491,41 @@ static PyObject *jf_writev(jfile_object *fp, PyObject *args)
 	return Our_PyLong_FromSsize_t(rv);
 }
 
+static PyObject *jf_writev(jfile_object *fp, PyObject *args)
+{
+	PyObject *buffers;
+
+	if (!PyArg_ParseTuple(args, "O:writev", &buffers))
+		return NULL;
+
+	return writev_common(fp, buffers, -1);
+}
+
+/* pwritev */
+PyDoc_STRVAR(jf_pwritev__doc,
+"pwritev([buf1, buf2, ...], offset)\n\
+\n\
+Writes the data contained in the different buffers to the file at the\n\
+given offset, returns the number of bytes written.\n\
+The buffers must be strings or string-alike objects, like str or bytes.\n\
+It's a wrapper to jpwritev().\n");
+
+static PyObject *jf_pwritev(jfile_object *fp, PyObject *args)
+{
+	PyObject *buffers;
+	long long offset;
+
+	if (!PyArg_ParseTuple(args, "OL:pwritev", &buffers, &offset))
+		return NULL;
+
+	if (offset < 0) {
+		PyErr_SetString(PyExc_TypeError, "offset must be >= 0");
+		return NULL;
+	}
+
+	return writev_common(fp, buffers, offset);
+}
+
 /* truncate */
 PyDoc_STRVAR(jf_truncate__doc,
 "truncate(length)\n\
@@ -572,6 +684,175 @@ static PyObject *jf_autosync_stop(jfile_object *fp, PyObject *args)
 	return PyLong_FromLong(rv);
 }
 
+/* jfs_linger_limit() */
+PyDoc_STRVAR(jf_linger_limit__doc,
+"linger_limit(max_bytes, max_count[, flags])\n\
+\n\
+Limits the amount of pending lingering transactions (0 means no limit).\n\
+It's a wrapper to jfs_linger_limit().\n");
+
+static PyObject *jf_linger_limit(jfile_object *fp, PyObject *args)
+{
+	int rv;
+	unsigned long max_bytes;
+	unsigned int max_count, flags = 0;
+
+	if (!PyArg_ParseTuple(args, "kI|I:linger_limit", &max_bytes,
+				&max_count, &flags))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	rv = jfs_linger_limit(fp->fs, max_bytes, max_count, flags);
+	Py_END_ALLOW_THREADS
+
+	if (rv != 0)
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	return PyLong_FromLong(rv);
+}
+
+/* jfs_sync_mode() */
+PyDoc_STRVAR(jf_sync_mode__doc,
+"sync_mode(mode)\n\
+\n\
+Sets how the transaction files are synced (J_SYNC_FSYNC or J_SYNC_DSYNC).\n\
+It's a wrapper to jfs_sync_mode().\n");
+
+static PyObject *jf_sync_mode(jfile_object *fp, PyObject *args)
+{
+	int rv;
+	unsigned int mode;
+
+	if (!PyArg_ParseTuple(args, "I:sync_mode", &mode))
+		return NULL;
+
+	rv = jfs_sync_mode(fp->fs, mode);
+	if (rv != 0)
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	return PyLong_FromLong(rv);
+}
+
+/* jfs_pool_config() */
+PyDoc_STRVAR(jf_pool_config__doc,
+"pool_config(max_bytes[, flags])\n\
+\n\
+Sets how many bytes the buffer pool can keep (0 means none).\n\
+It's a wrapper to jfs_pool_config().\n");
+
+static PyObject *jf_pool_config(jfile_object *fp, PyObject *args)
+{
+	int rv;
+	unsigned long max_bytes;
+	unsigned int flags = 0;
+
+	if (!PyArg_ParseTuple(args, "k|I:pool_config", &max_bytes, &flags))
+		return NULL;
+
+	rv = jfs_pool_config(fp->fs, max_bytes, flags);
+	if (rv != 0)
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	return PyLong_FromLong(rv);
+}
+
+/* jfs_pool_stats() */
+PyDoc_STRVAR(jf_pool_stats__doc,
+"pool_stats()\n\
+\n\
+Returns a dictionary with the statistics of the buffer pool.\n\
+It's a wrapper to jfs_pool_stats().\n");
+
+static PyObject *jf_pool_stats(jfile_object *fp, PyObject *args)
+{
+	struct jpool_stats st;
+	PyObject *dict;
+
+	if (!PyArg_ParseTuple(args, ":pool_stats"))
+		return NULL;
+
+	if (jfs_pool_stats(fp->fs, &st) != 0)
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	dict = PyDict_New();
+	if (dict == NULL)
+		return PyErr_NoMemory();
+
+	PyDict_SetItemString(dict, "gets", PyLong_FromUnsignedLongLong(st.gets));
+	PyDict_SetItemString(dict, "hits", PyLong_FromUnsignedLongLong(st.hits));
+	PyDict_SetItemString(dict, "puts", PyLong_FromUnsignedLongLong(st.puts));
+	PyDict_SetItemString(dict, "drops", PyLong_FromUnsignedLongLong(st.drops));
+	PyDict_SetItemString(dict, "kept", PyLong_FromUnsignedLongLong(st.kept));
+	PyDict_SetItemString(dict, "kept_bytes",
+			PyLong_FromUnsignedLongLong(st.kept_bytes));
+
+	return dict;
+}
+
+/* jfs_stats() */
+PyDoc_STRVAR(jf_stats__doc,
+"stats([reset])\n\
+\n\
+Returns a dictionary with the commit statistics; 'phases' maps the name of\n\
+each phase to its latency histogram, as a list. If reset is True, they're\n\
+reset after getting them.\n\
+It's a wrapper to jfs_stats().\n");
+
+static PyObject *jf_stats(jfile_object *fp, PyObject *args)
+{
+	int i, j, reset = 0;
+	struct jstats st;
+	PyObject *dict, *phases, *hist;
+	static const char *names[J_STATS_PHASES] = { "lock", "tid", "jwrite",
+		"jsync", "dirsync", "readprev", "apply", "datasync", "unlink",
+		"freetid" };
+
+	if (!PyArg_ParseTuple(args, "|i:stats", &reset))
+		return NULL;
+
+	if (jfs_stats(fp->fs, &st, reset) != 0)
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	dict = PyDict_New();
+	if (dict == NULL)
+		return PyErr_NoMemory();
+
+	phases = PyDict_New();
+	if (phases == NULL) {
+		Py_DECREF(dict);
+		return PyErr_NoMemory();
+	}
+
+	for (i = 0; i < J_STATS_PHASES; i++) {
+		hist = PyList_New(J_STATS_BUCKETS);
+		if (hist == NULL) {
+			Py_DECREF(phases);
+			Py_DECREF(dict);
+			return PyErr_NoMemory();
+		}
+
+		for (j = 0; j < J_STATS_BUCKETS; j++)
+			PyList_SET_ITEM(hist, j, PyLong_FromUnsignedLongLong(
+						st.phases[i][j]));
+
+		PyDict_SetItemString(phases, names[i], hist);
+		Py_DECREF(hist);
+	}
+
+	PyDict_SetItemString(dict, "phases", phases);
+	Py_DECREF(phases);
+
+	PyDict_SetItemString(dict, "commits",
+			PyLong_FromUnsignedLongLong(st.commits));
+	PyDict_SetItemString(dict, "ops", PyLong_FromUnsignedLongLong(st.ops));
+	PyDict_SetItemString(dict, "bytes_journaled",
+			PyLong_FromUnsignedLongLong(st.bytes_journaled));
+	PyDict_SetItemString(dict, "rollbacks",
+			PyLong_FromUnsignedLongLong(st.rollbacks));
+
+	return dict;
+}
+
 /* new_trans */
 PyDoc_STRVAR(jf_new_trans__doc,
 "new_trans()\n\
@@ -616,11 +897,16 @@ static PyMethodDef jfile_methods[] = {
 	{ "read", (PyCFunction) jf_read, METH_VARARGS, jf_read__doc },
 	{ "pread", (PyCFunction) jf_pread, METH_VARARGS, jf_pread__doc },
 	{ "readv", (PyCFunction) jf_readv, METH_VARARGS, jf_readv__doc },
+	{ "preadv", (PyCFunction) jf_preadv, METH_VARARGS, jf_preadv__doc },
 	{ "write", (PyCFunction) jf_write, METH_VARARGS, jf_write__doc },
 	{ "pwrite", (PyCFunction) jf_pwrite, METH_VARARGS, jf_pwrite__doc },
 	{ "writev", (PyCFunction) jf_writev, METH_VARARGS, jf_writev__doc },
+	{ "pwritev", (PyCFunction) jf_pwritev, METH_VARARGS,
+		jf_pwritev__doc },
 	{ "truncate", (PyCFunction) jf_truncate, METH_VARARGS,
 		jf_truncate__doc },
+	{ "replace", (PyCFunction) jf_replace, METH_VARARGS,
+		jf_replace__doc },
 	{ "lseek", (PyCFunction) jf_lseek, METH_VARARGS, jf_lseek__doc },
 	{ "jsync", (PyCFunction) jf_jsync, METH_VARARGS, jf_jsync__doc },
 	{ "jmove_journal", (PyCFunction) jf_jmove_journal, METH_VARARGS,
@@ -629,6 +915,15 @@ static PyMethodDef jfile_methods[] = {
 		jf_autosync_start__doc },
 	{ "autosync_stop", (PyCFunction) jf_autosync_stop, METH_VARARGS,
 		jf_autosync_stop__doc },
+	{ "linger_limit", (PyCFunction) jf_linger_limit, METH_VARARGS,
+		jf_linger_limit__doc },
+	{ "sync_mode", (PyCFunction) jf_sync_mode, METH_VARARGS,
+		jf_sync_mode__doc },
+	{ "pool_config", (PyCFunction) jf_pool_config, METH_VARARGS,
+		jf_pool_config__doc },
+	{ "pool_stats", (PyCFunction) jf_pool_stats, METH_VARARGS,
+		jf_pool_stats__doc },
+	{ "stats", (PyCFunction) jf_stats, METH_VARARGS, jf_stats__doc },
 	{ "new_trans", (PyCFunction) jf_new_trans, METH_VARARGS,
 		jf_new_trans__doc },
 	{ NULL }
@@ -716,6 +1011,106 @@ static PyObject *jt_add_w(jtrans_object *tp, PyObject *args)
 	return PyLong_FromLong(rv);
 }
 
+/* add_w_fd */
+PyDoc_STRVAR(jt_add_w_fd__doc,
+"add_w_fd(fd, srcoffset, length, offset)\n\
+\n\
+Add an operation to write length bytes read from the file descriptor fd\n\
+(starting at srcoffset) at the given offset to the transaction. fd can also\n\
+be a file object.\n\
+It's a wrapper to jtrans_add_w_fd().\n");
+
+static PyObject *jt_add_w_fd(jtrans_object *tp, PyObject *args)
+{
+	int rv, fd;
+	PyObject *fileobj;
+	long long srcoff, len, offset;
+
+	if (!PyArg_ParseTuple(args, "OLLL:add_w_fd", &fileobj, &srcoff, &len,
+				&offset))
+		return NULL;
+
+	fd = PyObject_AsFileDescriptor(fileobj);
+	if (fd < 0)
+		return NULL;
+
+	if (srcoff < 0 || len < 0 || offset < 0) {
+		PyErr_SetString(PyExc_TypeError,
+				"offsets and length must be >= 0");
+		return NULL;
+	}
+
+	rv = jtrans_add_w_fd(tp->ts, fd, srcoff, len, offset);
+	if (rv < 0)
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	return PyLong_FromLong(rv);
+}
+
+/* add_wv */
+PyDoc_STRVAR(jt_add_wv__doc,
+"add_wv([(buf1, offset1), (buf2, offset2), ...])\n\
+\n\
+Add many operations to write the given buffers at the given offsets to the\n\
+transaction, all at once.\n\
+It's a wrapper to jtrans_add_wv().\n");
+
+static PyObject *jt_add_wv(jtrans_object *tp, PyObject *args)
+{
+	int rv;
+	PyObject *list, *item;
+	ssize_t n, pos;
+	long long offset;
+	struct jio_wop *ops;
+
+	if (!PyArg_ParseTuple(args, "O:add_wv", &list))
+		return NULL;
+
+	n = PySequence_Length(list);
+	if (n < 0) {
+		PyErr_SetString(PyExc_TypeError, "iterable expected");
+		return NULL;
+	}
+
+	ops = malloc(sizeof(struct jio_wop) * n);
+	if (ops == NULL)
+		return PyErr_NoMemory();
+
+	for (pos = 0; pos < n; pos++) {
+		item = PySequence_GetItem(list, pos);
+		if (item == NULL)
+			goto error;
+
+		ops[pos].len = 0;
+		rv = PyArg_ParseTuple(item, "s#L:add_wv", &(ops[pos].buf),
+				&(ops[pos].len), &offset);
+		Py_DECREF(item);
+		if (!rv)
+			goto error;
+
+		if (offset < 0) {
+			PyErr_SetString(PyExc_TypeError,
+					"offset must be >= 0");
+			goto error;
+		}
+		ops[pos].offset = offset;
+	}
+
+	/* the buffers belong to the objects in the list, which may go away
+	 * before the commit, so we let the library copy them */
+	rv = jtrans_add_wv(tp->ts, ops, n, 0);
+	free(ops);
+
+	if (rv < 0)
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	return PyLong_FromLong(rv);
+
+error:
+	free(ops);
+	return NULL;
+}
+
 /* add_r */
 PyDoc_STRVAR(jt_add_r__doc,
 "add_r(buf, offset)\n\
@@ -845,12 +1240,41 @@ static PyObject *jt_rollback(jtrans_object *tp, PyObject *args)
 	return Our_PyLong_FromSsize_t(rv);
 }
 
+/* reset */
+PyDoc_STRVAR(jt_reset__doc,
+"reset()\n\
+\n\
+Removes all the operations from the transaction, so it can be used again.\n\
+It's a wrapper to jtrans_reset().\n");
+
+static PyObject *jt_reset(jtrans_object *tp, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args, ":reset"))
+		return NULL;
+
+	jtrans_reset(tp->ts);
+
+	/* release views allocated by add_r, they're no longer used */
+	while (tp->nviews) {
+		PyBuffer_Release(tp->views[tp->nviews - 1]);
+		free(tp->views[tp->nviews - 1]);
+		tp->nviews--;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
 /* method table */
 static PyMethodDef jtrans_methods[] = {
 	{ "add_r", (PyCFunction) jt_add_r, METH_VARARGS, jt_add_r__doc },
 	{ "add_w", (PyCFunction) jt_add_w, METH_VARARGS, jt_add_w__doc },
+	{ "add_wv", (PyCFunction) jt_add_wv, METH_VARARGS, jt_add_wv__doc },
+	{ "add_w_fd", (PyCFunction) jt_add_w_fd, METH_VARARGS,
+		jt_add_w_fd__doc },
 	{ "commit", (PyCFunction) jt_commit, METH_VARARGS, jt_commit__doc },
 	{ "rollback", (PyCFunction) jt_rollback, METH_VARARGS, jt_rollback__doc },
+	{ "reset", (PyCFunction) jt_reset, METH_VARARGS, jt_reset__doc },
 	{ NULL }
 };
 
@@ -934,6 +1358,74 @@ static PyObject *jf_open(PyObject *self, PyObject *args)
 	return (PyObject *) fp;
 }
 
+/* open_shared */
+PyDoc_STRVAR(jf_open_shared__doc,
+"open_shared(name, jdir[, flags[, mode[, jflags]]])\n\
+\n\
+Opens a file using the shared journal at jdir, returns a file object.\n\
+The other arguments are the same as in open().\n\
+It's a wrapper to jopen_shared().\n");
+
+static PyObject *jf_open_shared(PyObject *self, PyObject *args)
+{
+	char *file, *jdir;
+	int flags = O_RDWR;
+	int mode = 0600;
+	unsigned int jflags = 0;
+	jfile_object *fp = NULL;
+
+	if (!PyArg_ParseTuple(args, "ss|iiI:open_shared", &file, &jdir,
+				&flags, &mode, &jflags))
+		return NULL;
+
+#ifdef PYTHON3
+	fp = (jfile_object *) jfile_type.tp_alloc(&jfile_type, 0);
+#elif PYTHON2
+	fp = PyObject_New(jfile_object, &jfile_type);
+#endif
+
+	if (fp == NULL)
+		return NULL;
+
+	fp->fs = jopen_shared(file, flags, mode, jflags, jdir);
+	if (fp->fs == NULL) {
+		return PyErr_SetFromErrno(PyExc_IOError);
+	}
+
+	if (PyErr_Occurred()) {
+		jclose(fp->fs);
+		return NULL;
+	}
+
+	return (PyObject *) fp;
+}
+
+/* Build the result of jfsck() and jfsck_shared() */
+static PyObject *jfsck_result(int rv, struct jfsck_result *res)
+{
+	PyObject *dict;
+
+	if (rv == J_ENOMEM) {
+		return PyErr_NoMemory();
+	} else if (rv != 0) {
+		PyErr_SetObject(PyExc_IOError, PyLong_FromLong(rv));
+		return NULL;
+	}
+
+	dict = PyDict_New();
+	if (dict == NULL)
+		return PyErr_NoMemory();
+
+	PyDict_SetItemString(dict, "total", PyLong_FromLong(res->total));
+	PyDict_SetItemString(dict, "invalid", PyLong_FromLong(res->invalid));
+	PyDict_SetItemString(dict, "in_progress", PyLong_FromLong(res->in_progress));
+	PyDict_SetItemString(dict, "broken", PyLong_FromLong(res->broken));
+	PyDict_SetItemString(dict, "corrupt", PyLong_FromLong(res->corrupt));
+	PyDict_SetItemString(dict, "reapplied", PyLong_FromLong(res->reapplied));
+
+	return dict;
+}
+
 /* jfsck */
 PyDoc_STRVAR(jf_jfsck__doc,
 "jfsck(name[, jdir] [, flags])\n\
@@ -951,44 +1443,108 @@ static PyObject *jf_jfsck(PyObject *self, PyObject *args, PyObject *kw)
 	unsigned int flags = 0;
 	char *name, *jdir = NULL;
 	struct jfsck_result res;
-	PyObject *dict;
 	char *keywords[] = { "name", "jdir", "flags", NULL };
 
 	if (!PyArg_ParseTupleAndKeywords(args, kw, "s|sI:jfsck",
 				keywords, &name, &jdir, &flags))
 		return NULL;
 
-	dict = PyDict_New();
-	if (dict == NULL)
-		return PyErr_NoMemory();
-
 	Py_BEGIN_ALLOW_THREADS
 	rv = jfsck(name, jdir, &res, flags);
 	Py_END_ALLOW_THREADS
 
-	if (rv == J_ENOMEM) {
-		Py_XDECREF(dict);
-		return PyErr_NoMemory();
-	} else if (rv != 0) {
-		Py_XDECREF(dict);
-		PyErr_SetObject(PyExc_IOError, PyLong_FromLong(rv));
+	return jfsck_result(rv, &res);
+}
+
+/* jfsck_shared */
+PyDoc_STRVAR(jf_jfsck_shared__doc,
+"jfsck_shared(jdir[, flags])\n\
+\n\
+Checks the integrity of all the files using the shared journal at jdir,\n\
+with the given flags; returns a dictionary like jfsck().\n\
+It's a wrapper to jfsck_shared().\n");
+
+static PyObject *jf_jfsck_shared(PyObject *self, PyObject *args,
+		PyObject *kw)
+{
+	int rv;
+	unsigned int flags = 0;
+	char *jdir;
+	struct jfsck_result res;
+	char *keywords[] = { "jdir", "flags", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "s|I:jfsck_shared",
+				keywords, &jdir, &flags))
 		return NULL;
-	}
 
-	PyDict_SetItemString(dict, "total", PyLong_FromLong(res.total));
-	PyDict_SetItemString(dict, "invalid", PyLong_FromLong(res.invalid));
-	PyDict_SetItemString(dict, "in_progress", PyLong_FromLong(res.in_progress));
-	PyDict_SetItemString(dict, "broken", PyLong_FromLong(res.broken));
-	PyDict_SetItemString(dict, "corrupt", PyLong_FromLong(res.corrupt));
-	PyDict_SetItemString(dict, "reapplied", PyLong_FromLong(res.reapplied));
+	Py_BEGIN_ALLOW_THREADS
+	rv = jfsck_shared(jdir, &res, flags);
+	Py_END_ALLOW_THREADS
 
-	return dict;
+	return jfsck_result(rv, &res);
+}
+
+/* jfs_autosync_pool_start() */
+PyDoc_STRVAR(jf_autosync_pool_start__doc,
+"autosync_pool_start(nthreads)\n\
+\n\
+Starts the shared autosync pool; while it's running, the files' autosync\n\
+is handled by it instead of a dedicated thread.\n\
+It's a wrapper to jfs_autosync_pool_start().\n");
+
+static PyObject *jf_autosync_pool_start(PyObject *self, PyObject *args)
+{
+	int rv;
+	unsigned int nthreads;
+
+	if (!PyArg_ParseTuple(args, "I:autosync_pool_start", &nthreads))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	rv = jfs_autosync_pool_start(nthreads);
+	Py_END_ALLOW_THREADS
+
+	if (rv != 0)
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	return PyLong_FromLong(rv);
+}
+
+/* jfs_autosync_pool_stop() */
+PyDoc_STRVAR(jf_autosync_pool_stop__doc,
+"autosync_pool_stop()\n\
+\n\
+Stops the shared autosync pool started by autosync_pool_start().\n\
+It's a wrapper to jfs_autosync_pool_stop().\n");
+
+static PyObject *jf_autosync_pool_stop(PyObject *self, PyObject *args)
+{
+	int rv;
+
+	if (!PyArg_ParseTuple(args, ":autosync_pool_stop"))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	rv = jfs_autosync_pool_stop();
+	Py_END_ALLOW_THREADS
+
+	if (rv != 0)
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	return PyLong_FromLong(rv);
 }
 
 static PyMethodDef module_methods[] = {
 	{ "open", jf_open, METH_VARARGS, jf_open__doc },
+	{ "open_shared", jf_open_shared, METH_VARARGS, jf_open_shared__doc },
 	{ "jfsck", (PyCFunction) jf_jfsck, METH_VARARGS | METH_KEYWORDS,
 		jf_jfsck__doc },
+	{ "jfsck_shared", (PyCFunction) jf_jfsck_shared,
+		METH_VARARGS | METH_KEYWORDS, jf_jfsck_shared__doc },
+	{ "autosync_pool_start", jf_autosync_pool_start, METH_VARARGS,
+		jf_autosync_pool_start__doc },
+	{ "autosync_pool_stop", jf_autosync_pool_stop, METH_VARARGS,
+		jf_autosync_pool_stop__doc },
 	{ NULL, NULL, 0, NULL },
 };
 
@@ -1013,6 +1569,11 @@ static void populate_module(PyObject *m)
 	PyModule_AddIntConstant(m, "J_NOLOCK", J_NOLOCK);
 	PyModule_AddIntConstant(m, "J_NOROLLBACK", J_NOROLLBACK);
 	PyModule_AddIntConstant(m, "J_LINGER", J_LINGER);
+	PyModule_AddIntConstant(m, "J_FANOUT", J_FANOUT);
+	PyModule_AddIntConstant(m, "J_DROPCACHE", J_DROPCACHE);
+	PyModule_AddIntConstant(m, "J_ORDERED", J_ORDERED);
+	PyModule_AddIntConstant(m, "J_INCREMENTAL", J_INCREMENTAL);
+	PyModule_AddIntConstant(m, "J_NOSTATS", J_NOSTATS);
 	PyModule_AddIntConstant(m, "J_COMMITTED", J_COMMITTED);
 	PyModule_AddIntConstant(m, "J_ROLLBACKED", J_ROLLBACKED);
 	PyModule_AddIntConstant(m, "J_ROLLBACKING", J_ROLLBACKING);
@@ -1026,6 +1587,16 @@ static void populate_module(PyObject *m)
 	PyModule_AddIntConstant(m, "J_ECLEANUP", J_ECLEANUP);
 	PyModule_AddIntConstant(m, "J_EIO", J_EIO);
 
+	/* jfs_linger_limit() flags */
+	PyModule_AddIntConstant(m, "J_NONBLOCK", J_NONBLOCK);
+
+	/* jfs_sync_mode() modes */
+	PyModule_AddIntConstant(m, "J_SYNC_FSYNC", J_SYNC_FSYNC);
+	PyModule_AddIntConstant(m, "J_SYNC_DSYNC", J_SYNC_DSYNC);
+
+	/* jfs_pool_config() flags */
+	PyModule_AddIntConstant(m, "J_HUGEPAGES", J_HUGEPAGES);
+
 	/* jfsck() flags */
 	PyModule_AddIntConstant(m, "J_CLEANUP", J_CLEANUP);
 
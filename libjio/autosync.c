@@ -4,7 +4,7 @@
  */
 
 #include <pthread.h>	/* pthread_* */
-#include <errno.h>	/* ETIMEDOUT */
+#include <errno.h>	/* errno, ETIMEDOUT, EBUSY */
 #include <signal.h>	/* sig_atomic_t */
 #include <stdlib.h>	/* malloc() and friends */
 #include <time.h>	/* clock_gettime() */
@@ -12,6 +12,7 @@
 #include "common.h"
 #include "libjio.h"
 #include "compat.h"
+#include "trace.h"
 
 
 /** Configuration of an autosync thread */
@@ -36,8 +37,83 @@ struct autosync_cfg {
 
 	/** Mutex to use for the condition variable */
 	pthread_mutex_t mutex;
+
+	/** Is this file handled by the shared pool instead of its own
+	 * thread? */
+	int pooled;
+
+	/** When the pool should jsync() the file next (only if pooled) */
+	struct timespec deadline;
+
+	/** Position in the pool's heap, -1 if it's not in it (only if
+	 * pooled) */
+	int heap_idx;
+
+	/** Is a pool worker running jsync() on the file? (only if pooled) */
+	int busy;
+
+	/** Did any of the pool's jsync() calls fail? (only if pooled) */
+	int had_errors;
+};
+
+/** The shared autosync pool. Files are kept in a heap ordered by their
+ * deadline, so the workers only have to look at the top to know how long to
+ * sleep. Everything is protected by the pool mutex. */
+struct autosync_pool {
+	/** Protects all the fields */
+	pthread_mutex_t mutex;
+
+	/** Used to wake up the workers when the heap changes */
+	pthread_cond_t cond;
+
+	/** Signalled when a worker finishes a jsync() */
+	pthread_cond_t idle;
+
+	/** Heap of files, ordered by deadline */
+	struct autosync_cfg **heap;
+
+	/** Number of elements in the heap */
+	unsigned int heap_len;
+
+	/** Number of allocated elements in the heap */
+	unsigned int heap_size;
+
+	/** Number of files registered in the pool */
+	unsigned int nfiles;
+
+	/** Worker threads */
+	pthread_t *threads;
+
+	/** Number of worker threads */
+	unsigned int nthreads;
+
+	/** Is the pool running? */
+	int running;
+
+	/** When the workers must die, we set this to 1 */
+	int must_die;
+};
+
+static struct autosync_pool pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
 };
 
+/** Is a sync already due, because there are enough bytes written or commits
+ * are waiting for us? Takes fs' ltlock, so it must be called without it (and
+ * without the pool's mutex, which is always taken after it). */
+static int sync_due(struct autosync_cfg *cfg)
+{
+	int due;
+
+	pthread_mutex_lock(&cfg->fs->ltlock);
+	due = cfg->fs->ltrans_len > cfg->max_bytes || linger_full(cfg->fs);
+	pthread_mutex_unlock(&cfg->fs->ltlock);
+
+	return due;
+}
+
 /** Thread that performs the automatic syncing */
 static void *autosync_thread(void *arg)
 {
@@ -65,9 +141,11 @@ static void *autosync_thread(void *arg)
 			break;
 
 		/* cover from spurious wakeups */
-		if (rv != ETIMEDOUT && cfg->fs->ltrans_len < cfg->max_bytes)
+		if (rv != ETIMEDOUT && !sync_due(cfg))
 			continue;
 
+		trace2(autosync__wakeup, cfg->fs, cfg->fs->ltrans_len);
+
 		rv = jsync(cfg->fs);
 		if (rv != 0)
 			had_errors = (void *) 1;
@@ -79,14 +157,337 @@ static void *autosync_thread(void *arg)
 	return NULL;
 }
 
+
+/*
+ * Shared autosync pool
+ */
+
+/** Compare two timespecs, returns < 0, 0 or > 0 like strcmp() */
+static int ts_cmp(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec ? -1 : 1;
+	if (a->tv_nsec != b->tv_nsec)
+		return a->tv_nsec < b->tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/** Swap two elements of the pool's heap, keeping heap_idx updated */
+static void heap_swap(unsigned int i, unsigned int j)
+{
+	struct autosync_cfg *tmp;
+
+	tmp = pool.heap[i];
+	pool.heap[i] = pool.heap[j];
+	pool.heap[j] = tmp;
+
+	pool.heap[i]->heap_idx = i;
+	pool.heap[j]->heap_idx = j;
+}
+
+/** Restore the heap property for the element at position i, which may have
+ * moved in either direction */
+static void heap_fix(unsigned int i)
+{
+	unsigned int parent, child;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (ts_cmp(&pool.heap[parent]->deadline,
+					&pool.heap[i]->deadline) <= 0)
+			break;
+		heap_swap(i, parent);
+		i = parent;
+	}
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= pool.heap_len)
+			break;
+		if (child + 1 < pool.heap_len &&
+				ts_cmp(&pool.heap[child + 1]->deadline,
+					&pool.heap[child]->deadline) < 0)
+			child++;
+		if (ts_cmp(&pool.heap[i]->deadline,
+					&pool.heap[child]->deadline) <= 0)
+			break;
+		heap_swap(i, child);
+		i = child;
+	}
+}
+
+/** Add a file to the pool's heap. Returns 0 on success, -1 on error. */
+static int heap_push(struct autosync_cfg *cfg)
+{
+	unsigned int newsize;
+	struct autosync_cfg **newheap;
+
+	if (pool.heap_len == pool.heap_size) {
+		newsize = pool.heap_size ? pool.heap_size * 2 : 16;
+		newheap = realloc(pool.heap,
+				newsize * sizeof(struct autosync_cfg *));
+		if (newheap == NULL)
+			return -1;
+
+		pool.heap = newheap;
+		pool.heap_size = newsize;
+	}
+
+	cfg->heap_idx = pool.heap_len;
+	pool.heap[pool.heap_len] = cfg;
+	pool.heap_len++;
+	heap_fix(cfg->heap_idx);
+
+	return 0;
+}
+
+/** Remove a file from the pool's heap */
+static void heap_remove(struct autosync_cfg *cfg)
+{
+	unsigned int i = cfg->heap_idx;
+
+	pool.heap_len--;
+	if (i != pool.heap_len) {
+		heap_swap(i, pool.heap_len);
+		heap_fix(i);
+	}
+
+	cfg->heap_idx = -1;
+}
+
+/** Set the file's next deadline, max_sec seconds from now; or right now if
+ * due (see sync_due(), which must be called before taking the pool's
+ * mutex) */
+static void set_deadline(struct autosync_cfg *cfg, int due)
+{
+	if (due) {
+		cfg->deadline.tv_sec = 0;
+		cfg->deadline.tv_nsec = 0;
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &cfg->deadline);
+	cfg->deadline.tv_sec += cfg->max_sec;
+}
+
+/** Worker thread of the shared autosync pool */
+static void *autosync_pool_thread(void *arg)
+{
+	int rv, due;
+	struct timespec now;
+	struct autosync_cfg *cfg;
+
+	pthread_mutex_lock(&pool.mutex);
+	for (;;) {
+		if (pool.must_die)
+			break;
+
+		if (pool.heap_len == 0) {
+			pthread_cond_wait(&pool.cond, &pool.mutex);
+			continue;
+		}
+
+		cfg = pool.heap[0];
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (ts_cmp(&cfg->deadline, &now) > 0) {
+			/* we may be woken up earlier if another file's
+			 * deadline comes first, or if this one's changes */
+			pthread_cond_timedwait(&pool.cond, &pool.mutex,
+					&cfg->deadline);
+			continue;
+		}
+
+		/* take it out of the heap while we work on it, so no other
+		 * worker picks it up */
+		heap_remove(cfg);
+		cfg->busy = 1;
+		pthread_mutex_unlock(&pool.mutex);
+
+		trace2(autosync__wakeup, cfg->fs, cfg->fs->ltrans_len);
+
+		rv = jsync(cfg->fs);
+		due = sync_due(cfg);
+
+		pthread_mutex_lock(&pool.mutex);
+		if (rv != 0)
+			cfg->had_errors = 1;
+		cfg->busy = 0;
+
+		if (!cfg->must_die) {
+			set_deadline(cfg, due);
+			if (heap_push(cfg) != 0) {
+				/* we can't keep track of it anymore, report
+				 * it back on jfs_autosync_stop() */
+				cfg->had_errors = 1;
+			}
+		}
+
+		pthread_cond_broadcast(&pool.idle);
+	}
+	pthread_mutex_unlock(&pool.mutex);
+
+	return NULL;
+}
+
+/* Starts the shared autosync pool, with the given number of worker
+ * threads */
+int jfs_autosync_pool_start(unsigned int nthreads)
+{
+	int rv = 0;
+	unsigned int i;
+
+	if (nthreads == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&pool.mutex);
+
+	if (pool.running) {
+		errno = EBUSY;
+		goto error;
+	}
+
+	pool.threads = malloc(nthreads * sizeof(pthread_t));
+	if (pool.threads == NULL)
+		goto error;
+
+	pool.must_die = 0;
+	for (i = 0; i < nthreads; i++) {
+		rv = pthread_create(&pool.threads[i], NULL,
+				&autosync_pool_thread, NULL);
+		if (rv != 0)
+			break;
+	}
+
+	if (i < nthreads) {
+		/* stop the ones we could create */
+		pool.must_die = 1;
+		pthread_cond_broadcast(&pool.cond);
+		pthread_mutex_unlock(&pool.mutex);
+
+		while (i-- > 0)
+			pthread_join(pool.threads[i], NULL);
+
+		pthread_mutex_lock(&pool.mutex);
+		free(pool.threads);
+		pool.threads = NULL;
+		errno = rv;
+		goto error;
+	}
+
+	pool.nthreads = nthreads;
+	pool.running = 1;
+
+	pthread_mutex_unlock(&pool.mutex);
+	return 0;
+
+error:
+	pthread_mutex_unlock(&pool.mutex);
+	return -1;
+}
+
+/* Stops the shared autosync pool. All the files using it must have had their
+ * autosync stopped before. */
+int jfs_autosync_pool_stop(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&pool.mutex);
+
+	if (!pool.running || pool.nfiles > 0) {
+		pthread_mutex_unlock(&pool.mutex);
+		return -1;
+	}
+
+	pool.must_die = 1;
+	pool.running = 0;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.mutex);
+
+	for (i = 0; i < pool.nthreads; i++)
+		pthread_join(pool.threads[i], NULL);
+
+	pthread_mutex_lock(&pool.mutex);
+	free(pool.threads);
+	pool.threads = NULL;
+	pool.nthreads = 0;
+	free(pool.heap);
+	pool.heap = NULL;
+	pool.heap_len = pool.heap_size = 0;
+	pthread_mutex_unlock(&pool.mutex);
+
+	return 0;
+}
+
+/** Register the file in the shared pool. Returns 1 if it was registered, 0
+ * if the pool is not running, and -1 on error. */
+static int autosync_pool_add(struct autosync_cfg *cfg)
+{
+	int rv = 0;
+	int due;
+
+	due = sync_due(cfg);
+	pthread_mutex_lock(&pool.mutex);
+
+	if (!pool.running)
+		goto exit;
+
+	cfg->pooled = 1;
+	set_deadline(cfg, due);
+
+	rv = -1;
+	if (heap_push(cfg) != 0)
+		goto exit;
+
+	pool.nfiles++;
+	pthread_cond_signal(&pool.cond);
+	rv = 1;
+
+exit:
+	pthread_mutex_unlock(&pool.mutex);
+	return rv;
+}
+
+/** Unregister the file from the shared pool, waiting for any in-progress
+ * jsync() to finish. Returns 0 on success, -1 if there were errors. */
+static int autosync_pool_remove(struct autosync_cfg *cfg)
+{
+	int rv;
+
+	pthread_mutex_lock(&pool.mutex);
+
+	cfg->must_die = 1;
+	while (cfg->busy)
+		pthread_cond_wait(&pool.idle, &pool.mutex);
+
+	if (cfg->heap_idx >= 0)
+		heap_remove(cfg);
+	pool.nfiles--;
+
+	rv = cfg->had_errors ? -1 : 0;
+
+	pthread_mutex_unlock(&pool.mutex);
+	return rv;
+}
+
+
+/*
+ * Per-file API
+ */
+
 /* Starts the autosync thread, which will perform a jsync() every max_sec
- * seconds, or every max_bytes written using lingering transactions. */
+ * seconds, or every max_bytes written using lingering transactions. If the
+ * shared pool is running, the file is handled by it instead. */
 int jfs_autosync_start(struct jfs *fs, time_t max_sec, size_t max_bytes)
 {
+	int rv;
 	struct autosync_cfg *cfg;
 
-	if (fs->as_cfg != NULL)
+	if (fs->as_cfg != NULL) {
+		errno = EBUSY;
 		return -1;
+	}
 
 	cfg = malloc(sizeof(struct autosync_cfg));
 	if (cfg == NULL)
@@ -96,12 +497,44 @@ int jfs_autosync_start(struct jfs *fs, time_t max_sec, size_t max_bytes)
 	cfg->max_sec = max_sec;
 	cfg->max_bytes = max_bytes;
 	cfg->must_die = 0;
+	cfg->pooled = 0;
+	cfg->heap_idx = -1;
+	cfg->busy = 0;
+	cfg->had_errors = 0;
 	pthread_cond_init(&cfg->cond, NULL);
 	pthread_mutex_init(&cfg->mutex, NULL);
 
+	/* autosync_check() reads fs->as_cfg with ltlock held, so we set it
+	 * under it to make sure it never sees a half-registered config */
+	pthread_mutex_lock(&fs->ltlock);
 	fs->as_cfg = cfg;
+	pthread_mutex_unlock(&fs->ltlock);
 
-	return pthread_create(&cfg->tid, NULL, &autosync_thread, cfg);
+	rv = autosync_pool_add(cfg);
+	if (rv == 1)
+		return 0;
+
+	if (rv == 0) {
+		/* pthread_create() returns the error instead of setting
+		 * errno */
+		rv = pthread_create(&cfg->tid, NULL, &autosync_thread, cfg);
+		if (rv != 0) {
+			errno = rv;
+			rv = -1;
+		}
+	}
+
+	if (rv != 0) {
+		pthread_mutex_lock(&fs->ltlock);
+		fs->as_cfg = NULL;
+		pthread_mutex_unlock(&fs->ltlock);
+
+		pthread_cond_destroy(&cfg->cond);
+		pthread_mutex_destroy(&cfg->mutex);
+		free(cfg);
+	}
+
+	return rv;
 }
 
 /* Stops the autosync thread started by jfs_autosync_start(). It's
@@ -110,33 +543,64 @@ int jfs_autosync_stop(struct jfs *fs)
 {
 	int rv = 0;
 	void *had_errors;
+	struct autosync_cfg *cfg;
 
 	if (fs->as_cfg == NULL)
 		return 0;
 
-	fs->as_cfg->must_die = 1;
-	pthread_cond_signal(&fs->as_cfg->cond);
-	pthread_join(fs->as_cfg->tid, &had_errors);
+	cfg = fs->as_cfg;
 
-	if (had_errors)
-		rv = -1;
+	if (cfg->pooled) {
+		rv = autosync_pool_remove(cfg);
+	} else {
+		pthread_mutex_lock(&cfg->mutex);
+		cfg->must_die = 1;
+		pthread_cond_signal(&cfg->cond);
+		pthread_mutex_unlock(&cfg->mutex);
+		pthread_join(cfg->tid, &had_errors);
+
+		if (had_errors)
+			rv = -1;
+	}
 
-	pthread_cond_destroy(&fs->as_cfg->cond);
-	pthread_mutex_destroy(&fs->as_cfg->mutex);
-	free(fs->as_cfg);
+	pthread_mutex_lock(&fs->ltlock);
 	fs->as_cfg = NULL;
+	pthread_mutex_unlock(&fs->ltlock);
+
+	pthread_cond_destroy(&cfg->cond);
+	pthread_mutex_destroy(&cfg->mutex);
+	free(cfg);
 
 	return rv;
 }
 
 /** Notify the autosync thread that it should check the number of bytes
- * written. Must be called with fs' ltlock held. */
+ * written, or that the lingering transactions limit has been reached. Must be
+ * called with fs' ltlock held. */
 void autosync_check(struct jfs *fs)
 {
-	if (fs->as_cfg == NULL)
+	struct autosync_cfg *cfg = fs->as_cfg;
+
+	if (cfg == NULL)
+		return;
+
+	if (fs->ltrans_len <= cfg->max_bytes && !linger_full(fs))
 		return;
 
-	if (fs->ltrans_len > fs->as_cfg->max_bytes)
-		pthread_cond_signal(&fs->as_cfg->cond);
+	if (!cfg->pooled) {
+		pthread_cond_signal(&cfg->cond);
+		return;
+	}
+
+	/* move it to the top of the heap, unless a worker is already on it or
+	 * it has already been moved */
+	pthread_mutex_lock(&pool.mutex);
+	if (cfg->heap_idx >= 0 && cfg->deadline.tv_sec != 0) {
+		cfg->deadline.tv_sec = 0;
+		cfg->deadline.tv_nsec = 0;
+		heap_fix(cfg->heap_idx);
+		pthread_cond_signal(&pool.cond);
+	}
+	pthread_mutex_unlock(&pool.mutex);
 }
 
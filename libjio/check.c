@@ -14,11 +14,712 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/mman.h>
+#include <pthread.h>
 
 #include "libjio.h"
 #include "common.h"
+#include "compat.h"
 #include "journal.h"
 #include "trans.h"
+#include "trace.h"
+
+
+/** Maximum number of threads used to replay transactions */
+#define MAX_REPLAY_THREADS 8
+
+/** Largest possible offset, used as the end of the ranges that go up to the
+ * end of the file */
+#define OFF_MAX ((off_t) (((uint64_t) 1 << (sizeof(off_t) * 8 - 1)) - 1))
+
+
+/*
+ * Replay scheduling
+ *
+ * Transactions that don't touch the same parts of the file can be replayed
+ * in any order, so we replay them in parallel. To do that, we build a
+ * dependency graph where each transaction depends on the previous ones (in
+ * id order) that overlap with it, and only replay a transaction after all
+ * its dependencies were replayed.
+ *
+ * To find the dependencies, we keep a map of which transaction was the last
+ * one to write each part of the file, and add the transactions in id order.
+ * This avoids building edges between every pair of overlapping transactions,
+ * as depending on the last writer of each region is enough.
+ *
+ * Undoing an append depends on the size of the file (see
+ * journal_undo_append()), so append intents claim everything from the old
+ * length of the file onwards, not just the appended range.
+ */
+
+/** A region of the file written by a transaction */
+struct range {
+	off_t offset;
+	size_t len;
+};
+
+/** A valid transaction waiting to be replayed */
+struct rtrans {
+	/** Transaction id */
+	unsigned int id;
+
+	/** File it belongs to, only known for transactions from shared
+	 * journals */
+	int has_ident;
+	uint64_t dev;
+	uint64_t ino;
+	char *path;
+
+	/** Descriptor of the file to replay it on */
+	int fd;
+
+	/** Is it an intent transaction? If so, what the intent was */
+	int has_intent;
+	struct journal_intent intent;
+
+	/** Regions of the file it writes to */
+	struct range *ranges;
+	unsigned int nranges;
+	unsigned int ranges_size;
+
+	/** Number of dependencies not yet replayed */
+	unsigned int ndeps;
+
+	/** Transactions that depend on this one (indexes in the array) */
+	unsigned int *dependents;
+	unsigned int ndependents;
+	unsigned int dependents_size;
+};
+
+/** A segment of the last writer map */
+struct segment {
+	off_t start;
+	off_t end;
+	unsigned int owner;
+};
+
+/** Map of the last transaction to write each part of the file, kept as a
+ * sorted array of non-overlapping segments */
+struct lwmap {
+	struct segment *segs;
+	unsigned int nsegs;
+	unsigned int size;
+};
+
+/** The replay work queue, shared by all the replay threads */
+struct replay_queue {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	struct jfs *fs;
+	struct rtrans *rts;
+
+	/** Transactions ready to be replayed; each transaction is added only
+	 * once, so it never needs more than one slot per transaction */
+	unsigned int *ready;
+	unsigned int ready_head;
+	unsigned int ready_tail;
+
+	/** Number of transactions not yet replayed */
+	unsigned int pending;
+
+	/** Number of transactions successfuly replayed */
+	unsigned int replayed;
+
+	/** Set if any replay failed, to stop the others */
+	int error;
+};
+
+/** Add a dependent to a transaction. Returns 0 on success, -1 on error. */
+static int add_dependent(struct rtrans *rt, unsigned int dependent)
+{
+	unsigned int newsize, *newdeps;
+
+	if (rt->ndependents == rt->dependents_size) {
+		newsize = rt->dependents_size ? rt->dependents_size * 2 : 4;
+		newdeps = realloc(rt->dependents,
+				newsize * sizeof(unsigned int));
+		if (newdeps == NULL)
+			return -1;
+		rt->dependents = newdeps;
+		rt->dependents_size = newsize;
+	}
+
+	rt->dependents[rt->ndependents] = dependent;
+	rt->ndependents++;
+	return 0;
+}
+
+/** Find the first segment that ends after the given offset */
+static unsigned int lwmap_find(struct lwmap *map, off_t offset)
+{
+	unsigned int lo = 0, hi = map->nsegs, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (map->segs[mid].end <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/** Record in the map that the transaction at index "owner" writes the given
+ * range, adding dependencies to the previous owners of it. "seen" is used to
+ * avoid adding the same dependency twice, and must hold owner + 1 for each
+ * transaction already added as a dependency of this owner. Returns 0 on
+ * success, -1 on error. */
+static int lwmap_add(struct lwmap *map, struct rtrans *rts, unsigned int *seen,
+		unsigned int owner, off_t start, off_t end)
+{
+	unsigned int first, last, nnew, newsize;
+	struct segment *newsegs, new[3];
+	struct segment *seg;
+
+	first = lwmap_find(map, start);
+
+	/* add the dependencies on the previous owners */
+	for (last = first; last < map->nsegs; last++) {
+		seg = &map->segs[last];
+		if (seg->start >= end)
+			break;
+
+		/* a transaction can write the same range more than once,
+		 * don't make it depend on itself */
+		if (seg->owner == owner || seen[seg->owner] == owner + 1)
+			continue;
+		seen[seg->owner] = owner + 1;
+
+		if (add_dependent(&rts[seg->owner], owner) != 0)
+			return -1;
+		rts[owner].ndeps++;
+	}
+
+	/* replace segments [first, last) with the remainders of the first
+	 * and last ones, and the new one */
+	nnew = 0;
+	if (first < last && map->segs[first].start < start) {
+		new[nnew] = map->segs[first];
+		new[nnew].end = start;
+		nnew++;
+	}
+
+	new[nnew].start = start;
+	new[nnew].end = end;
+	new[nnew].owner = owner;
+	nnew++;
+
+	if (first < last && map->segs[last - 1].end > end) {
+		new[nnew] = map->segs[last - 1];
+		new[nnew].start = end;
+		nnew++;
+	}
+
+	if (map->nsegs - (last - first) + nnew > map->size) {
+		newsize = map->size ? map->size * 2 : 64;
+		while (newsize < map->nsegs + nnew)
+			newsize *= 2;
+		newsegs = realloc(map->segs, newsize * sizeof(struct segment));
+		if (newsegs == NULL)
+			return -1;
+		map->segs = newsegs;
+		map->size = newsize;
+	}
+
+	memmove(map->segs + first + nnew, map->segs + last,
+			(map->nsegs - last) * sizeof(struct segment));
+	memcpy(map->segs + first, new, nnew * sizeof(struct segment));
+	map->nsegs = map->nsegs - (last - first) + nnew;
+
+	return 0;
+}
+
+/** Build the dependency graph of the given transactions, which must be
+ * grouped by file and in id order within each file. Returns 0 on success, -1
+ * on error. */
+static int build_deps(struct rtrans *rts, unsigned int nrts)
+{
+	int rv = -1;
+	unsigned int i, j, *seen;
+	struct lwmap map;
+	struct range *r;
+
+	map.segs = NULL;
+	map.nsegs = map.size = 0;
+
+	seen = calloc(nrts, sizeof(unsigned int));
+	if (seen == NULL)
+		return -1;
+
+	for (i = 0; i < nrts; i++) {
+		/* transactions on different files never depend on each
+		 * other */
+		if (i > 0 && rts[i].fd != rts[i - 1].fd)
+			map.nsegs = 0;
+
+		if (rts[i].has_intent &&
+				rts[i].intent.type == JOURNAL_INTENT_APPEND) {
+			if (lwmap_add(&map, rts, seen, i, rts[i].intent.oldlen,
+						OFF_MAX) != 0)
+				goto exit;
+			continue;
+		}
+
+		for (j = 0; j < rts[i].nranges; j++) {
+			r = &rts[i].ranges[j];
+			if (lwmap_add(&map, rts, seen, i, r->offset,
+						r->offset + r->len) != 0)
+				goto exit;
+		}
+	}
+
+	rv = 0;
+
+exit:
+	free(map.segs);
+	free(seen);
+	return rv;
+}
+
+/** Undo a replace that didn't complete (see jreplace() in trans.c) by
+ * removing its temporary file, if it's still there: the file was either
+ * already replaced, or left untouched. Returns 0 on success, -1 on error. */
+static int undo_replace(struct jfs *fs, struct rtrans *rt)
+{
+	char tmpname[PATH_MAX];
+
+	if (!get_jrfile(fs->name, rt->id, tmpname))
+		return -1;
+
+	if (unlink(tmpname) != 0 && errno != ENOENT)
+		return -1;
+
+	return 0;
+}
+
+/** Replay a single transaction by applying its operations directly from the
+ * transaction file, which is read using the given buffer as window. There is
+ * no need to journal them again nor to save the previous data, as the
+ * original transaction file is only removed after the data has been synced.
+ * Intent transactions are undone instead. Returns 0 on success, -1 on
+ * error. */
+static int replay_trans(struct jfs *fs, struct rtrans *rt, unsigned char *buf)
+{
+	int tfd, rv;
+	char tname[PATH_MAX];
+	size_t len, count;
+	off_t offset;
+	unsigned char *data;
+	struct journal_reader jr;
+
+	if (rt->has_intent && rt->intent.type == JOURNAL_INTENT_REPLACE)
+		return undo_replace(fs, rt);
+	else if (rt->has_intent)
+		return journal_undo_append(rt->fd, &(rt->intent));
+
+	get_jtfile(fs, rt->id, tname);
+	tfd = open(tname, O_RDONLY);
+	if (tfd < 0)
+		return -1;
+
+	rv = journal_reader_init(&jr, tfd, buf, JOURNAL_READ_WINDOW);
+	if (rv != 0)
+		goto exit;
+
+	while ((rv = journal_reader_next(&jr, &len, &offset)) == 1) {
+		trace3(fsck__replay__op, rt->id, offset, len);
+
+		/* big operations are copied inside the kernel if possible;
+		 * the checksum was already verified by scan_trans() */
+		if (have_copy_range && len >= COPY_RANGE_MIN &&
+				copy_range(tfd, journal_reader_tell(&jr),
+					rt->fd, offset, len) == len) {
+			journal_reader_skip(&jr);
+			continue;
+		}
+
+		for (;;) {
+			rv = journal_reader_data(&jr, &data, &count);
+			if (rv != 0)
+				goto exit;
+			if (count == 0)
+				break;
+
+			if (spwrite(rt->fd, data, count, offset) != count) {
+				rv = -1;
+				goto exit;
+			}
+			offset += count;
+		}
+	}
+	if (rv != 0)
+		goto exit;
+
+	rv = journal_reader_finish(&jr);
+
+exit:
+	close(tfd);
+	return rv == 0 ? 0 : -1;
+}
+
+/** Replay thread, takes transactions from the queue until there are no more
+ * left */
+static void *replay_thread(void *arg)
+{
+	int rv;
+	unsigned int i, idx;
+	struct replay_queue *q = arg;
+	struct rtrans *rt;
+	unsigned char *buf;
+	size_t bufsize;
+
+	buf = pool_get(&(q->fs->pool), JOURNAL_READ_WINDOW, &bufsize);
+
+	pthread_mutex_lock(&q->mutex);
+	if (buf == NULL) {
+		q->error = 1;
+		pthread_cond_broadcast(&q->cond);
+	}
+
+	for (;;) {
+		if (q->pending == 0 || q->error)
+			break;
+
+		if (q->ready_head == q->ready_tail) {
+			pthread_cond_wait(&q->cond, &q->mutex);
+			continue;
+		}
+
+		idx = q->ready[q->ready_head];
+		q->ready_head++;
+		rt = &q->rts[idx];
+		pthread_mutex_unlock(&q->mutex);
+
+		trace2(fsck__replay__start, rt->id,
+				rt->has_intent ? rt->intent.type : 0);
+		rv = replay_trans(q->fs, rt, buf);
+		trace2(fsck__replay__end, rt->id, rv);
+
+		pthread_mutex_lock(&q->mutex);
+		if (rv != 0) {
+			q->error = 1;
+			pthread_cond_broadcast(&q->cond);
+			break;
+		}
+
+		q->replayed++;
+		q->pending--;
+
+		for (i = 0; i < rt->ndependents; i++) {
+			if (--q->rts[rt->dependents[i]].ndeps == 0) {
+				q->ready[q->ready_tail] = rt->dependents[i];
+				q->ready_tail++;
+			}
+		}
+
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->mutex);
+
+	pool_put(&(q->fs->pool), buf, bufsize);
+	return NULL;
+}
+
+/** Replay the given transactions (which must be grouped by file and in id
+ * order within each file) in parallel, respecting their dependencies.
+ * Returns the number of transactions replayed on success, or -1 on error. */
+static int replay_all(struct jfs *fs, struct rtrans *rts, unsigned int nrts)
+{
+	int rv = -1;
+	unsigned int i, nthreads;
+	pthread_t threads[MAX_REPLAY_THREADS];
+	struct replay_queue q;
+
+	if (nrts == 0)
+		return 0;
+
+	if (build_deps(rts, nrts) != 0)
+		return -1;
+
+	q.ready = malloc(nrts * sizeof(unsigned int));
+	if (q.ready == NULL)
+		return -1;
+
+	pthread_mutex_init(&q.mutex, NULL);
+	pthread_cond_init(&q.cond, NULL);
+	q.fs = fs;
+	q.rts = rts;
+	q.ready_head = q.ready_tail = 0;
+	q.pending = nrts;
+	q.replayed = 0;
+	q.error = 0;
+
+	for (i = 0; i < nrts; i++) {
+		if (rts[i].ndeps == 0) {
+			q.ready[q.ready_tail] = i;
+			q.ready_tail++;
+		}
+	}
+
+	nthreads = nrts < MAX_REPLAY_THREADS ? nrts : MAX_REPLAY_THREADS;
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, &replay_thread, &q) != 0)
+			break;
+	}
+	nthreads = i;
+
+	/* if we couldn't create any thread, do the work ourselves */
+	if (nthreads == 0)
+		replay_thread(&q);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (!q.error)
+		rv = q.replayed;
+
+	pthread_mutex_destroy(&q.mutex);
+	pthread_cond_destroy(&q.cond);
+	free(q.ready);
+
+	return rv;
+}
+
+/** Free the contents of a struct rtrans */
+static void free_rtrans_contents(struct rtrans *rt)
+{
+	free(rt->ranges);
+	free(rt->dependents);
+	free(rt->path);
+}
+
+/** Free an array of struct rtrans */
+static void free_rtrans(struct rtrans *rts, unsigned int nrts)
+{
+	unsigned int i;
+
+	for (i = 0; i < nrts; i++)
+		free_rtrans_contents(&rts[i]);
+	free(rts);
+}
+
+/** Add a range to the ones written by the transaction. Returns 0 on success,
+ * -1 on error. */
+static int add_range(struct rtrans *rt, off_t offset, size_t len)
+{
+	unsigned int newsize;
+	struct range *newranges;
+
+	if (rt->nranges == rt->ranges_size) {
+		newsize = rt->ranges_size ? rt->ranges_size * 2 : 4;
+		newranges = realloc(rt->ranges, newsize * sizeof(struct range));
+		if (newranges == NULL)
+			return -1;
+		rt->ranges = newranges;
+		rt->ranges_size = newsize;
+	}
+
+	rt->ranges[rt->nranges].offset = offset;
+	rt->ranges[rt->nranges].len = len;
+	rt->nranges++;
+	return 0;
+}
+
+/** Verify a transaction file, and if it's valid add it to the array of
+ * transactions to replay. The file is read using the given buffer as window.
+ * Returns 0 on success, -1 if the transaction was broken, -2 if the checksums
+ * didn't match, -3 on I/O errors, -4 on memory errors. */
+static int scan_trans(int tfd, unsigned int id, unsigned char *buf,
+		struct rtrans **rts, unsigned int *nrts, unsigned int *size)
+{
+	int rv;
+	unsigned int newsize;
+	size_t len;
+	off_t offset;
+	struct rtrans *newrts, *rt;
+	struct journal_reader jr;
+
+	if (*nrts == *size) {
+		newsize = *size ? *size * 2 : 64;
+		newrts = realloc(*rts, newsize * sizeof(struct rtrans));
+		if (newrts == NULL)
+			return -4;
+		*rts = newrts;
+		*size = newsize;
+	}
+
+	rt = &(*rts)[*nrts];
+	rt->id = id;
+	rt->has_ident = 0;
+	rt->path = NULL;
+	rt->fd = -1;
+	rt->has_intent = 0;
+	rt->ranges = NULL;
+	rt->nranges = rt->ranges_size = 0;
+	rt->ndeps = 0;
+	rt->dependents = NULL;
+	rt->ndependents = rt->dependents_size = 0;
+
+	rv = journal_reader_init(&jr, tfd, buf, JOURNAL_READ_WINDOW);
+	if (rv != 0)
+		goto error;
+
+	if (jr.intent) {
+		/* appends cover from the old length of the file to the new
+		 * one; replaces don't write to the file at all, they rename
+		 * another one over it */
+		rv = journal_reader_intent(&jr, &rt->intent);
+		if (rv != 0)
+			goto error;
+		if (rt->intent.type == JOURNAL_INTENT_APPEND &&
+				rt->intent.newlen < rt->intent.oldlen) {
+			rv = -1;
+			goto error;
+		} else if (rt->intent.type != JOURNAL_INTENT_APPEND &&
+				rt->intent.type != JOURNAL_INTENT_REPLACE) {
+			rv = -1;
+			goto error;
+		}
+
+		rt->has_intent = 1;
+		if (rt->intent.type == JOURNAL_INTENT_APPEND &&
+				add_range(rt, rt->intent.oldlen,
+					rt->intent.newlen -
+					rt->intent.oldlen) != 0) {
+			rv = -4;
+			goto error;
+		}
+	} else {
+		while ((rv = journal_reader_next(&jr, &len, &offset)) == 1) {
+			if (add_range(rt, offset, len) != 0) {
+				rv = -4;
+				goto error;
+			}
+		}
+		if (rv != 0)
+			goto error;
+	}
+
+	rv = journal_reader_finish(&jr);
+	if (rv != 0)
+		goto error;
+
+	if (jr.has_ident) {
+		rt->has_ident = 1;
+		rt->dev = jr.dev;
+		rt->ino = jr.ino;
+		rt->path = strdup(jr.path);
+		if (rt->path == NULL) {
+			rv = -4;
+			goto error;
+		}
+	}
+
+	(*nrts)++;
+	return 0;
+
+error:
+	free(rt->ranges);
+	return rv;
+}
+
+/** Compare two transaction ids, for qsort() */
+static int tid_cmp(const void *a, const void *b)
+{
+	unsigned int ta = *(const unsigned int *) a;
+	unsigned int tb = *(const unsigned int *) b;
+
+	if (ta < tb)
+		return -1;
+	return ta > tb;
+}
+
+/** Compare two transactions by file and then by id, for qsort() */
+static int rtrans_cmp(const void *a, const void *b)
+{
+	const struct rtrans *ra = a, *rb = b;
+
+	if (ra->dev != rb->dev)
+		return ra->dev < rb->dev ? -1 : 1;
+	if (ra->ino != rb->ino)
+		return ra->ino < rb->ino ? -1 : 1;
+	return tid_cmp(&ra->id, &rb->id);
+}
+
+/** Check if the given transaction file belongs to a file other than the one
+ * with the given device and inode, looking only at its header. */
+static int is_foreign(int tfd, unsigned char *buf, uint64_t dev,
+		uint64_t ino)
+{
+	struct journal_reader jr;
+
+	if (journal_reader_init(&jr, tfd, buf, JOURNAL_READ_WINDOW) != 0)
+		return 0;
+
+	return jr.has_ident && (jr.dev != dev || jr.ino != ino);
+}
+
+/** Open the files the transactions (which must be sorted with rtrans_cmp())
+ * belong to, and set their fd. The transactions whose file can't be found are
+ * counted as invalid and removed from the array (but left in the journal).
+ * The opened descriptors are stored in *fds. Returns 0 on success, -1 on
+ * error. */
+static int open_files(struct rtrans *rts, unsigned int *nrts,
+		struct jfsck_result *res, int **fds, unsigned int *nfds)
+{
+	int fd;
+	unsigned int i, start, end, kept;
+	struct stat sinfo;
+
+	*fds = malloc(*nrts * sizeof(int));
+	if (*fds == NULL)
+		return -1;
+	*nfds = 0;
+
+	kept = 0;
+	for (start = 0; start < *nrts; start = end) {
+		for (end = start + 1; end < *nrts; end++) {
+			if (rts[end].dev != rts[start].dev ||
+					rts[end].ino != rts[start].ino)
+				break;
+		}
+
+		fd = open(rts[start].path, O_RDWR);
+		if (fd >= 0 && (fstat(fd, &sinfo) != 0 ||
+				sinfo.st_dev != rts[start].dev ||
+				sinfo.st_ino != rts[start].ino)) {
+			/* the path now points to a different file */
+			close(fd);
+			fd = -1;
+		}
+
+		/* see jfsck() about this lock */
+		if (fd >= 0 && plockf(fd, F_LOCKW, 0, 0) == -1) {
+			close(fd);
+			fd = -1;
+		}
+
+		if (fd < 0) {
+			res->invalid += end - start;
+			for (i = start; i < end; i++)
+				free_rtrans_contents(&rts[i]);
+			continue;
+		}
+
+		(*fds)[*nfds] = fd;
+		(*nfds)++;
+
+		for (i = start; i < end; i++) {
+			rts[i].fd = fd;
+			rts[kept] = rts[i];
+			kept++;
+		}
+	}
+
+	*nrts = kept;
+	return 0;
+}
 
 
 /** Remove the journal directory (if it's clean).
@@ -29,6 +730,7 @@
  */
 static int jfsck_cleanup(const char *name, const char *jdir)
 {
+	unsigned int i;
 	char tfile[PATH_MAX*3];
 	DIR *dir;
 	struct dirent *dent;
@@ -45,7 +747,8 @@ static int jfsck_cleanup(const char *name, const char *jdir)
 		/* We only care about files we know, and ignore everything
 		 * else. Note that transactions should have been removed by
 		 * jfsck(), we will not do it to prevent accidental misuse */
-		if (strcmp(dent->d_name, "lock"))
+		if (strcmp(dent->d_name, "lock") &&
+				strcmp(dent->d_name, "fanout"))
 			continue;
 
 		/* build the full path to the transaction file */
@@ -73,37 +776,110 @@ static int jfsck_cleanup(const char *name, const char *jdir)
 	if (closedir(dir) != 0)
 		return -1;
 
+	/* the subdirectories of the fan-out layout, if there are any */
+	for (i = 0; i < JOURNAL_FANOUT; i++) {
+		snprintf(tfile, PATH_MAX, "%s/%u", jdir, i);
+		if (rmdir(tfile) != 0 && errno != ENOENT)
+			return -1;
+	}
+
 	if (rmdir(jdir) != 0)
 		return -1;
 
 	return 0;
 }
 
-/* Check the journal and fix the incomplete transactions */
-enum jfsck_return jfsck(const char *name, const char *jdir,
+/** Add the ids of the transactions found in the given directory to the tids
+ * array, and update maxtid. Returns 0 on success, or a jfsck_return
+ * error. */
+static int collect_tids(const char *path, unsigned int **tids,
+		unsigned int *ntids, unsigned int *tids_size,
+		unsigned int *maxtid)
+{
+	int rv, ret;
+	unsigned int *newtids;
+	DIR *dir;
+	struct dirent *dent;
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		if (errno == ENOENT)
+			return J_ENOJOURNAL;
+		return J_EIO;
+	}
+
+	ret = 0;
+	for (errno = 0, dent = readdir(dir); dent != NULL;
+			errno = 0, dent = readdir(dir)) {
+		/* see if the file is named like a transaction, ignore
+		 * otherwise; as transactions are named as numbers > 0, a
+		 * simple atoi() is enough testing */
+		rv = atoi(dent->d_name);
+		if (rv <= 0)
+			continue;
+		if (rv > *maxtid)
+			*maxtid = rv;
+
+		if (*ntids == *tids_size) {
+			*tids_size = *tids_size ? *tids_size * 2 : 64;
+			newtids = realloc(*tids,
+					*tids_size * sizeof(unsigned int));
+			if (newtids == NULL) {
+				ret = J_ENOMEM;
+				goto exit;
+			}
+			*tids = newtids;
+		}
+		(*tids)[*ntids] = rv;
+		(*ntids)++;
+	}
+	if (errno)
+		ret = J_EIO;
+
+exit:
+	closedir(dir);
+	return ret;
+}
+
+/** Check the journal and fix the incomplete transactions. If name is NULL,
+ * jdir is a shared journal and the transactions of all the files in it are
+ * recovered; otherwise only the ones of the given file are. */
+static enum jfsck_return check_journal(const char *name, const char *jdir,
 		struct jfsck_result *res, unsigned int flags)
 {
-	int tfd, rv, i, ret;
-	unsigned int maxtid;
+	int tfd, rv, ret, *fds;
+	unsigned int i, maxtid, curtid;
+	unsigned int nrts, rts_size, ntids, tids_size, nfds;
+	unsigned int *tids, foreign;
+	uint64_t dev, ino;
+	struct rtrans *rt;
 	char jlockfile[PATH_MAX], tname[PATH_MAX], brokenname[PATH_MAX];
 	struct stat sinfo;
 	struct jfs fs;
-	struct jtrans *curts;
-	struct operation *tmpop;
-	DIR *dir;
-	struct dirent *dent;
-	unsigned char *map;
+	struct rtrans *rts;
+	unsigned char *buf;
+	size_t bufsize;
 	off_t filelen, lr;
 
 	tfd = -1;
-	filelen = 0;
-	dir = NULL;
 	fs.fd = -1;
 	fs.jfd = -1;
 	fs.jdir = NULL;
 	fs.jdirfd = -1;
 	fs.jmap = MAP_FAILED;
-	map = NULL;
+	fs.fanout = 0;
+	fs.flags = 0;
+	fs.shared = NULL;
+	pool_init(&(fs.pool));
+	fds = NULL;
+	nfds = 0;
+	foreign = 0;
+	dev = ino = 0;
+	buf = NULL;
+	tids = NULL;
+	ntids = tids_size = 0;
+	rts = NULL;
+	nrts = rts_size = 0;
 	ret = 0;
 
 	res->total = 0;
@@ -113,7 +889,13 @@ enum jfsck_return jfsck(const char *name, const char *jdir,
 	res->corrupt = 0;
 	res->reapplied = 0;
 
-	fs.fd = open(name, O_RDWR | O_SYNC);
+	fs.name = (char *) name;
+	if (name == NULL)
+		goto open_journal;
+
+	/* we don't use O_SYNC because the transactions are replayed directly
+	 * and synced all at once at the end */
+	fs.fd = open(name, O_RDWR);
 	if (fs.fd < 0) {
 		ret = J_EIO;
 		if (errno == ENOENT)
@@ -121,8 +903,6 @@ enum jfsck_return jfsck(const char *name, const char *jdir,
 		goto exit;
 	}
 
-	fs.name = (char *) name;
-
 	/* Locking the whole file protect us from concurrent runs, but it's
 	 * not to be trusted nor assumed (lingering transactions break it): it
 	 * just helps prevent some accidents. */
@@ -134,6 +914,15 @@ enum jfsck_return jfsck(const char *name, const char *jdir,
 		goto exit;
 	}
 
+	/* used to find our transactions if the journal is shared */
+	if (fstat(fs.fd, &sinfo) != 0) {
+		ret = J_EIO;
+		goto exit;
+	}
+	dev = sinfo.st_dev;
+	ino = sinfo.st_ino;
+
+open_journal:
 	if (jdir == NULL) {
 		fs.jdir = (char *) malloc(PATH_MAX);
 		if (fs.jdir == NULL) {
@@ -153,8 +942,12 @@ enum jfsck_return jfsck(const char *name, const char *jdir,
 		}
 	}
 
-	rv = lstat(fs.jdir, &sinfo);
-	if (rv < 0) {
+	rv = stat(fs.jdir, &sinfo);
+	if (rv < 0 && errno == ENOENT && jdir == NULL) {
+		/* the default journal directory is only created when the
+		 * file is first written to, so there is nothing to do */
+		goto exit;
+	} else if (rv < 0) {
 		ret = J_EIO;
 		if (errno == ENOENT)
 			ret = J_ENOJOURNAL;
@@ -192,42 +985,51 @@ enum jfsck_return jfsck(const char *name, const char *jdir,
 		goto exit;
 	}
 
-	dir = opendir(fs.jdir);
-	if (dir == NULL) {
-		ret = J_EIO;
-		if (errno == ENOENT)
-			ret = J_ENOJOURNAL;
-		goto exit;
-	}
+	/* collect the ids of the transactions in the journal directory (or
+	 * its subdirectories, if it uses the fan-out layout), and find the
+	 * greatest one */
+	snprintf(tname, PATH_MAX, "%s/fanout", fs.jdir);
+	fs.fanout = access(tname, F_OK) == 0;
 
-	/* find the greatest transaction number by looking into the journal
-	 * directory */
 	maxtid = 0;
-	for (errno = 0, dent = readdir(dir); dent != NULL;
-			errno = 0, dent = readdir(dir)) {
-		/* see if the file is named like a transaction, ignore
-		 * otherwise; as transactions are named as numbers > 0, a
-		 * simple atoi() is enough testing */
-		rv = atoi(dent->d_name);
-		if (rv <= 0)
-			continue;
-		if (rv > maxtid)
-			maxtid = rv;
+	if (!fs.fanout) {
+		ret = collect_tids(fs.jdir, &tids, &ntids, &tids_size,
+				&maxtid);
+		if (ret != 0)
+			goto exit;
 	}
-	if (errno) {
-		ret = J_EIO;
-		goto exit;
+	for (i = 0; fs.fanout && i < JOURNAL_FANOUT; i++) {
+		snprintf(tname, PATH_MAX, "%s/%u", fs.jdir, i);
+		ret = collect_tids(tname, &tids, &ntids, &tids_size, &maxtid);
+		if (ret == J_ENOJOURNAL)
+			ret = 0;
+		else if (ret != 0)
+			goto exit;
 	}
 
+	/* transactions must be processed in order (recovering them in a
+	 * different order as they were applied would result in corruption) */
+	qsort(tids, ntids, sizeof(unsigned int), tid_cmp);
+
 	/* rewrite the lockfile, writing the new maxtid on it, so that when we
-	 * rollback a transaction it doesn't step over existing ones */
+	 * rollback a transaction it doesn't step over existing ones; when
+	 * checking a single file of a shared journal, the other files may
+	 * still be using it, so we never lower the tid they rely on */
+	plockf(fs.jfd, F_LOCKW, 0, 0);
+	if (name != NULL && jdir != NULL) {
+		rv = spread(fs.jfd, &curtid, sizeof(curtid), 0);
+		if (rv == sizeof(curtid) && curtid > maxtid)
+			maxtid = curtid;
+	}
 	rv = spwrite(fs.jfd, &maxtid, sizeof(maxtid), 0);
+	plockf(fs.jfd, F_UNLOCK, 0, 0);
 	if (rv != sizeof(maxtid)) {
 		ret = J_ENOMEM;
 		goto exit;
 	}
 
-	/* remove the broken mark so we can call jtrans_commit() */
+	/* remove the broken mark, the journal will be consistent after we're
+	 * done */
 	snprintf(brokenname, PATH_MAX, "%s/broken", fs.jdir);
 	rv = access(brokenname, F_OK);
 	if (rv == 0) {
@@ -240,23 +1042,20 @@ enum jfsck_return jfsck(const char *name, const char *jdir,
 		goto exit;
 	}
 
-	/* verify (and possibly fix) all the transactions */
-	for (i = 1; i <= maxtid; i++) {
-		curts = jtrans_new(&fs, 0);
-		if (curts == NULL) {
-			ret = J_ENOMEM;
-			goto exit;
-		}
-
-		curts->id = i;
+	buf = pool_get(&(fs.pool), JOURNAL_READ_WINDOW, &bufsize);
+	if (buf == NULL) {
+		ret = J_ENOMEM;
+		goto exit;
+	}
 
-		/* open the transaction file, using i as its name, so we are
-		 * really looping in order (recovering transaction in a
-		 * different order as they were applied would result in
-		 * corruption) */
-		get_jtfile(&fs, i, tname);
+	/* verify all the transactions, and keep the valid ones to replay them
+	 * later */
+	for (i = 0; i < ntids; i++) {
+		get_jtfile(&fs, tids[i], tname);
 		tfd = open(tname, O_RDWR | O_SYNC, 0600);
 		if (tfd < 0) {
+			/* it could have been removed after we read the
+			 * directory */
 			if (errno == ENOENT) {
 				res->invalid++;
 				goto nounlink_loop;
@@ -267,9 +1066,16 @@ enum jfsck_return jfsck(const char *name, const char *jdir,
 		}
 
 		/* try to lock the transaction file, if it's locked then it is
-		 * currently being used so we skip it */
+		 * currently being used so we skip it; but if it belongs to
+		 * another file in a shared journal, we leave it alone */
 		lr = plockf(tfd, F_TLOCKW, 0, 0);
 		if (lr == -1) {
+			if (name != NULL && is_foreign(tfd, buf, dev, ino)) {
+				foreign++;
+				close(tfd);
+				tfd = -1;
+				continue;
+			}
 			res->in_progress++;
 			goto loop;
 		}
@@ -283,35 +1089,45 @@ enum jfsck_return jfsck(const char *name, const char *jdir,
 			goto exit;
 		}
 
-		/* no overflow problems because we know the transaction size
-		 * is limited to SSIZE_MAX */
-		map = mmap((void *) 0, filelen, PROT_READ, MAP_SHARED, tfd, 0);
-		if (map == MAP_FAILED) {
-			map = NULL;
-			ret = J_EIO;
-			goto exit;
-		}
-
-		rv = fill_trans(map, filelen, curts);
+		/* valid transactions are removed only after they have been
+		 * replayed */
+		rv = scan_trans(tfd, tids[i], buf, &rts, &nrts, &rts_size);
 		if (rv == -1) {
 			res->broken++;
 			goto loop;
 		} else if (rv == -2) {
 			res->corrupt++;
 			goto loop;
-		}
-
-		/* remove flags from the transaction, so we don't have issues
-		 * re-committing */
-		curts->flags = 0;
-
-		rv = jtrans_commit(curts);
-
-		if (rv < 0) {
+		} else if (rv == -3) {
 			ret = J_EIO;
 			goto exit;
+		} else if (rv == -4) {
+			ret = J_ENOMEM;
+			goto exit;
 		}
-		res->reapplied++;
+
+		rt = &rts[nrts - 1];
+		if (name != NULL && rt->has_ident &&
+				(rt->dev != dev || rt->ino != ino)) {
+			/* a transaction of another file in a shared
+			 * journal, leave it alone */
+			free_rtrans_contents(rt);
+			nrts--;
+			foreign++;
+			close(tfd);
+			tfd = -1;
+			continue;
+		} else if (name == NULL && !rt->has_ident) {
+			/* we can't know which file it belongs to */
+			free_rtrans_contents(rt);
+			nrts--;
+			foreign++;
+			res->invalid++;
+			goto nounlink_loop;
+		}
+
+		rt->fd = fs.fd;
+		goto nounlink_loop;
 
 loop:
 		if (unlink(tname) != 0) {
@@ -324,29 +1140,66 @@ nounlink_loop:
 			close(tfd);
 			tfd = -1;
 		}
-		if (map != NULL)
-			munmap(map, filelen);
 
-		while (curts->op != NULL) {
-			tmpop = curts->op->next;
-			if (curts->op->pdata)
-				free(curts->op->pdata);
-			free(curts->op);
-			curts->op = tmpop;
+		res->total++;
+	}
+
+	/* for shared journals, group the transactions by file and open them;
+	 * the ones we can't replay are left in the journal */
+	if (name == NULL) {
+		qsort(rts, nrts, sizeof(struct rtrans), rtrans_cmp);
+		i = nrts;
+		if (open_files(rts, &nrts, res, &fds, &nfds) != 0) {
+			ret = J_ENOMEM;
+			goto exit;
 		}
-		pthread_mutex_destroy(&(curts->lock));
-		free(curts);
+		foreign += i - nrts;
+	}
 
-		res->total++;
+	/* replay the valid transactions, and sync them all at once */
+	rv = replay_all(&fs, rts, nrts);
+	if (rv < 0) {
+		ret = J_EIO;
+		goto exit;
 	}
+	res->reapplied = rv;
 
+	if (fs.fd >= 0 && fdatasync(fs.fd) != 0) {
+		ret = J_EIO;
+		goto exit;
+	}
+	for (i = 0; i < nfds; i++) {
+		if (fdatasync(fds[i]) != 0) {
+			ret = J_EIO;
+			goto exit;
+		}
+	}
+
+	/* now that the data is safe, remove the original transactions */
+	for (i = 0; i < nrts; i++) {
+		get_jtfile(&fs, rts[i].id, tname);
+		if (unlink(tname) != 0) {
+			ret = J_EIO;
+			goto exit;
+		}
+	}
+
+	/* the journal can't be removed if there are transactions of other
+	 * files in it */
 	if (flags & J_CLEANUP) {
-		if (jfsck_cleanup(name, fs.jdir) < 0) {
+		if (foreign || jfsck_cleanup(name, fs.jdir) < 0) {
 			ret = J_ECLEANUP;
 		}
 	}
 
 exit:
+	if (tfd >= 0)
+		close(tfd);
+	if (buf != NULL)
+		pool_put(&(fs.pool), buf, bufsize);
+	pool_destroy(&(fs.pool));
+	if (tids != NULL)
+		free(tids);
 	if (fs.fd >= 0)
 		close(fs.fd);
 	if (fs.jfd >= 0)
@@ -355,11 +1208,32 @@ exit:
 		close(fs.jdirfd);
 	if (fs.jdir)
 		free(fs.jdir);
-	if (dir != NULL)
-		closedir(dir);
 	if (fs.jmap != MAP_FAILED)
 		munmap(fs.jmap, sizeof(unsigned int));
+	if (rts != NULL)
+		free_rtrans(rts, nrts);
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+	if (fds != NULL)
+		free(fds);
 
 	return ret;
 }
 
+/* Check the journal of a file and fix its incomplete transactions */
+enum jfsck_return jfsck(const char *name, const char *jdir,
+		struct jfsck_result *res, unsigned int flags)
+{
+	return check_journal(name, jdir, res, flags);
+}
+
+/* Check a shared journal and fix the incomplete transactions of all the
+ * files in it */
+enum jfsck_return jfsck_shared(const char *jdir, struct jfsck_result *res,
+		unsigned int flags)
+{
+	if (jdir == NULL)
+		return J_ENOJOURNAL;
+
+	return check_journal(NULL, jdir, res, flags);
+}
@@ -15,6 +15,7 @@
 
 #include "libjio.h"
 #include "common.h"
+#include "compat.h"
 
 
 /** Like lockf(), but lock always from the given offset */
@@ -142,6 +143,40 @@ ssize_t swritev(int fd, struct iovec *iov, int iovcnt)
 	return c;
 }
 
+/** Like pwritev() but either fails, or return a complete write. Unlike
+ * swritev(), iov is not modified. */
+ssize_t spwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	int i;
+	ssize_t rv;
+	size_t c, t, skip;
+
+	rv = vector_pwrite(fd, iov, iovcnt, offset);
+	if (rv < 0)
+		return rv;
+
+	/* incomplete write, finish it one element at a time */
+	c = rv;
+	t = 0;
+	for (i = 0; i < iovcnt; i++) {
+		if (t + iov[i].iov_len <= c) {
+			t += iov[i].iov_len;
+			continue;
+		}
+
+		skip = c > t ? c - t : 0;
+		rv = spwrite(fd, (char *) iov[i].iov_base + skip,
+				iov[i].iov_len - skip, offset + t + skip);
+		if (rv < 0)
+			return rv;
+
+		t += iov[i].iov_len;
+		c = t;
+	}
+
+	return t;
+}
+
 /** Store in jdir the default journal directory path of the given filename */
 int get_jdir(const char *filename, char *jdir)
 {
@@ -172,7 +207,27 @@ int get_jdir(const char *filename, char *jdir)
  * least PATH_MAX bytes. */
 void get_jtfile(struct jfs *fs, unsigned int tid, char *jtfile)
 {
-	snprintf(jtfile, PATH_MAX, "%s/%u", fs->jdir, tid);
+	if (fs->fanout)
+		snprintf(jtfile, PATH_MAX, "%s/%u/%u", fs->jdir,
+				tid % JOURNAL_FANOUT, tid);
+	else
+		snprintf(jtfile, PATH_MAX, "%s/%u", fs->jdir, tid);
+}
+
+
+/** Store in jrfile the path of the temporary file used by the given replace
+ * transaction (see jreplace()), which lives next to the file so it can be
+ * renamed over it. Assumes jrfile can hold at least PATH_MAX bytes. */
+int get_jrfile(const char *filename, unsigned int tid, char *jrfile)
+{
+	size_t len;
+
+	if (!get_jdir(filename, jrfile))
+		return 0;
+
+	len = strlen(jrfile);
+	snprintf(jrfile + len, PATH_MAX - len, "-replace.%u", tid);
+	return 1;
 }
 
 
@@ -10,6 +10,9 @@
 #include <stdint.h>	/* for uint*_t */
 #include <sys/uio.h>	/* for struct iovec */
 #include <pthread.h>	/* pthread_mutex_t */
+#include <time.h>	/* struct timespec */
+
+#include "libjio.h"	/* struct jstats */
 
 #include "fiu-local.h"	/* for fault injection functions */
 
@@ -27,6 +30,131 @@
 
 #define MAX_TSIZE	(SSIZE_MAX)
 
+/** Largest write operation, as its length is saved in 32 bits in the
+ * transaction file (see struct on_disk_ophdr) */
+#define MAX_OPSIZE	((size_t) UINT32_MAX)
+
+/** Operations closer than this are hinted to the kernel as a single range */
+#define READAHEAD_GAP	(64 * 1024)
+
+/** Data of up to this many bytes is kept inside the operation structure,
+ * along with its previous data */
+#ifndef OP_INLINE_SIZE
+#define OP_INLINE_SIZE	64
+#endif
+
+/** Operations of at least this many bytes are applied by copying their data
+ * from the transaction file, when the platform supports it (see
+ * copy_range()) */
+#ifndef COPY_RANGE_MIN
+#define COPY_RANGE_MIN	(64 * 1024)
+#endif
+
+/** Number of operations allocated at once */
+#define OP_CHUNK	16
+
+/** How many freed transactions are kept for reuse by each thread, and the
+ * most memory a single one of them can keep */
+#define TRANS_CACHE_SIZE	4
+#define TRANS_CACHE_MEM		(1024 * 1024)
+
+/** Buffer pool size classes go from 2^POOL_MIN_SHIFT to 2^POOL_MAX_SHIFT
+ * bytes; bigger buffers are not pooled */
+#define POOL_MIN_SHIFT	7
+#define POOL_MAX_SHIFT	24
+#define POOL_NCLASSES	(POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+
+/** Pooled buffers of at least this size are mmap()ed instead of malloc()ed,
+ * so they can be backed by huge pages */
+#define POOL_MMAP_SIZE	(2 * 1024 * 1024)
+
+/** Default maximum number of bytes kept by a buffer pool */
+#define POOL_DEFAULT_MAX	(16 * 1024 * 1024)
+
+/** Number of subdirectories used by journals with the fan-out layout */
+#define JOURNAL_FANOUT	256
+
+/** A journal shared between several files, see jopen_shared() */
+struct jshared {
+	/** Journal directory canonical path, which is what we use to find it,
+	 * as it can be reached through different paths */
+	char *jdir;
+
+	/** Journal directory file descriptor */
+	int jdirfd;
+
+	/** Journal's lock file descriptor */
+	int jfd;
+
+	/** Journal's lock file mmap */
+	unsigned int *jmap;
+
+	/** Protects the setup of the journal, and the fan-out subdirectory
+	 * descriptors */
+	pthread_mutex_t lock;
+
+	/** Serializes the access to jmap between threads */
+	pthread_mutex_t tidlock;
+
+	/** Are the transaction files spread over subdirectories? */
+	int fanout;
+
+	/** Fan-out subdirectory descriptors, opened as needed */
+	int *fanout_fds;
+
+	/** Number of files using it */
+	unsigned int refcount;
+
+	/** Next shared journal in the list */
+	struct jshared *next;
+};
+
+/** A pool of buffers, see pool.c */
+struct jpool {
+	/** Protects the whole structure */
+	pthread_mutex_t lock;
+
+	/** Free buffers of each size class, linked through their first word */
+	void *free[POOL_NCLASSES];
+
+	/** Max. number of bytes to keep */
+	size_t max_bytes;
+
+	/** Flags given to jfs_pool_config() */
+	unsigned int flags;
+
+	/** Statistics, see struct jpool_stats */
+	unsigned long long gets, hits, puts, drops, kept;
+	size_t kept_bytes;
+};
+
+/** Commit statistics, see stats.c */
+struct jstats_data {
+	/** Protects the statistics */
+	pthread_mutex_t lock;
+
+	/** The statistics themselves, as returned by jfs_stats() */
+	struct jstats st;
+};
+
+/** Statistics of a single commit, gathered without locking and then merged
+ * into the file's ones with stats_merge(), see stats.c */
+struct jstats_acc {
+	/** The file they belong to */
+	struct jfs *fs;
+
+	/** Whether they're being gathered at all, see J_NOSTATS */
+	int on;
+
+	/** Latency of each phase, in microseconds, and a mask of the phases
+	 * that were recorded */
+	unsigned long long usecs[J_STATS_PHASES];
+	unsigned int phases;
+
+	/** Counters, see struct jstats */
+	unsigned long long commits, ops, bytes_journaled, rollbacks;
+};
+
 /** The main file structure */
 struct jfs {
 	/** Real file fd */
@@ -47,26 +175,104 @@ struct jfs {
 	/** Journal's lock file mmap */
 	unsigned int *jmap;
 
+	/** Are the transaction files spread over subdirectories? Only valid
+	 * once the journal has been set up */
+	int fanout;
+
+	/** Fan-out subdirectory descriptors, opened as needed; unused if the
+	 * journal is shared, as they belong to it */
+	int *fanout_fds;
+
+	/** Protects the lazy setup of the journal, see journal_setup(), and
+	 * the fan-out subdirectory descriptors */
+	pthread_mutex_t jsetup_lock;
+
+	/** Serializes the access to jmap between threads, since the fcntl()
+	 * lock on jfd only protects us from other processes */
+	pthread_mutex_t tidlock;
+
+	/** Shared journal, or NULL if the file has its own */
+	struct jshared *shared;
+
+	/** Identity of the file, used to tag the transactions in a shared
+	 * journal: absolute path, device and inode */
+	char *shared_name;
+	dev_t dev;
+	ino_t ino;
+
 	/** Journal flags */
 	uint32_t flags;
 
 	/** Flags passed to the real open() */
 	uint32_t open_flags;
 
+	/** Size of the file as far as we know: it's updated by our own writes
+	 * and truncates, but not by anybody else's, so it's only used for
+	 * deciding which readahead hints are worth giving; see eof_hint_get()
+	 * and eof_hint_set() */
+	off_t eof_hint;
+
+	/** Protects eof_hint, which is updated by concurrent commits */
+	pthread_mutex_t eoflock;
+
 	/** Lingering transactions (linked list) */
 	struct jlinger *ltrans;
 
-	/** Length of all the lingered transactions */
+	/** Length of all the lingered transactions, including the ones
+	 * being committed, which reserve their room beforehand */
 	size_t ltrans_len;
 
+	/** Number of lingered transactions, counted the same way */
+	unsigned int ltrans_count;
+
+	/** Number of jsync() calls that failed, so the commits waiting for
+	 * one can tell, and the errno of the last one */
+	unsigned int ltrans_nerrors;
+	int ltrans_error;
+
+	/** Max. ltrans_len allowed before commits have to wait (0 means no
+	 * limit) */
+	size_t ltrans_max_len;
+
+	/** Max. ltrans_count allowed before commits have to wait (0 means no
+	 * limit) */
+	unsigned int ltrans_max_count;
+
+	/** Flags given to jfs_linger_limit() */
+	unsigned int ltrans_limit_flags;
+
+	/** How to sync the transaction files, see jfs_sync_mode() */
+	unsigned int sync_mode;
+
 	/** Lingering transactions' lock */
 	pthread_mutex_t ltlock;
 
+	/** Signalled (with ltlock) when lingering transactions are freed */
+	pthread_cond_t ltcond;
+
 	/** A soft lock used in some operations */
 	pthread_mutex_t lock;
 
 	/** Autosync config */
 	struct autosync_cfg *as_cfg;
+
+	/** Pool for the buffers of the transactions */
+	struct jpool pool;
+
+	/** Transactions created for the file and not freed yet, linked
+	 * through their prev and next fields, so jclose() can detach them */
+	struct jtrans *trans;
+
+	/** Transaction files of incremental transactions that were freed
+	 * without being committed, linked through their next field; they're
+	 * removed by jclose() */
+	struct journal_op *stale_jops;
+
+	/** Protects trans and stale_jops */
+	pthread_mutex_t translock;
+
+	/** Commit statistics */
+	struct jstats_data stats;
 };
 
 
@@ -74,14 +280,40 @@ off_t plockf(int fd, int cmd, off_t offset, off_t len);
 ssize_t spread(int fd, void *buf, size_t count, off_t offset);
 ssize_t spwrite(int fd, const void *buf, size_t count, off_t offset);
 ssize_t swritev(int fd, struct iovec *iov, int iovcnt);
+ssize_t spwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
 int get_jdir(const char *filename, char *jdir);
 void get_jtfile(struct jfs *fs, unsigned int tid, char *jtfile);
+int get_jrfile(const char *filename, unsigned int tid, char *jrfile);
 uint64_t ntohll(uint64_t x);
 uint64_t htonll(uint64_t x);
 
 uint32_t checksum_buf(uint32_t sum, const unsigned char *buf, size_t count);
 
+void pool_init(struct jpool *pool);
+void pool_destroy(struct jpool *pool);
+void *pool_get(struct jpool *pool, size_t size, size_t *realsize);
+void pool_put(struct jpool *pool, void *buf, size_t realsize);
+
+void stats_init(struct jstats_data *stats);
+void stats_destroy(struct jstats_data *stats);
+void stats_acc_init(struct jstats_acc *acc, struct jfs *fs,
+		unsigned int flags);
+void stats_start(struct jstats_acc *acc, enum jstats_phase phase,
+		struct timespec *start);
+void stats_phase(struct jstats_acc *acc, enum jstats_phase phase,
+		const struct timespec *start);
+void stats_commit(struct jstats_acc *acc, unsigned int ops);
+void stats_journaled(struct jstats_acc *acc, size_t bytes);
+void stats_rollback(struct jstats_acc *acc);
+void stats_add(struct jstats_acc *dst, struct jstats_acc *src);
+void stats_merge(struct jstats_acc *acc);
+
 void autosync_check(struct jfs *fs);
+int linger_full(struct jfs *fs);
+ssize_t jtrans_commit_single(struct jfs *fs, const struct iovec *iov,
+		int iovcnt, off_t offset);
+off_t eof_hint_get(struct jfs *fs);
+void eof_hint_set(struct jfs *fs, off_t eof, int raise_only);
 
 #endif
 
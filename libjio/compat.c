@@ -3,6 +3,10 @@
  * Compatibility functions
  */
 
+/* needed to get preadv(), pwritev(), pwritev2(), copy_file_range() and
+ * MAP_ANONYMOUS on Linux; see compat.h */
+#define _GNU_SOURCE
+
 #include "compat.h"
 #include <sys/types.h>		/* off_t, size_t */
 #include <unistd.h>		/* fdatasync(), if available */
@@ -59,6 +63,229 @@ int sync_range_wait(int fd, off_t offset, size_t nbytes)
 #endif
 
 
+/*
+ * preadv() and pwritev() support through an internal similar API
+ */
+
+#ifdef LACK_PREADV
+#warning "Using pread() and pwrite() instead of preadv() and pwritev()"
+
+ssize_t vector_pread(int fd, const struct iovec *iov, int iovcnt,
+		off_t offset)
+{
+	int i;
+	ssize_t rv;
+	size_t c = 0;
+
+	for (i = 0; i < iovcnt; i++) {
+		rv = pread(fd, iov[i].iov_base, iov[i].iov_len, offset + c);
+		if (rv < 0)
+			return c ? c : rv;
+
+		c += rv;
+		if (rv < iov[i].iov_len)
+			break;
+	}
+
+	return c;
+}
+
+ssize_t vector_pwrite(int fd, const struct iovec *iov, int iovcnt,
+		off_t offset)
+{
+	int i;
+	ssize_t rv;
+	size_t c = 0;
+
+	for (i = 0; i < iovcnt; i++) {
+		rv = pwrite(fd, iov[i].iov_base, iov[i].iov_len, offset + c);
+		if (rv < 0)
+			return c ? c : rv;
+
+		c += rv;
+		if (rv < iov[i].iov_len)
+			break;
+	}
+
+	return c;
+}
+
+#else
+
+/** Read into many buffers at the given offset, see preadv(2) */
+ssize_t vector_pread(int fd, const struct iovec *iov, int iovcnt,
+		off_t offset)
+{
+	return preadv(fd, iov, iovcnt, offset);
+}
+
+/** Write from many buffers at the given offset, see pwritev(2) */
+ssize_t vector_pwrite(int fd, const struct iovec *iov, int iovcnt,
+		off_t offset)
+{
+	return pwritev(fd, iov, iovcnt, offset);
+}
+
+#endif /* defined LACK_PREADV */
+
+
+/*
+ * Data-synchronous writes
+ */
+
+#include <errno.h>		/* errno */
+
+/** Write using the fallback, see dsync_writev() */
+static ssize_t writev_fdatasync(int fd, const struct iovec *iov, int iovcnt)
+{
+	ssize_t rv;
+
+	rv = writev(fd, iov, iovcnt);
+	if (rv < 0)
+		return rv;
+
+	if (fdatasync(fd) != 0)
+		return -1;
+
+	return rv;
+}
+
+#ifndef RWF_DSYNC
+#warning "Using writev() and fdatasync() instead of pwritev2(RWF_DSYNC)"
+const int have_dsync_writev = 0;
+
+ssize_t dsync_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	return writev_fdatasync(fd, iov, iovcnt);
+}
+
+#else
+
+/** Indicates whether we have a single-call implementation of dsync_writev(),
+ * so we can take advantage of it. */
+const int have_dsync_writev = 1;
+
+/** Write from many buffers at the current position, and sync the written
+ * data (like writev() followed by fdatasync(), but in one call, so the
+ * kernel can use FUA writes instead of a full cache flush) */
+ssize_t dsync_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	ssize_t rv;
+
+	/* an offset of -1 means the current position, like writev() */
+	rv = pwritev2(fd, iov, iovcnt, -1, RWF_DSYNC);
+	if (rv < 0 && (errno == ENOSYS || errno == EOPNOTSUPP))
+		return writev_fdatasync(fd, iov, iovcnt);
+
+	return rv;
+}
+
+#endif /* defined RWF_DSYNC */
+
+
+/*
+ * In-kernel copies between files
+ */
+
+#ifdef LACK_COPY_FILE_RANGE
+#warning "Not using copy_file_range()"
+const int have_copy_range = 0;
+
+ssize_t copy_range(int fd_in, off_t off_in, int fd_out, off_t off_out,
+		size_t len)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#else
+
+/** Indicates whether we have an implementation of copy_range(), so we can
+ * take advantage of it. */
+const int have_copy_range = 1;
+
+/** Copy len bytes from fd_in at off_in to fd_out at off_out without going
+ * through user space (and sharing the blocks, on filesystems that support
+ * it). Returns len on success, or -1 on error, which includes the cases
+ * where the kernel or the filesystems can't do it. */
+ssize_t copy_range(int fd_in, off_t off_in, int fd_out, off_t off_out,
+		size_t len)
+{
+	ssize_t rv;
+	size_t copied;
+	loff_t in, out;
+
+	in = off_in;
+	out = off_out;
+	copied = 0;
+	while (copied < len) {
+		rv = copy_file_range(fd_in, &in, fd_out, &out, len - copied,
+				0);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		else if (rv <= 0)
+			return -1;
+
+		copied += rv;
+	}
+
+	return len;
+}
+
+#endif /* defined LACK_COPY_FILE_RANGE */
+
+
+/*
+ * Anonymous memory allocation
+ */
+
+#include <stdlib.h>		/* malloc(), free() */
+#include <sys/mman.h>		/* mmap(), munmap(), madvise() */
+
+#ifndef MAP_ANONYMOUS
+#warning "Using malloc() instead of anonymous mmap()"
+
+void *anon_alloc(size_t size, int hugepages)
+{
+	return malloc(size);
+}
+
+void anon_free(void *buf, size_t size)
+{
+	free(buf);
+}
+
+#else
+
+/** Allocate a buffer directly from the kernel, asking for it to be backed by
+ * huge pages if possible. Returns NULL on error. */
+void *anon_alloc(size_t size, int hugepages)
+{
+	void *buf;
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		return NULL;
+
+#ifdef MADV_HUGEPAGE
+	/* it's just a hint, it doesn't matter if it fails */
+	if (hugepages)
+		madvise(buf, size, MADV_HUGEPAGE);
+#endif
+
+	return buf;
+}
+
+/** Release a buffer allocated by anon_alloc() */
+void anon_free(void *buf, size_t size)
+{
+	munmap(buf, size);
+}
+
+#endif /* defined MAP_ANONYMOUS */
+
+
 /*
  * Support for platforms where clock_gettime() is not available.
  */
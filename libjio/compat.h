@@ -41,6 +41,8 @@ int sync_range_wait(int fd, off_t offset, size_t nbytes);
 #ifndef POSIX_FADV_WILLNEED
 #define LACK_POSIX_FADVISE 1
 #define POSIX_FADV_WILLNEED 0
+#define POSIX_FADV_SEQUENTIAL 0
+#define POSIX_FADV_DONTNEED 0
 #define posix_fadvise(fd, offset, len, advise)
 #endif
 
@@ -54,6 +56,70 @@ int fdatasync(int fd);
 #endif
 
 
+/* preadv() and pwritev() are not standard, but Linux and the BSDs have them.
+ * We provide an internal similar API, implemented in compat.c, which uses
+ * them if available or does a pread()/pwrite() per element otherwise. Note
+ * that the fallback is not atomic with regards to other readers and
+ * writers, but we always call them with the range locked. */
+#if ! ( (defined __linux__) || (defined __FreeBSD__) || \
+		(defined __NetBSD__) || (defined __OpenBSD__) || \
+		(defined __DragonFly__) )
+#define LACK_PREADV 1
+#endif
+
+#include <sys/uio.h>		/* struct iovec */
+ssize_t vector_pread(int fd, const struct iovec *iov, int iovcnt,
+		off_t offset);
+ssize_t vector_pwrite(int fd, const struct iovec *iov, int iovcnt,
+		off_t offset);
+
+/* IOV_MAX is in limits.h since SUSv2, but some platforms only define it with
+ * other names, or not at all; 16 is the minimum SUSv2 allows. */
+#include <limits.h>
+#ifndef IOV_MAX
+#ifdef UIO_MAXIOV
+#define IOV_MAX UIO_MAXIOV
+#else
+#define IOV_MAX 16
+#endif
+#endif
+
+
+/* Writing and syncing the data in a single call, with pwritev2() and
+ * RWF_DSYNC, is linux-specific, so we provide an internal similar API, with a
+ * constant to be able to check for its presence; the implementation is in
+ * compat.c, and falls back to writev() + fdatasync().
+ *
+ * O_DSYNC is SUSv3 but it's optional, so we use O_SYNC if it's missing. */
+extern const int have_dsync_writev;
+ssize_t dsync_writev(int fd, const struct iovec *iov, int iovcnt);
+
+#ifndef O_DSYNC
+#define O_DSYNC O_SYNC
+#endif
+
+
+/* copy_file_range() is linux-specific (and only in glibc >= 2.27), so we
+ * provide an internal similar API, with a constant to be able to check for its
+ * presence; the implementation is in compat.c. There is no fallback, as the
+ * callers already have the data at hand and can write it themselves. */
+#if ! ( (defined __linux__) && (defined __GLIBC__) && \
+		(__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27)) )
+#define LACK_COPY_FILE_RANGE 1
+#endif
+
+extern const int have_copy_range;
+ssize_t copy_range(int fd_in, off_t off_in, int fd_out, off_t off_out,
+		size_t len);
+
+
+/* Anonymous mmap()s (MAP_ANONYMOUS) and madvise(MADV_HUGEPAGE) are not
+ * standard, so we provide an internal API to allocate large buffers, in
+ * compat.c, which uses them if available or malloc() otherwise. */
+void *anon_alloc(size_t size, int hugepages);
+void anon_free(void *buf, size_t size);
+
+
 /* Some platforms do not have clock_gettime() so we define an alternative for
  * them, in compat.c. We should check for _POSIX_TIMERS, but some platforms do
  * not have it yet they do have clock_gettime() (DragonflyBSD), so we just
@@ -65,5 +131,10 @@ int fdatasync(int fd);
 int clock_gettime(int clk_id, struct timespec *tp);
 #endif
 
+/* The monotonic clock is optional, fall back to the real time one */
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC CLOCK_REALTIME
+#endif
+
 #endif
 
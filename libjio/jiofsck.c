@@ -13,18 +13,21 @@ static void usage(void)
 {
 	printf("\
 Use: jiofsck [clean=1] [dir=DIR] FILE\n\
+     jiofsck [clean=1] dir=DIR\n\
 \n\
 Where \"FILE\" is the name of the file you want to check the journal from,\n\
 and the optional parameter \"clean\" makes jiofsck to clean up the journal\n\
 after recovery.\n\
 The parameter \"dir=DIR\", also optional, is used to indicate the position\n\
-of the journal directory.\n\
+of the journal directory. If no file is given, DIR is taken as a shared\n\
+journal, and the files of all its transactions are checked.\n\
 \n\
 Examples:\n\
 # jiofsck file\n\
 # jiofsck clean=1 file\n\
 # jiofsck dir=/tmp/journal file\n\
 # jiofsck clean=1 dir=/tmp/journal file\n\
+# jiofsck dir=/tmp/shared_journal\n\
 \n");
 }
 
@@ -56,6 +59,11 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (file == NULL && jdir == NULL) {
+		usage();
+		return 1;
+	}
+
 	memset(&res, 0, sizeof(res));
 
 	flags = 0;
@@ -64,7 +72,10 @@ int main(int argc, char **argv)
 
 	printf("Checking journal: ");
 	fflush(stdout);
-	rv = jfsck(file, jdir, &res, flags);
+	if (file == NULL)
+		rv = jfsck_shared(jdir, &res, flags);
+	else
+		rv = jfsck(file, jdir, &res, flags);
 
 	switch (rv) {
 	case J_ESUCCESS:
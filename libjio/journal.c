@@ -4,7 +4,8 @@
  */
 
 #include <sys/types.h>		/* [s]size_t */
-#include <sys/stat.h>		/* open() */
+#include <sys/stat.h>		/* open(), mkdir(), stat() */
+#include <sys/mman.h>		/* mmap() */
 #include <fcntl.h>		/* open() */
 #include <unistd.h>		/* f[data]sync(), close() */
 #include <stdlib.h>		/* malloc() and friends */
@@ -21,6 +22,7 @@
 #include "compat.h"
 #include "journal.h"
 #include "trans.h"
+#include "trace.h"
 
 
 /*
@@ -42,6 +44,18 @@
  *
  * The details of each part can be seen on the following structures. All
  * integers are stored in network byte order.
+ *
+ * Transactions of files using a shared journal (see jopen_shared()) have
+ * version 2 headers, which are followed by the identity of the file: its
+ * device, its inode, and its absolute path (without the trailing 0). That way
+ * jfsck() can tell which file each transaction belongs to.
+ *
+ * Intent transactions, which record what is about to be done to the file
+ * instead of the data to write (see journal_add_intent()), have version 3
+ * headers, or version 4 if they have the identity of the file. They have a
+ * single operation whose data is the intent. Older versions of the library
+ * see them as broken, which is better than replaying them as regular
+ * transactions.
  */
 
 /** Transaction file header */
@@ -51,12 +65,26 @@ struct on_disk_hdr {
 	uint32_t trans_id;
 } __attribute__((packed));
 
+/** Transaction file identity, only present in version 2 headers */
+struct on_disk_ident {
+	uint64_t dev;
+	uint64_t ino;
+	uint32_t pathlen;
+} __attribute__((packed));
+
 /** Transaction file operation header */
 struct on_disk_ophdr {
 	uint32_t len;
 	uint64_t offset;
 } __attribute__((packed));
 
+/** Intent, the data of the only operation of an intent transaction */
+struct on_disk_intent {
+	uint32_t type;
+	uint64_t oldlen;
+	uint64_t newlen;
+} __attribute__((packed));
+
 /** Transaction file trailer */
 struct on_disk_trailer {
 	uint32_t numops;
@@ -80,6 +108,20 @@ static void hdr_ntoh(struct on_disk_hdr *hdr)
 	hdr->trans_id = ntohl(hdr->trans_id);
 }
 
+static void ident_hton(struct on_disk_ident *ident)
+{
+	ident->dev = htonll(ident->dev);
+	ident->ino = htonll(ident->ino);
+	ident->pathlen = htonl(ident->pathlen);
+}
+
+static void ident_ntoh(struct on_disk_ident *ident)
+{
+	ident->dev = ntohll(ident->dev);
+	ident->ino = ntohll(ident->ino);
+	ident->pathlen = ntohl(ident->pathlen);
+}
+
 static void ophdr_hton(struct on_disk_ophdr *ophdr)
 {
 	ophdr->len = htonl(ophdr->len);
@@ -92,6 +134,20 @@ static void ophdr_ntoh(struct on_disk_ophdr *ophdr)
 	ophdr->offset = ntohll(ophdr->offset);
 }
 
+static void intent_hton(struct on_disk_intent *intent)
+{
+	intent->type = htonl(intent->type);
+	intent->oldlen = htonll(intent->oldlen);
+	intent->newlen = htonll(intent->newlen);
+}
+
+static void intent_ntoh(struct on_disk_intent *intent)
+{
+	intent->type = ntohl(intent->type);
+	intent->oldlen = ntohll(intent->oldlen);
+	intent->newlen = ntohll(intent->newlen);
+}
+
 static void trailer_hton(struct on_disk_trailer *trailer) {
 	trailer->numops = htonl(trailer->numops);
 	trailer->checksum = htonl(trailer->checksum);
@@ -107,12 +163,21 @@ static void trailer_ntoh(struct on_disk_trailer *trailer) {
  * Helper functions
  */
 
+/** Get the mutex that serializes the access to the lock file */
+static pthread_mutex_t *tidlock(struct jfs *fs)
+{
+	if (fs->shared)
+		return &(fs->shared->tidlock);
+	return &(fs->tidlock);
+}
+
 /** Get a new transaction id */
 static unsigned int get_tid(struct jfs *fs)
 {
 	unsigned int curid, rv;
 
 	/* lock the whole file */
+	pthread_mutex_lock(tidlock(fs));
 	plockf(fs->jfd, F_LOCKW, 0, 0);
 
 	/* read the current max. curid */
@@ -130,6 +195,7 @@ static unsigned int get_tid(struct jfs *fs)
 
 exit:
 	plockf(fs->jfd, F_UNLOCK, 0, 0);
+	pthread_mutex_unlock(tidlock(fs));
 	return rv;
 }
 
@@ -140,6 +206,7 @@ static void free_tid(struct jfs *fs, unsigned int tid)
 	char name[PATH_MAX];
 
 	/* lock the whole file */
+	pthread_mutex_lock(tidlock(fs));
 	plockf(fs->jfd, F_LOCKW, 0, 0);
 
 	/* read the current max. curid */
@@ -166,6 +233,7 @@ static void free_tid(struct jfs *fs, unsigned int tid)
 	}
 
 	plockf(fs->jfd, F_UNLOCK, 0, 0);
+	pthread_mutex_unlock(tidlock(fs));
 	return;
 }
 
@@ -250,21 +318,403 @@ static int is_broken(struct jfs *fs)
 	return access(broken_path, F_OK) == 0;
 }
 
+/** Check if the journal has transactions pending, either because the lock
+ * file records one that was not freed (it may be in progress, or left over by
+ * a crash), or because it's marked as broken. The journal must exist but
+ * doesn't need to be set up. */
+int journal_pending(struct jfs *fs)
+{
+	int fd;
+	ssize_t rv;
+	unsigned int maxtid;
+	char jlockfile[PATH_MAX];
+
+	if (is_broken(fs))
+		return 1;
+
+	snprintf(jlockfile, PATH_MAX, "%s/lock", fs->jdir);
+	fd = open(jlockfile, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	rv = spread(fd, &maxtid, sizeof(maxtid), 0);
+	close(fd);
+
+	return rv == sizeof(maxtid) && maxtid != 0;
+}
+
+
+/** Create the subdirectories and the marker of the fan-out layout. Returns
+ * 0 on success, -1 on error. */
+static int create_fanout(const char *jdir, int dirfd)
+{
+	int fd;
+	unsigned int i;
+	char path[PATH_MAX];
+
+	for (i = 0; i < JOURNAL_FANOUT; i++) {
+		snprintf(path, PATH_MAX, "%s/%u", jdir, i);
+		if (mkdir(path, 0750) != 0 && errno != EEXIST)
+			return -1;
+	}
+
+	/* the marker goes last, so the layout is never detected until all
+	 * the subdirectories are there */
+	snprintf(path, PATH_MAX, "%s/fanout", jdir);
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0)
+		return -1;
+	close(fd);
+
+	return fsync_dir(dirfd);
+}
+
+/** Create the journal directory if needed, and open it and its lock file.
+ * When the journal is new, want_fanout decides its layout; otherwise the
+ * existing one is detected. The results are only stored on success. Returns
+ * 0 on success, -1 on error. */
+static int open_journal(const char *jdir, int want_fanout, int *jdirfdp,
+		int *jfdp, unsigned int **jmapp, int *fanoutp)
+{
+	int rv, dirfd, jfd, fanout;
+	unsigned int t;
+	char jlockfile[PATH_MAX];
+	struct stat sinfo;
+	unsigned int *jmap;
+
+	dirfd = jfd = -1;
+	rv = -1;
+
+	mkdir(jdir, 0750);
+	if (stat(jdir, &sinfo) < 0 || !S_ISDIR(sinfo.st_mode))
+		goto exit;
+
+	/* open the directory, we will use it to flush transaction files'
+	 * metadata in journal_commit() */
+	dirfd = open(jdir, O_RDONLY);
+	if (dirfd < 0)
+		goto exit;
+
+	snprintf(jlockfile, PATH_MAX, "%s/lock", jdir);
+	jfd = open(jlockfile, O_RDWR | O_CREAT, 0600);
+	if (jfd < 0)
+		goto exit;
+
+	/* initialize the lock file by writing the first tid to it, but only
+	 * if its empty, otherwise there is a race if two processes set up the
+	 * journal simultaneously and both initialize the file */
+	plockf(jfd, F_LOCKW, 0, 0);
+	if (fstat(jfd, &sinfo) != 0) {
+		plockf(jfd, F_UNLOCK, 0, 0);
+		goto exit;
+	}
+	if (sinfo.st_size != sizeof(unsigned int)) {
+		t = 0;
+		if ((want_fanout && create_fanout(jdir, dirfd) != 0) ||
+				spwrite(jfd, &t, sizeof(t), 0) != sizeof(t)) {
+			plockf(jfd, F_UNLOCK, 0, 0);
+			goto exit;
+		}
+	}
+	plockf(jfd, F_UNLOCK, 0, 0);
+
+	snprintf(jlockfile, PATH_MAX, "%s/fanout", jdir);
+	fanout = access(jlockfile, F_OK) == 0;
+
+	jmap = (unsigned int *) mmap(NULL, sizeof(unsigned int),
+			PROT_READ | PROT_WRITE, MAP_SHARED, jfd, 0);
+	if (jmap == MAP_FAILED)
+		goto exit;
+
+	*jdirfdp = dirfd;
+	*jfdp = jfd;
+	*jmapp = jmap;
+	*fanoutp = fanout;
+	rv = 0;
+
+exit:
+	if (rv != 0) {
+		if (jfd >= 0)
+			close(jfd);
+		if (dirfd >= 0)
+			close(dirfd);
+	}
+	return rv;
+}
+
+/** Set up the journal of the file, if it wasn't already: create the journal
+ * directory, and open it and the lock file. It's done on the first
+ * transaction instead of in jopen(), so files that are only read don't pay
+ * for it. Returns 0 on success, -1 on error. */
+int journal_setup(struct jfs *fs)
+{
+	int rv = 0;
+	struct jshared *sh = fs->shared;
+
+	pthread_mutex_lock(&(fs->jsetup_lock));
+	if (fs->jmap != MAP_FAILED)
+		goto exit;
+
+	if (sh == NULL) {
+		rv = open_journal(fs->jdir, fs->flags & J_FANOUT,
+				&(fs->jdirfd), &(fs->jfd), &(fs->jmap),
+				&(fs->fanout));
+		goto exit;
+	}
+
+	/* shared journals are set up only once, by the first file that
+	 * needs it */
+	pthread_mutex_lock(&(sh->lock));
+	if (sh->jmap == MAP_FAILED)
+		rv = open_journal(sh->jdir, fs->flags & J_FANOUT,
+				&(sh->jdirfd), &(sh->jfd), &(sh->jmap),
+				&(sh->fanout));
+	pthread_mutex_unlock(&(sh->lock));
+
+	if (rv == 0) {
+		fs->jdirfd = sh->jdirfd;
+		fs->jfd = sh->jfd;
+		fs->fanout = sh->fanout;
+		fs->jmap = sh->jmap;
+	}
+
+exit:
+	pthread_mutex_unlock(&(fs->jsetup_lock));
+	return rv;
+}
+
+
+/** Get the descriptor of the fan-out subdirectory that holds the given
+ * transaction. They're opened the first time they're needed and kept until
+ * the journal is closed, so they're shared with the other files if the
+ * journal is. Returns -1 on error. */
+static int fanout_dirfd(struct jfs *fs, unsigned int id)
+{
+	int fd, **fdsp;
+	unsigned int i, n;
+	char dname[PATH_MAX];
+	pthread_mutex_t *lock;
+
+	if (fs->shared) {
+		lock = &(fs->shared->lock);
+		fdsp = &(fs->shared->fanout_fds);
+	} else {
+		lock = &(fs->jsetup_lock);
+		fdsp = &(fs->fanout_fds);
+	}
+
+	n = id % JOURNAL_FANOUT;
+	fd = -1;
+
+	pthread_mutex_lock(lock);
+	if (*fdsp == NULL) {
+		*fdsp = malloc(JOURNAL_FANOUT * sizeof(int));
+		if (*fdsp == NULL)
+			goto exit;
+		for (i = 0; i < JOURNAL_FANOUT; i++)
+			(*fdsp)[i] = -1;
+	}
+
+	fd = (*fdsp)[n];
+	if (fd < 0) {
+		snprintf(dname, PATH_MAX, "%s/%u", fs->jdir, n);
+		fd = open(dname, O_RDONLY);
+		(*fdsp)[n] = fd;
+	}
+
+exit:
+	pthread_mutex_unlock(lock);
+	return fd;
+}
+
+/** Close the fan-out subdirectory descriptors opened by fanout_dirfd(), and
+ * free the array that holds them, which can be NULL. Returns 0 on success,
+ * -1 on error. */
+int journal_close_fanout(int *fds)
+{
+	int rv = 0;
+	unsigned int i;
+
+	if (fds == NULL)
+		return 0;
+
+	for (i = 0; i < JOURNAL_FANOUT; i++) {
+		if (fds[i] >= 0 && close(fds[i]))
+			rv = -1;
+	}
+	free(fds);
+
+	return rv;
+}
+
+
+/*
+ * Shared journals
+ *
+ * Files opened with jopen_shared() using the same journal directory share a
+ * single struct jshared, and so the directory and lock file descriptors, and
+ * the transaction id space. They are kept in a list, and freed when the last
+ * file using them is closed.
+ */
+
+static struct jshared *shared_list = NULL;
+static pthread_mutex_t shared_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Get the canonical path of the journal directory jdir into path, which must
+ * be PATH_MAX long. The directory doesn't need to exist yet, but its parent
+ * does. Returns 0 on success, -1 on error. */
+static int canonical_jdir(const char *jdir, char *path)
+{
+	size_t len;
+	char tmp[PATH_MAX], parent[PATH_MAX];
+	char *dir, *base;
+
+	if (realpath(jdir, path) != NULL)
+		return 0;
+	if (errno != ENOENT)
+		return -1;
+
+	/* it doesn't exist yet, so we resolve its parent instead */
+	len = strlen(jdir);
+	if (len == 0 || len >= PATH_MAX)
+		return -1;
+	strcpy(tmp, jdir);
+	while (len > 1 && tmp[len - 1] == '/')
+		tmp[--len] = '\0';
+
+	base = strrchr(tmp, '/');
+	if (base == NULL) {
+		dir = ".";
+		base = tmp;
+	} else if (base == tmp) {
+		dir = "/";
+		base++;
+	} else {
+		*base = '\0';
+		dir = tmp;
+		base++;
+	}
+
+	if (realpath(dir, parent) == NULL)
+		return -1;
+
+	if (snprintf(path, PATH_MAX, "%s/%s",
+			strcmp(parent, "/") == 0 ? "" : parent, base)
+			>= PATH_MAX)
+		return -1;
+
+	return 0;
+}
+
+/** Get the shared journal for the given directory, creating it if needed.
+ * The directory itself is created by journal_setup(), on the first
+ * transaction. Returns NULL on error. */
+struct jshared *jshared_get(const char *jdir)
+{
+	struct jshared *sh;
+	char path[PATH_MAX];
+
+	/* the same directory can be given with different paths (relative,
+	 * with a trailing slash, through a symlink), and if we didn't notice
+	 * they would have separate transaction id locks, so we find them by
+	 * their canonical path */
+	if (canonical_jdir(jdir, path) != 0)
+		return NULL;
+
+	pthread_mutex_lock(&shared_list_lock);
+
+	for (sh = shared_list; sh != NULL; sh = sh->next) {
+		if (strcmp(sh->jdir, path) == 0) {
+			sh->refcount++;
+			goto exit;
+		}
+	}
+
+	sh = malloc(sizeof(struct jshared));
+	if (sh == NULL)
+		goto exit;
+
+	sh->jdir = strdup(path);
+	if (sh->jdir == NULL) {
+		free(sh);
+		sh = NULL;
+		goto exit;
+	}
+
+	sh->jdirfd = -1;
+	sh->jfd = -1;
+	sh->jmap = MAP_FAILED;
+	sh->fanout_fds = NULL;
+	pthread_mutex_init(&(sh->lock), NULL);
+	pthread_mutex_init(&(sh->tidlock), NULL);
+	sh->refcount = 1;
+
+	sh->next = shared_list;
+	shared_list = sh;
+
+exit:
+	pthread_mutex_unlock(&shared_list_lock);
+	return sh;
+}
+
+/** Release a shared journal obtained with jshared_get(), freeing it if it's
+ * not used anymore. Returns 0 on success, -1 on error. */
+int jshared_put(struct jshared *sh)
+{
+	int rv = 0;
+	struct jshared **prev;
+
+	pthread_mutex_lock(&shared_list_lock);
+
+	sh->refcount--;
+	if (sh->refcount > 0)
+		goto exit;
+
+	for (prev = &shared_list; *prev != sh; prev = &((*prev)->next))
+		;
+	*prev = sh->next;
+
+	if (sh->jfd >= 0 && close(sh->jfd))
+		rv = -1;
+	if (sh->jdirfd >= 0 && close(sh->jdirfd))
+		rv = -1;
+	if (journal_close_fanout(sh->fanout_fds))
+		rv = -1;
+	if (sh->jmap != MAP_FAILED)
+		munmap(sh->jmap, sizeof(unsigned int));
+
+	pthread_mutex_destroy(&(sh->lock));
+	pthread_mutex_destroy(&(sh->tidlock));
+	free(sh->jdir);
+	free(sh);
+
+exit:
+	pthread_mutex_unlock(&shared_list_lock);
+	return rv;
+}
+
 
 /*
  * Journal functions
  */
 
-/** Create a new transaction in the journal. Returns a pointer to an opaque
+/** Create a new transaction in the journal; if intent is set, it will be an
+ * intent transaction, see journal_add_intent(). Returns a pointer to an opaque
  * jop_t (that is freed using journal_free), or NULL if there was an error. */
-struct journal_op *journal_new(struct jfs *fs, unsigned int flags)
+struct journal_op *journal_new(struct jfs *fs, unsigned int flags, int intent)
 {
-	int fd, id;
+	int fd, dirfd, id, i, iovcnt, oflags;
 	ssize_t rv;
+	size_t hlen;
 	char *name = NULL;
 	struct journal_op *jop = NULL;
 	struct on_disk_hdr hdr;
-	struct iovec iov[1];
+	struct on_disk_ident ident;
+	struct iovec iov[3];
+	struct timespec start;
+
+	if (journal_setup(fs) != 0)
+		goto error;
 
 	if (is_broken(fs))
 		goto error;
@@ -277,52 +727,107 @@ struct journal_op *journal_new(struct jfs *fs, unsigned int flags)
 	if (name == NULL)
 		goto error;
 
+	stats_acc_init(&(jop->stats), fs, flags);
+
+	stats_start(&(jop->stats), J_PHASE_TID, &start);
 	id = get_tid(fs);
 	if (id == 0)
 		goto error;
-
-	/* open the transaction file */
+	stats_phase(&(jop->stats), J_PHASE_TID, &start);
+
+	/* with J_SYNC_DSYNC the last write syncs the file, see
+	 * journal_commit(); if we can't do that in a single call, every write
+	 * is synchronous instead */
+	jop->dsync = fs->sync_mode == J_SYNC_DSYNC;
+	oflags = O_RDWR | O_CREAT | O_TRUNC;
+	if (jop->dsync && !have_dsync_writev)
+		oflags |= O_DSYNC;
+
+	/* open the transaction file, and the directory that holds it, which
+	 * is the journal directory itself unless we use the fan-out layout */
 	get_jtfile(fs, id, name);
-	fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	fd = open(name, oflags, 0600);
 	if (fd < 0)
-		goto error;
+		goto tid_error;
 
-	if (plockf(fd, F_LOCKW, 0, 0) != 0)
-		goto unlink_error;
+	dirfd = fs->jdirfd;
+	if (fs->fanout) {
+		dirfd = fanout_dirfd(fs, id);
+		if (dirfd < 0)
+			goto unlink_error;
+	}
 
 	jop->id = id;
 	jop->fd = fd;
+	jop->dirfd = dirfd;
+
+	if (plockf(fd, F_LOCKW, 0, 0) != 0)
+		goto unlink_error;
+
 	jop->numops = 0;
+	jop->size = 0;
+	jop->last_data = 0;
+	jop->keep_cache = 0;
+	jop->broken = 0;
 	jop->name = name;
 	jop->csum = 0;
 	jop->fs = fs;
+	jop->next = NULL;
 
 	fiu_exit_on("jio/commit/created_tf");
 
-	/* save the header */
-	hdr.ver = 1;
+	/* save the header, followed by the file identity if the journal is
+	 * shared */
+	hdr.ver = fs->shared ? 2 : 1;
+	if (intent)
+		hdr.ver += 2;
 	hdr.trans_id = id;
 	hdr.flags = flags;
 	hdr_hton(&hdr);
 
 	iov[0].iov_base = (void *) &hdr;
 	iov[0].iov_len = sizeof(hdr);
-	rv = swritev(fd, iov, 1);
-	if (rv != sizeof(hdr))
+	iovcnt = 1;
+
+	if (fs->shared) {
+		ident.dev = fs->dev;
+		ident.ino = fs->ino;
+		ident.pathlen = strlen(fs->shared_name);
+		iov[2].iov_base = (void *) fs->shared_name;
+		iov[2].iov_len = ident.pathlen;
+		ident_hton(&ident);
+
+		iov[1].iov_base = (void *) &ident;
+		iov[1].iov_len = sizeof(ident);
+		iovcnt = 3;
+	}
+
+	hlen = 0;
+	for (i = 0; i < iovcnt; i++)
+		hlen += iov[i].iov_len;
+
+	rv = swritev(fd, iov, iovcnt);
+	if (rv != hlen)
 		goto unlink_error;
+	jop->size = hlen;
 
-	jop->csum = checksum_buf(jop->csum, (unsigned char *) &hdr,
-			sizeof(hdr));
+	for (i = 0; i < iovcnt; i++)
+		jop->csum = checksum_buf(jop->csum, iov[i].iov_base,
+				iov[i].iov_len);
 
 	fiu_exit_on("jio/commit/tf_header");
 
+	trace3(journal__new, fs, id, intent);
+
 	return jop;
 
 unlink_error:
 	unlink(name);
-	free_tid(fs, id);
 	close(fd);
 
+tid_error:
+	free_tid(fs, id);
+
 error:
 	free(name);
 	free(jop);
@@ -334,9 +839,28 @@ error:
 int journal_add_op(struct journal_op *jop, unsigned char *buf, size_t len,
 		off_t offset)
 {
+	struct iovec iov;
+
+	iov.iov_base = (void *) buf;
+	iov.iov_len = len;
+
+	return journal_add_opv(jop, &iov, 1, len, offset);
+}
+
+/** Save a single operation whose data is gathered from many buffers, which
+ * add up to len bytes, in the journal file. The data is written straight
+ * from the buffers, a few of them at a time. */
+int journal_add_opv(struct journal_op *jop, const struct iovec *data,
+		int datacnt, size_t len, off_t offset)
+{
+	int i, n;
 	ssize_t rv;
+	size_t wlen;
 	struct on_disk_ophdr ophdr;
-	struct iovec iov[2];
+	struct iovec iov[JOURNAL_IOV_BATCH];
+
+	if (jop->broken)
+		return -1;
 
 	ophdr.len = len;
 	ophdr.offset = offset;
@@ -346,19 +870,33 @@ int journal_add_op(struct journal_op *jop, unsigned char *buf, size_t len,
 	iov[0].iov_len = sizeof(ophdr);
 	jop->csum = checksum_buf(jop->csum, (unsigned char *) &ophdr,
 			sizeof(ophdr));
-
-	iov[1].iov_base = (void *) buf;
-	iov[1].iov_len = len;
-	jop->csum = checksum_buf(jop->csum, buf, len);
+	n = 1;
+	wlen = sizeof(ophdr);
 
 	fiu_exit_on("jio/commit/tf_pre_addop");
 
-	rv = swritev(jop->fd, iov, 2);
-	if (rv != sizeof(ophdr) + len)
-		goto error;
+	/* swritev() modifies the iovecs, so we copy the caller's into our
+	 * own array, and write whenever it fills up */
+	for (i = 0; i < datacnt; i++) {
+		iov[n] = data[i];
+		wlen += data[i].iov_len;
+		jop->csum = checksum_buf(jop->csum, data[i].iov_base,
+				data[i].iov_len);
+		n++;
+
+		if (n == JOURNAL_IOV_BATCH || i == datacnt - 1) {
+			rv = swritev(jop->fd, iov, n);
+			if (rv != wlen)
+				goto error;
+			n = 0;
+			wlen = 0;
+		}
+	}
 
 	fiu_exit_on("jio/commit/tf_addop");
 
+	jop->last_data = jop->size + sizeof(ophdr);
+	jop->size += sizeof(ophdr) + len;
 	jop->numops++;
 
 	return 0;
@@ -367,6 +905,157 @@ error:
 	return -1;
 }
 
+/** Save a single operation whose data is read from srcfd, starting at srcoff,
+ * in the journal file. The data is streamed through a buffer from the pool,
+ * so it never has to be in memory all at once. */
+int journal_add_fd(struct journal_op *jop, int srcfd, off_t srcoff,
+		size_t len, off_t offset)
+{
+	int rv = -1;
+	size_t done, count, bufsize;
+	unsigned char *buf;
+	struct on_disk_ophdr ophdr;
+	struct iovec iov;
+
+	if (jop->broken)
+		return -1;
+
+	buf = pool_get(&(jop->fs->pool), JOURNAL_READ_WINDOW, &bufsize);
+	if (buf == NULL)
+		return -1;
+
+	ophdr.len = len;
+	ophdr.offset = offset;
+	ophdr_hton(&ophdr);
+
+	jop->csum = checksum_buf(jop->csum, (unsigned char *) &ophdr,
+			sizeof(ophdr));
+
+	fiu_exit_on("jio/commit/tf_pre_addop");
+
+	iov.iov_base = (void *) &ophdr;
+	iov.iov_len = sizeof(ophdr);
+	if (swritev(jop->fd, &iov, 1) != sizeof(ophdr))
+		goto exit;
+
+	for (done = 0; done < len; done += count) {
+		count = len - done;
+		if (count > bufsize)
+			count = bufsize;
+
+		/* the source must have all the data we were told about */
+		if (spread(srcfd, buf, count, srcoff + done) != count)
+			goto exit;
+
+		jop->csum = checksum_buf(jop->csum, buf, count);
+		iov.iov_base = (void *) buf;
+		iov.iov_len = count;
+		if (swritev(jop->fd, &iov, 1) != count)
+			goto exit;
+	}
+
+	fiu_exit_on("jio/commit/tf_addop");
+
+	jop->last_data = jop->size + sizeof(ophdr);
+	jop->size += sizeof(ophdr) + len;
+	jop->numops++;
+	rv = 0;
+
+exit:
+	pool_put(&(jop->fs->pool), buf, bufsize);
+	return rv;
+}
+
+/** Remember the current end of the transaction file, to go back to it with
+ * journal_rewind() */
+void journal_mark(struct journal_op *jop, struct journal_mark *mark)
+{
+	mark->size = jop->size;
+	mark->last_data = jop->last_data;
+	mark->csum = jop->csum;
+	mark->numops = jop->numops;
+}
+
+/** Throw away the operations saved after the given mark, usually because one
+ * of them could not be saved completely. If that fails, the transaction
+ * can't be committed anymore. */
+int journal_rewind(struct journal_op *jop, const struct journal_mark *mark)
+{
+	if (ftruncate(jop->fd, mark->size) != 0 ||
+			lseek(jop->fd, mark->size, SEEK_SET) != mark->size) {
+		jop->broken = 1;
+		return -1;
+	}
+
+	jop->size = mark->size;
+	jop->last_data = mark->last_data;
+	jop->csum = mark->csum;
+	jop->numops = mark->numops;
+
+	return 0;
+}
+
+/** Save the intent of an intent transaction, which must be its only
+ * operation */
+int journal_add_intent(struct journal_op *jop,
+		const struct journal_intent *intent)
+{
+	struct on_disk_intent odi;
+
+	odi.type = intent->type;
+	odi.oldlen = intent->oldlen;
+	odi.newlen = intent->newlen;
+	intent_hton(&odi);
+
+	return journal_add_op(jop, (unsigned char *) &odi, sizeof(odi),
+			intent->oldlen);
+}
+
+/** Undo an append intent on the given file, the same way for commits that
+ * failed (see commit_append() in trans.c) and for the ones jfsck() finds. The
+ * file is truncated back to its old length, unless something was written
+ * after the appended data, in which case we just zero the appended data, as
+ * it would be if the append had never happened. Returns 0 on success, -1 on
+ * error. */
+int journal_undo_append(int fd, const struct journal_intent *intent)
+{
+	int rv = -1;
+	size_t count;
+	off_t offset;
+	struct stat sinfo;
+	unsigned char *buf;
+
+	if (fstat(fd, &sinfo) != 0)
+		return -1;
+
+	if (sinfo.st_size <= intent->newlen) {
+		if (sinfo.st_size > intent->oldlen &&
+				ftruncate(fd, intent->oldlen) != 0)
+			return -1;
+		return 0;
+	}
+
+	buf = calloc(1, JOURNAL_READ_WINDOW);
+	if (buf == NULL)
+		return -1;
+
+	for (offset = intent->oldlen; offset < intent->newlen;
+			offset += count) {
+		count = JOURNAL_READ_WINDOW;
+		if (count > intent->newlen - offset)
+			count = intent->newlen - offset;
+
+		if (spwrite(fd, buf, count, offset) != count)
+			goto exit;
+	}
+
+	rv = 0;
+
+exit:
+	free(buf);
+	return rv;
+}
+
 /** Prepares to commit the operation. Can be omitted. */
 void journal_pre_commit(struct journal_op *jop)
 {
@@ -383,6 +1072,10 @@ int journal_commit(struct journal_op *jop)
 	struct on_disk_ophdr ophdr;
 	struct on_disk_trailer trailer;
 	struct iovec iov[2];
+	struct timespec start;
+
+	if (jop->broken)
+		goto error;
 
 	/* write the empty ophdr to mark there are no more operations, and
 	 * then the trailer */
@@ -400,7 +1093,19 @@ int journal_commit(struct journal_op *jop)
 	iov[1].iov_base = (void *) &trailer;
 	iov[1].iov_len = sizeof(trailer);
 
-	rv = swritev(jop->fd, iov, 2);
+	stats_start(&(jop->stats), J_PHASE_JSYNC, &start);
+	if (jop->dsync && have_dsync_writev) {
+		/* write out what journal_pre_commit() didn't submit, and wait
+		 * for all of it, so the synchronous write of the trailer
+		 * makes it durable along with it */
+		if (sync_range_submit(jop->fd, 0, 0) != 0)
+			goto error;
+		if (sync_range_wait(jop->fd, 0, 0) != 0)
+			goto error;
+		rv = dsync_writev(jop->fd, iov, 2);
+	} else {
+		rv = swritev(jop->fd, iov, 2);
+	}
 	if (rv != sizeof(ophdr) + sizeof(trailer))
 		goto error;
 
@@ -408,11 +1113,26 @@ int journal_commit(struct journal_op *jop)
 	 * everything O_SYNC, we sync at this point only, this way we avoid
 	 * doing a lot of very small writes; in case of a crash the
 	 * transaction file is only useful if it's complete (ie. after this
-	 * point) so we only flush here (both data and metadata) */
-	if (fsync(jop->fd) != 0)
+	 * point) so we only flush here (both data and metadata). With
+	 * J_SYNC_DSYNC the data is already on disk, but the directory entry
+	 * still needs syncing. */
+	if (!jop->dsync && fsync(jop->fd) != 0)
 		goto error;
-	if (fsync_dir(jop->fs->jdirfd) != 0)
+	stats_phase(&(jop->stats), J_PHASE_JSYNC, &start);
+
+	stats_start(&(jop->stats), J_PHASE_DIRSYNC, &start);
+	if (fsync_dir(jop->dirfd) != 0)
 		goto error;
+	stats_phase(&(jop->stats), J_PHASE_DIRSYNC, &start);
+
+	stats_journaled(&(jop->stats),
+			jop->size + sizeof(ophdr) + sizeof(trailer));
+
+	/* the transaction file is only read again if we crash, so now that
+	 * it's on disk there's no point in keeping it in the cache, pushing
+	 * out more useful pages; unless we are about to copy from it */
+	if (!jop->keep_cache)
+		posix_fadvise(jop->fd, 0, 0, POSIX_FADV_DONTNEED);
 
 	fiu_exit_on("jio/commit/tf_sync");
 
@@ -428,6 +1148,9 @@ error:
 int journal_free(struct journal_op *jop, int do_unlink)
 {
 	int rv;
+	struct timespec start;
+
+	trace3(journal__free, jop->fs, jop->id, do_unlink);
 
 	if (!do_unlink) {
 		rv = 0;
@@ -436,6 +1159,8 @@ int journal_free(struct journal_op *jop, int do_unlink)
 
 	rv = -1;
 
+	stats_start(&(jop->stats), J_PHASE_UNLINK, &start);
+
 	if (unlink(jop->name)) {
 		/* we do not want to leave a possibly complete transaction
 		 * file around when the transaction was not commited and the
@@ -449,129 +1174,328 @@ int journal_free(struct journal_op *jop, int do_unlink)
 		}
 	}
 
-	if (fsync_dir(jop->fs->jdirfd) != 0) {
+	if (fsync_dir(jop->dirfd) != 0) {
 		mark_broken(jop->fs);
 		goto exit;
 	}
+	stats_phase(&(jop->stats), J_PHASE_UNLINK, &start);
 
 	fiu_exit_on("jio/commit/pre_ok_free_tid");
+	stats_start(&(jop->stats), J_PHASE_FREETID, &start);
 	free_tid(jop->fs, jop->id);
+	stats_phase(&(jop->stats), J_PHASE_FREETID, &start);
 
 	rv = 0;
 
 exit:
 	close(jop->fd);
 
+	stats_merge(&(jop->stats));
+
 	free(jop->name);
 	free(jop);
 
 	return rv;
 }
 
-/** Fill a transaction structure from a mmapped transaction file. Useful for
- * checking purposes.
- * @returns 0 on success, -1 if the file was broken, -2 if the checksums didn't
- *	match
+
+/*
+ * Transaction file reading
+ *
+ * Transaction files are read sequentially through a fixed size window
+ * supplied by the caller, so checking or replaying a huge transaction does
+ * not need it all in memory. The operations are returned one at a time, and
+ * their data in chunks of at most the window size. The checksum is computed
+ * as the file is read, and verified by journal_reader_finish().
+ */
+
+/** Make sure there are at least need bytes available in the window (need must
+ * not be bigger than the window). Returns 0 on success, -1 if the file is too
+ * short, -3 on I/O errors. */
+static int jr_fill(struct journal_reader *jr, size_t need)
+{
+	size_t count;
+
+	if (jr->end - jr->start >= need)
+		return 0;
+
+	if (jr->start > 0) {
+		memmove(jr->buf, jr->buf + jr->start, jr->end - jr->start);
+		jr->end -= jr->start;
+		jr->start = 0;
+	}
+
+	count = jr->bufsize - jr->end;
+	if (count > jr->len - jr->pos)
+		count = jr->len - jr->pos;
+
+	if (spread(jr->fd, jr->buf + jr->end, count, jr->pos) != count)
+		return -3;
+	jr->end += count;
+	jr->pos += count;
+
+	if (jr->end - jr->start < need)
+		return -1;
+
+	return 0;
+}
+
+/** Consume count bytes from the window, adding them to the checksum */
+static void jr_consume(struct journal_reader *jr, size_t count)
+{
+	jr->csum = checksum_buf(jr->csum, jr->buf + jr->start, count);
+	jr->start += count;
+}
+
+/** Start reading a transaction file, using the given buffer as window.
+ * @returns 0 on success, -1 if the file was broken, -3 on I/O errors
  */
-int fill_trans(unsigned char *map, off_t len, struct jtrans *ts)
+int journal_reader_init(struct journal_reader *jr, int fd, unsigned char *buf,
+		size_t bufsize)
 {
 	int rv;
-	unsigned char *p;
-	struct operation *op, *tmp;
 	struct on_disk_hdr hdr;
-	struct on_disk_ophdr ophdr;
-	struct on_disk_trailer trailer;
+	struct on_disk_ident ident;
+
+	jr->fd = fd;
+	jr->buf = buf;
+	jr->bufsize = bufsize;
+	jr->start = jr->end = 0;
+	jr->pos = 0;
+	jr->csum = 0;
+	jr->numops = 0;
+	jr->remaining = 0;
+	jr->has_ident = 0;
+	jr->intent = 0;
+	jr->skipped = 0;
+
+	jr->len = lseek(fd, 0, SEEK_END);
+	if (jr->len < 0)
+		return -3;
+
+	if (jr->len < sizeof(hdr) + sizeof(struct on_disk_ophdr) +
+			sizeof(struct on_disk_trailer))
+		return -1;
 
-	rv = -1;
+	posix_fadvise(fd, 0, jr->len, POSIX_FADV_SEQUENTIAL);
+
+	rv = jr_fill(jr, sizeof(hdr));
+	if (rv != 0)
+		return rv;
+
+	memcpy(&hdr, jr->buf + jr->start, sizeof(hdr));
+	jr_consume(jr, sizeof(hdr));
 
-	if (len < sizeof(hdr) + sizeof(ophdr) + sizeof(trailer))
+	hdr_ntoh(&hdr);
+	if (hdr.ver < 1 || hdr.ver > 4)
 		return -1;
 
-	p = map;
+	if (hdr.ver >= 3) {
+		jr->intent = 1;
+		hdr.ver -= 2;
+	}
 
-	memcpy(&hdr, p, sizeof(hdr));
-	p += sizeof(hdr);
+	jr->trans_id = hdr.trans_id;
+	jr->flags = hdr.flags;
 
-	hdr_ntoh(&hdr);
-	if (hdr.ver != 1)
+	if (hdr.ver == 1)
+		return 0;
+
+	rv = jr_fill(jr, sizeof(ident));
+	if (rv != 0)
+		return rv;
+
+	memcpy(&ident, jr->buf + jr->start, sizeof(ident));
+	jr_consume(jr, sizeof(ident));
+
+	ident_ntoh(&ident);
+	if (ident.pathlen == 0 || ident.pathlen >= PATH_MAX)
 		return -1;
 
-	ts->id = hdr.trans_id;
-	ts->flags = hdr.flags;
-	ts->numops_r = 0;
-	ts->numops_w = 0;
-	ts->len_w = 0;
+	rv = jr_fill(jr, ident.pathlen);
+	if (rv != 0)
+		return rv;
 
-	for (;;) {
-		if (p + sizeof(ophdr) > map + len)
-			goto error;
+	memcpy(jr->path, jr->buf + jr->start, ident.pathlen);
+	jr->path[ident.pathlen] = '\0';
+	jr_consume(jr, ident.pathlen);
 
-		memcpy(&ophdr, p,  sizeof(ophdr));
-		p += sizeof(ophdr);
+	jr->has_ident = 1;
+	jr->dev = ident.dev;
+	jr->ino = ident.ino;
 
-		ophdr_ntoh(&ophdr);
+	return 0;
+}
 
-		if (ophdr.len == 0 && ophdr.offset == 0) {
-			/* This header marks the end of the operations */
-			break;
-		}
+/** Get the next operation of the transaction, skipping whatever was not read
+ * from the data of the previous one.
+ * @returns 1 if there was an operation, 0 if there are no more, -1 if the
+ *	file was broken, -3 on I/O errors
+ */
+int journal_reader_next(struct journal_reader *jr, size_t *len,
+		off_t *offset)
+{
+	int rv;
+	unsigned char *data;
+	size_t count;
+	struct on_disk_ophdr ophdr;
 
-		if (p + ophdr.len > map + len)
-			goto error;
+	do {
+		rv = journal_reader_data(jr, &data, &count);
+		if (rv != 0)
+			return rv;
+	} while (count > 0);
 
-		op = malloc(sizeof(struct operation));
-		if (op == NULL)
-			goto error;
+	rv = jr_fill(jr, sizeof(ophdr));
+	if (rv != 0)
+		return rv;
 
-		op->len = ophdr.len;
-		op->offset = ophdr.offset;
-		op->direction = D_WRITE;
-
-		op->buf = (void *) p;
-		p += op->len;
-
-		op->pdata = NULL;
-
-		if (ts->op == NULL) {
-			ts->op = op;
-			op->prev = NULL;
-			op->next = NULL;
-		} else {
-			for (tmp = ts->op; tmp->next != NULL; tmp = tmp->next)
-				;
-			tmp->next = op;
-			op->prev = tmp;
-			op->next = NULL;
-		}
+	memcpy(&ophdr, jr->buf + jr->start, sizeof(ophdr));
+	jr_consume(jr, sizeof(ophdr));
+
+	ophdr_ntoh(&ophdr);
 
-		ts->numops_w++;
-		ts->len_w += op->len;
+	if (ophdr.len == 0 && ophdr.offset == 0) {
+		/* This header marks the end of the operations */
+		return 0;
 	}
 
-	if (p + sizeof(trailer) > map + len)
-		goto error;
+	if (jr->pos - (jr->end - jr->start) + ophdr.len > jr->len)
+		return -1;
 
-	memcpy(&trailer, p, sizeof(trailer));
-	p += sizeof(trailer);
+	jr->numops++;
+	jr->remaining = ophdr.len;
+	*len = ophdr.len;
+	*offset = ophdr.offset;
 
-	trailer_ntoh(&trailer);
+	return 1;
+}
 
-	if (trailer.numops != ts->numops_w)
-		goto error;
+/** Get the next chunk of data of the current operation. The returned pointer
+ * is only valid until the next call to a journal_reader_*() function.
+ * @returns 0 on success (with *count set to 0 when there is no more data),
+ *	-1 if the file was broken, -3 on I/O errors
+ */
+int journal_reader_data(struct journal_reader *jr, unsigned char **data,
+		size_t *count)
+{
+	int rv;
 
-	if (checksum_buf(0, map, len - sizeof(trailer)) != trailer.checksum) {
-		rv = -2;
-		goto error;
-	}
+	*count = jr->remaining;
+	if (*count == 0)
+		return 0;
+
+	if (*count > jr->bufsize)
+		*count = jr->bufsize;
+
+	rv = jr_fill(jr, *count);
+	if (rv != 0)
+		return rv;
+
+	*data = jr->buf + jr->start;
+	jr_consume(jr, *count);
+	jr->remaining -= *count;
 
 	return 0;
+}
 
-error:
-	while (ts->op != NULL) {
-		tmp = ts->op->next;
-		free(ts->op);
-		ts->op = tmp;
+/** Get the position in the file of the data of the current operation that
+ * hasn't been read yet */
+off_t journal_reader_tell(struct journal_reader *jr)
+{
+	return jr->pos - (jr->end - jr->start);
+}
+
+/** Skip the rest of the data of the current operation, without reading it;
+ * the checksum won't be verified by journal_reader_finish() afterwards, so
+ * it must have been verified before */
+void journal_reader_skip(struct journal_reader *jr)
+{
+	size_t buffered;
+
+	buffered = jr->end - jr->start;
+	if (jr->remaining <= buffered) {
+		jr->start += jr->remaining;
+	} else {
+		jr->pos += jr->remaining - buffered;
+		jr->start = jr->end = 0;
 	}
-	return rv;
+
+	jr->remaining = 0;
+	jr->skipped = 1;
+}
+
+/** Read the intent of an intent transaction; it must be called right after
+ * journal_reader_init(), and be followed by journal_reader_finish().
+ * @returns 0 on success, -1 if the file was broken, -3 on I/O errors
+ */
+int journal_reader_intent(struct journal_reader *jr,
+		struct journal_intent *intent)
+{
+	int rv;
+	size_t len, count;
+	off_t offset;
+	unsigned char *data;
+	struct on_disk_intent odi;
+
+	if (!jr->intent)
+		return -1;
+
+	rv = journal_reader_next(jr, &len, &offset);
+	if (rv != 1)
+		return rv == 0 ? -1 : rv;
+	if (len != sizeof(odi))
+		return -1;
+
+	rv = journal_reader_data(jr, &data, &count);
+	if (rv != 0)
+		return rv;
+	if (count != sizeof(odi))
+		return -1;
+
+	memcpy(&odi, data, sizeof(odi));
+	intent_ntoh(&odi);
+	intent->type = odi.type;
+	intent->oldlen = odi.oldlen;
+	intent->newlen = odi.newlen;
+
+	/* there must be no other operations */
+	rv = journal_reader_next(jr, &len, &offset);
+	if (rv != 0)
+		return rv == 1 ? -1 : rv;
+
+	return 0;
+}
+
+/** Finish reading a transaction file, after all its operations have been
+ * read, and verify its trailer and checksum.
+ * @returns 0 on success, -1 if the file was broken, -2 if the checksums
+ *	didn't match, -3 on I/O errors
+ */
+int journal_reader_finish(struct journal_reader *jr)
+{
+	int rv;
+	struct on_disk_trailer trailer;
+
+	rv = jr_fill(jr, sizeof(trailer));
+	if (rv != 0)
+		return rv;
+
+	memcpy(&trailer, jr->buf + jr->start, sizeof(trailer));
+	jr->start += sizeof(trailer);
+
+	/* the trailer must be right at the end of the file */
+	if (jr->start != jr->end || jr->pos != jr->len)
+		return -1;
+
+	trailer_ntoh(&trailer);
+
+	if (trailer.numops != jr->numops)
+		return -1;
+
+	if (!jr->skipped && jr->csum != trailer.checksum)
+		return -2;
+
+	return 0;
 }
 
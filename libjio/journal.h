@@ -3,28 +3,138 @@
 #define _JOURNAL_H
 
 #include <stdint.h>
+#include <limits.h>
 #include "libjio.h"
+#include "common.h"
 
 
 struct journal_op {
 	int id;
 	int fd;
+	int dirfd;
 	int numops;
+	int dsync;
+
+	/* size of the file so far, and where the data of the last operation
+	 * added starts */
+	off_t size;
+	off_t last_data;
+
+	/* don't drop the file from the cache in journal_commit(), because
+	 * some operations will be applied by copying from it */
+	int keep_cache;
+
+	/* a journal_rewind() failed, so the file can't be committed */
+	int broken;
+
 	char *name;
 	uint32_t csum;
 	struct jfs *fs;
+
+	/* next in the file's list of stale transaction files, see
+	 * jtrans_free() */
+	struct journal_op *next;
+
+	/* commit statistics, merged into the file's ones by
+	 * journal_free() */
+	struct jstats_acc stats;
 };
 
 typedef struct journal_op jop_t;
 
-struct journal_op *journal_new(struct jfs *fs, unsigned int flags);
+/** A point in a transaction file to go back to, see journal_mark() */
+struct journal_mark {
+	off_t size;
+	off_t last_data;
+	uint32_t csum;
+	int numops;
+};
+
+/** Types of intents, see journal_add_intent() */
+enum journal_intent_type {
+	/** Data is being appended to the file; to undo it the file is
+	 * truncated back to oldlen, see commit_append() in trans.c */
+	JOURNAL_INTENT_APPEND = 1,
+
+	/** The whole file is being replaced by a temporary file (see
+	 * get_jrfile()); to undo it the temporary file is removed, see
+	 * jreplace() in trans.c */
+	JOURNAL_INTENT_REPLACE = 2,
+};
+
+/** What an intent transaction is about to do to the file */
+struct journal_intent {
+	uint32_t type;
+	off_t oldlen;
+	off_t newlen;
+};
+
+int journal_setup(struct jfs *fs);
+int journal_pending(struct jfs *fs);
+int journal_close_fanout(int *fds);
+struct jshared *jshared_get(const char *jdir);
+int jshared_put(struct jshared *sh);
+struct journal_op *journal_new(struct jfs *fs, unsigned int flags,
+		int intent);
 int journal_add_op(struct journal_op *jop, unsigned char *buf, size_t len,
 		off_t offset);
+int journal_add_opv(struct journal_op *jop, const struct iovec *data,
+		int datacnt, size_t len, off_t offset);
+int journal_add_fd(struct journal_op *jop, int srcfd, off_t srcoff,
+		size_t len, off_t offset);
+void journal_mark(struct journal_op *jop, struct journal_mark *mark);
+int journal_rewind(struct journal_op *jop, const struct journal_mark *mark);
+int journal_add_intent(struct journal_op *jop,
+		const struct journal_intent *intent);
+int journal_undo_append(int fd, const struct journal_intent *intent);
 void journal_pre_commit(struct journal_op *jop);
 int journal_commit(struct journal_op *jop);
 int journal_free(struct journal_op *jop, int do_unlink);
 
-int fill_trans(unsigned char *map, off_t len, struct jtrans *ts);
+/** Number of buffers journal_add_opv() writes at a time */
+#define JOURNAL_IOV_BATCH 16
+
+/** Size of the window used to read transaction files */
+#define JOURNAL_READ_WINDOW (256 * 1024)
+
+struct journal_reader {
+	int fd;
+	off_t len;
+	off_t pos;
+	unsigned char *buf;
+	size_t bufsize;
+	size_t start;
+	size_t end;
+	uint32_t csum;
+	uint32_t numops;
+	size_t remaining;
+	uint32_t trans_id;
+	uint16_t flags;
+
+	/* is it an intent transaction? */
+	int intent;
+
+	/* was any data skipped? then the checksum can't be verified */
+	int skipped;
+
+	/* file identity, only for transactions in shared journals */
+	int has_ident;
+	uint64_t dev;
+	uint64_t ino;
+	char path[PATH_MAX];
+};
+
+int journal_reader_init(struct journal_reader *jr, int fd, unsigned char *buf,
+		size_t bufsize);
+int journal_reader_next(struct journal_reader *jr, size_t *len,
+		off_t *offset);
+int journal_reader_data(struct journal_reader *jr, unsigned char **data,
+		size_t *count);
+off_t journal_reader_tell(struct journal_reader *jr);
+void journal_reader_skip(struct journal_reader *jr);
+int journal_reader_intent(struct journal_reader *jr,
+		struct journal_intent *intent);
+int journal_reader_finish(struct journal_reader *jr);
 
 #endif
 
@@ -63,6 +63,122 @@ struct jfsck_result {
 	int reapplied;
 };
 
+/** A write operation, used to add many of them at once with
+ * jtrans_add_wv().
+ *
+ * @see jtrans_add_wv()
+ * @ingroup basic
+ */
+struct jio_wop {
+	/** Buffer to write */
+	const void *buf;
+
+	/** How many bytes from the buffer to write */
+	size_t len;
+
+	/** Offset to write at */
+	off_t offset;
+};
+
+/** Statistics of the buffer pool of an open file.
+ *
+ * @see jfs_pool_stats()
+ * @ingroup basic
+ */
+struct jpool_stats {
+	/** Number of buffers requested from the pool */
+	unsigned long long gets;
+
+	/** How many of them were reused from the pool */
+	unsigned long long hits;
+
+	/** Number of buffers given back to the pool */
+	unsigned long long puts;
+
+	/** How many of them were released because the pool was full */
+	unsigned long long drops;
+
+	/** Number of buffers currently kept in the pool */
+	unsigned long long kept;
+
+	/** Total size of the buffers currently kept in the pool */
+	unsigned long long kept_bytes;
+};
+
+/** Phases of a commit whose latency is measured, see struct jstats.
+ *
+ * @see jfs_stats()
+ * @ingroup basic
+ */
+enum jstats_phase {
+	/** Locking the ranges of the file the transaction works on */
+	J_PHASE_LOCK = 0,
+
+	/** Allocating a transaction id */
+	J_PHASE_TID = 1,
+
+	/** Creating the transaction file and writing the operations to it
+	 * (including the transaction id allocation) */
+	J_PHASE_JWRITE = 2,
+
+	/** Syncing the transaction file */
+	J_PHASE_JSYNC = 3,
+
+	/** Syncing the journal directory, after the transaction file has
+	 * been synced */
+	J_PHASE_DIRSYNC = 4,
+
+	/** Reading the previous data, to be able to roll back */
+	J_PHASE_READPREV = 5,
+
+	/** Applying the operations to the file */
+	J_PHASE_APPLY = 6,
+
+	/** Syncing the data written to the file */
+	J_PHASE_DATASYNC = 7,
+
+	/** Unlinking the transaction file, and syncing the journal
+	 * directory afterwards */
+	J_PHASE_UNLINK = 8,
+
+	/** Freeing the transaction id */
+	J_PHASE_FREETID = 9,
+};
+
+/** Number of phases in enum jstats_phase */
+#define J_STATS_PHASES	10
+
+/** Number of buckets of each latency histogram in struct jstats */
+#define J_STATS_BUCKETS	32
+
+/** Commit statistics of an open file.
+ *
+ * The latencies are kept in histograms with a logarithmic scale, in
+ * microseconds: bucket 0 counts the ones under 1us, and bucket i the ones
+ * from 2^(i-1) up to 2^i - 1us; the last bucket also counts all the longer
+ * ones.
+ *
+ * @see jfs_stats()
+ * @ingroup basic
+ */
+struct jstats {
+	/** Latency histogram of each phase, see enum jstats_phase */
+	unsigned long long phases[J_STATS_PHASES][J_STATS_BUCKETS];
+
+	/** Number of transactions committed */
+	unsigned long long commits;
+
+	/** Number of operations of the transactions committed */
+	unsigned long long ops;
+
+	/** Number of bytes written to the committed transaction files */
+	unsigned long long bytes_journaled;
+
+	/** Number of transactions rolled back, either by jtrans_rollback()
+	 * or after a failed commit */
+	unsigned long long rollbacks;
+};
+
 /** jfsck() return values.
  *
  * @see jfsck()
@@ -99,8 +215,12 @@ enum jfsck_return {
  * Takes the same parameters as the UNIX open(2), with an additional one for
  * internal flags.
  *
- * The only supported internal flag is J_LINGER, which enables lingering
- * transactions.
+ * The supported internal flags are J_LINGER, which enables lingering
+ * transactions, and J_FANOUT, which makes a new journal directory spread the
+ * transaction files over 256 subdirectories, to keep them small when there
+ * are lots of lingering transactions. J_DROPCACHE, J_ORDERED and
+ * J_INCREMENTAL can also be given, and apply to all the transactions of the
+ * file.
  *
  * @param name path to the file to open
  * @param flags flags to pass to open(2)
@@ -113,6 +233,32 @@ enum jfsck_return {
  */
 jfs_t *jopen(const char *name, int flags, int mode, unsigned int jflags);
 
+/** Open a file using a shared journal.
+ *
+ * Like jopen(), but instead of having its own journal directory, the file
+ * uses the one given, which can be shared by many files. They share the
+ * directory, the lock file and the transaction ids, which saves file
+ * descriptors and directories when working with lots of files. The
+ * transactions are tagged with the identity of the file they belong to.
+ *
+ * The journal directory is created on the first write. It can be checked for
+ * a single file with jfsck(), passing the same journal directory, while the
+ * other files are in use; or for all the files at once with jfsck_shared(),
+ * when none is. jmove_journal() is not supported on these files.
+ *
+ * @param name path to the file to open
+ * @param flags flags to pass to open(2)
+ * @param mode mode to pass to open(2)
+ * @param jflags journal flags
+ * @param jdir path to the shared journal directory
+ * @returns a new jfs_t that identifies the open file on success, or NULL on
+ *	error
+ * @see jopen(), jfsck_shared()
+ * @ingroup basic
+ */
+jfs_t *jopen_shared(const char *name, int flags, int mode,
+		unsigned int jflags, const char *jdir);
+
 /** Close a file opened with jopen().
  *
  * After a call to this function, the memory allocated for the open file will
@@ -120,6 +266,10 @@ jfs_t *jopen(const char *name, int flags, int mode, unsigned int jflags);
  *
  * If there was an autosync thread started for this file, it will be stopped.
  *
+ * The transactions created for the file that haven't been freed yet can
+ * still be freed with jtrans_free() afterwards, but nothing else can be done
+ * with them. Uncommitted J_INCREMENTAL transaction files are removed.
+ *
  * @param fs open file
  * @returns 0 on success, -1 on error
  * @see jopen(), jfs_autosync_start()
@@ -135,10 +285,33 @@ int jclose(jfs_t *fs);
  */
 int jsync(jfs_t *fs);
 
+/** Atomically replace the whole contents of a file.
+ *
+ * The new contents are written to a temporary file next to it, which is
+ * synced and then renamed over the file, so they are written only once
+ * instead of twice as with a transaction; only the intent of replacing the
+ * file is journaled, so jfsck() can remove the temporary file if there is a
+ * crash. Afterwards, fs refers to the new file; the file offset is kept.
+ *
+ * The new file gets the permissions of the old one, but not its owner nor
+ * any hard links to it. Like jtruncate(), it must not be used while other
+ * threads or processes are using the file, and it can't be used with shared
+ * journals.
+ *
+ * @param fs open file
+ * @param buf new contents of the file
+ * @param count length of the new contents
+ * @returns count on success, -1 on error
+ * @ingroup basic
+ */
+ssize_t jreplace(jfs_t *fs, const void *buf, size_t count);
+
 /** Create a new transaction.
  *
  * Note that the final flags to use in the transaction will be the result of
- * ORing the flags parameter with fs' flags.
+ * ORing the flags parameter with fs' flags, so for instance J_DROPCACHE,
+ * J_ORDERED or J_INCREMENTAL can be given here to use them only for some
+ * transactions.
  *
  * @param fs open file the transaction will apply to
  * @param flags transaction flags
@@ -162,6 +335,9 @@ jtrans_t *jtrans_new(jfs_t *fs, unsigned int flags);
  * The buffer will be copied internally and can be free()d right after this
  * function returns.
  *
+ * A single operation can't be 4 GiB or bigger (the limit of the journal
+ * format); bigger writes must be split in several operations.
+ *
  * @param ts transaction
  * @param buf buffer to write
  * @param count how many bytes from the buffer to write
@@ -171,6 +347,51 @@ jtrans_t *jtrans_new(jfs_t *fs, unsigned int flags);
  */
 int jtrans_add_w(jtrans_t *ts, const void *buf, size_t count, off_t offset);
 
+/** Add many write operations to a transaction at once.
+ *
+ * It's equivalent to calling jtrans_add_w() for each of the operations, in
+ * order, but cheaper. If any of them is invalid, none is added.
+ *
+ * If flags has J_NOCOPY, the buffers are not copied, and must not be
+ * modified nor freed until the transaction is freed.
+ *
+ * @param ts transaction
+ * @param ops operations to add
+ * @param n number of operations
+ * @param flags 0 or J_NOCOPY
+ * @returns 0 on success, -1 on error
+ * @see jtrans_add_w()
+ * @ingroup basic
+ */
+int jtrans_add_wv(jtrans_t *ts, const struct jio_wop *ops, size_t n,
+		unsigned int flags);
+
+/** Add a write operation whose data is read from another file.
+ *
+ * The data is not read now, but streamed from srcfd into the journal when
+ * the transaction is committed, and then applied from the journal, so it
+ * never has to be in memory all at once. srcfd must be kept open, and the
+ * data must not change, until the transaction is committed.
+ *
+ * Since their previous data would have to be kept in memory, it isn't read,
+ * so transactions with these operations can't be rolled back, as if
+ * J_NOROLLBACK had been given.
+ *
+ * Like with jtrans_add_w(), len must be under 4 GiB; bigger streams must be
+ * added as several operations.
+ *
+ * @param ts transaction
+ * @param srcfd file descriptor to read the data from
+ * @param srcoff offset in srcfd where the data begins
+ * @param len how many bytes to write
+ * @param dstoff offset to write at
+ * @returns 0 on success, -1 on error
+ * @see jtrans_add_w()
+ * @ingroup basic
+ */
+int jtrans_add_w_fd(jtrans_t *ts, int srcfd, off_t srcoff, size_t len,
+		off_t dstoff);
+
 /** Add a read operation to a transaction.
  *
  * An operation consists of a buffer, its length, and the offset to read it
@@ -232,7 +453,25 @@ ssize_t jtrans_commit(jtrans_t *ts);
  */
 ssize_t jtrans_rollback(jtrans_t *ts);
 
+/** Reset a transaction, so it can be used again.
+ *
+ * All its operations are removed and it goes back to the state it had right
+ * after jtrans_new(), but the memory it has allocated is kept for the new
+ * operations, which makes it cheaper than freeing it and creating a new one.
+ *
+ * @param ts transaction to reset
+ * @see jtrans_new()
+ * @ingroup basic
+ */
+void jtrans_reset(jtrans_t *ts);
+
 /** Free a transaction structure.
+ *
+ * A few freed transactions are kept by each thread, and reused by
+ * jtrans_new(). It can be called after the file has been closed.
+ *
+ * This is not a disk operation: if a J_INCREMENTAL transaction wasn't
+ * committed, its transaction file is removed by jclose().
  *
  * @param ts transaction to free
  * @see jtrans_new()
@@ -240,6 +479,94 @@ ssize_t jtrans_rollback(jtrans_t *ts);
  */
 void jtrans_free(jtrans_t *ts);
 
+/** Limit the amount of pending lingering transactions.
+ *
+ * Lingering transactions are normally only bounded by how often jsync() is
+ * called. This function sets a hard limit: once it's reached, commits of
+ * lingering transactions will wait until jsync() (usually called by the
+ * autosync thread) frees some of them. If there is no autosync thread, the
+ * commit will call jsync() itself. If the jsync() they were waiting for
+ * fails, the commits fail too, without any changes being made.
+ *
+ * If J_NONBLOCK is given in the flags, instead of waiting the commits will
+ * fail with errno set to EAGAIN, without any changes being made.
+ *
+ * @param fs open file
+ * @param max_bytes maximum number of bytes written by pending lingering
+ *	transactions, 0 means no limit
+ * @param max_count maximum number of pending lingering transactions, 0 means
+ *	no limit
+ * @param flags either 0 or J_NONBLOCK
+ * @returns 0 on success, -1 on error
+ * @see jsync(), jfs_autosync_start()
+ * @ingroup basic
+ */
+int jfs_linger_limit(jfs_t *fs, size_t max_bytes, unsigned int max_count,
+		unsigned int flags);
+
+/** Set how the transaction files of an open file are synced.
+ *
+ * By default (J_SYNC_FSYNC) they are written and then synced with fsync().
+ * With J_SYNC_DSYNC the last write syncs the data by itself, which on Linux
+ * is done with pwritev2() and lets the kernel use FUA writes instead of a
+ * full cache flush on the devices that support them; elsewhere all the
+ * writes are synchronous (O_DSYNC), which is usually slower. Which one is
+ * faster depends on the device, the benchmark in tests/performance/ can be
+ * used to compare them.
+ *
+ * @param fs open file
+ * @param mode either J_SYNC_FSYNC or J_SYNC_DSYNC
+ * @returns 0 on success, -1 on error
+ * @ingroup basic
+ */
+int jfs_sync_mode(jfs_t *fs, unsigned int mode);
+
+/** Configure the buffer pool of an open file.
+ *
+ * The buffers used to hold the data of the transactions, and the data they
+ * overwrite, come from a pool of power-of-two sized buffers that is kept for
+ * each open file, so they can be reused without having to allocate them
+ * every time. This function sets how many bytes the pool can keep, which by
+ * default is 16 MiB.
+ *
+ * If J_HUGEPAGES is given in the flags, the large buffers (2 MiB and up)
+ * will be backed by huge pages when the system supports it.
+ *
+ * @param fs open file
+ * @param max_bytes maximum number of bytes kept in the pool, 0 means no
+ * 	buffers will be kept
+ * @param flags either 0 or J_HUGEPAGES
+ * @returns 0 on success, -1 on error
+ * @see jfs_pool_stats()
+ * @ingroup basic
+ */
+int jfs_pool_config(jfs_t *fs, size_t max_bytes, unsigned int flags);
+
+/** Get the statistics of the buffer pool of an open file.
+ *
+ * @param fs open file
+ * @param stats where to store the statistics
+ * @returns 0 on success, -1 on error
+ * @see jfs_pool_config()
+ * @ingroup basic
+ */
+int jfs_pool_stats(jfs_t *fs, struct jpool_stats *stats);
+
+/** Get the commit statistics of an open file.
+ *
+ * They include all the transactions committed using the file since it was
+ * opened (or since the statistics were last reset), along with the journal
+ * work done by jsync() and jreplace().
+ *
+ * @param fs open file
+ * @param stats where to store the statistics
+ * @param reset if not 0, reset the statistics after getting them
+ * @returns 0 on success, -1 on error
+ * @see struct jstats
+ * @ingroup basic
+ */
+int jfs_stats(jfs_t *fs, struct jstats *stats, int reset);
+
 /** Change the location of the journal directory.
  *
  * The file MUST NOT be in use by any other thread or process. The older
@@ -268,7 +595,8 @@ int jmove_journal(jfs_t *fs, const char *newpath);
  * 	call to jsync()
  * @param max_bytes maximum number of bytes that should be written between
  *	each call to jsync()
- * @returns 0 on success, -1 on error
+ * @returns 0 on success, -1 on error (with errno set, to EBUSY if the file
+ * 	already has an autosync thread)
  * @ingroup basic
  */
 int jfs_autosync_start(jfs_t *fs, time_t max_sec, size_t max_bytes);
@@ -281,6 +609,38 @@ int jfs_autosync_start(jfs_t *fs, time_t max_sec, size_t max_bytes);
  */
 int jfs_autosync_stop(jfs_t *fs);
 
+/** Start the shared autosync pool.
+ *
+ * While the pool is running, jfs_autosync_start() will register the files
+ * with it instead of starting a dedicated thread for each one. The pool uses
+ * a fixed number of threads that call jsync() on the files when their
+ * deadlines expire, preserving the per-file max_sec and max_bytes semantics.
+ * This is useful when autosync is wanted on a lot of open files at the same
+ * time.
+ *
+ * Files that had autosync started before the pool are not affected.
+ *
+ * @param nthreads number of worker threads to use, must be > 0
+ * @returns 0 on success, -1 on error (with errno set, to EBUSY if the pool
+ * 	was already running)
+ * @see jfs_autosync_start(), jfs_autosync_pool_stop()
+ * @ingroup basic
+ */
+int jfs_autosync_pool_start(unsigned int nthreads);
+
+/** Stop the shared autosync pool started with jfs_autosync_pool_start().
+ *
+ * All the files registered with it must have had their autosync stopped
+ * (either with jfs_autosync_stop() or jclose()) before calling this
+ * function.
+ *
+ * @returns 0 on success, -1 on error (including if there are still files
+ * 	registered, or the pool was not running)
+ * @see jfs_autosync_pool_start()
+ * @ingroup basic
+ */
+int jfs_autosync_pool_stop(void);
+
 
 /*
  * Journal checker
@@ -301,13 +661,33 @@ int jfs_autosync_stop(jfs_t *fs);
  * @returns 0 on success, < 0 on error, with the following possible negative
  * 	values from enum jfsck_return: J_ENOENT if there was no such file with
  * 	the given name, J_ENOJOURNAL if there was no journal at the given
- * 	jdir, J_ENOMEM if memory could not be allocated, J_ECLEANUP if there
- * 	was an error cleaning the journal, J_EIO if there was an I/O error.
+ * 	jdir (a missing default journal is not an error, as it's only created
+ * 	when the file is first written to), J_ENOMEM if memory could not be
+ * 	allocated, J_ECLEANUP if there was an error cleaning the journal, J_EIO
+ * 	if there was an I/O error.
  * @ingroup check
  */
 enum jfsck_return jfsck(const char *name, const char *jdir,
 		struct jfsck_result *res, unsigned int flags);
 
+/** Check and repair all the files using the given shared journal.
+ *
+ * Like jfsck(), but recovers the transactions of all the files that use the
+ * shared journal (see jopen_shared()) in a single pass. The files are found
+ * using the identity stored in the transactions; transactions whose file
+ * can't be found (or was replaced) are counted as invalid and left in the
+ * journal.
+ *
+ * @param jdir shared journal directory
+ * @param res structure where to store the result
+ * @param flags same as jfsck()
+ * @returns same as jfsck()
+ * @see jfsck(), jopen_shared()
+ * @ingroup check
+ */
+enum jfsck_return jfsck_shared(const char *jdir, struct jfsck_result *res,
+		unsigned int flags);
+
 
 /*
  * UNIX API wrappers
@@ -347,6 +727,20 @@ ssize_t jpread(jfs_t *fs, void *buf, size_t count, off_t offset);
  */
 ssize_t jreadv(jfs_t *fs, const struct iovec *vector, int count);
 
+/** Read from the file at the given offset into multiple buffers. Works just
+ * like preadv(2), and like jpread() it doesn't change the file position.
+ *
+ * @param fs file to read from
+ * @param vector buffers used to store the data
+ * @param count number of buffers in vector
+ * @param offset offset to read at
+ * @returns number of bytes read on success, or -1 on error
+ * @see preadv(2)
+ * @ingroup unix
+ */
+ssize_t jpreadv(jfs_t *fs, const struct iovec *vector, int count,
+		off_t offset);
+
 /** Write to the file. Works just like UNIX write(2).
  *
  * @param fs file to write to
@@ -381,6 +775,20 @@ ssize_t jpwrite(jfs_t *fs, const void *buf, size_t count, off_t offset);
  */
 ssize_t jwritev(jfs_t *fs, const struct iovec *vector, int count);
 
+/** Write to the file at the given offset from multiple buffers. Works just
+ * like pwritev(2); the buffers are written in a single transaction.
+ *
+ * @param fs file to write to
+ * @param vector buffers used to read the data from
+ * @param count number of buffers in vector
+ * @param offset offset to write at
+ * @returns number of bytes written on success, or -1 on error
+ * @see pwritev(2)
+ * @ingroup unix
+ */
+ssize_t jpwritev(jfs_t *fs, const struct iovec *vector, int count,
+		off_t offset);
+
 /** Truncates the file to the given length. Works just like UNIX ftruncate(2).
  *
  * @param fs file to truncate
@@ -460,7 +868,50 @@ FILE *jfsopen(jfs_t *stream, const char *mode);
  * @ingroup basic */
 #define J_LINGER	4
 
-/* Range 8-256 is reserved for future public use */
+/** Spread the transaction files over subdirectories of the journal
+ * directory. Only has effect when the journal is created.
+ *
+ * @see jopen()
+ * @ingroup basic */
+#define J_FANOUT	8
+
+/** Drop the data written by a transaction from the page cache once it's on
+ * disk, so bulk writes don't push out more useful data. Has no effect on
+ * lingering transactions, since their data is not on disk at commit time.
+ *
+ * @see jopen(), jtrans_new()
+ * @ingroup basic */
+#define J_DROPCACHE	16
+
+/** Commit the transactions that only append data to the file without
+ * journaling the data: the data is written once and synced, and only the
+ * intent of appending it is journaled. If there is a crash before the commit
+ * completes, jfsck() truncates the file back, so it's as if the transaction
+ * had never happened. Has no effect on lingering transactions.
+ *
+ * @see jopen(), jtrans_new()
+ * @ingroup basic */
+#define J_ORDERED	32
+
+/** Write the operations to the transaction file as they are added to the
+ * transaction, instead of all at once when it's committed; the commit then
+ * only has to finish and sync it. The data is not kept in memory, it's
+ * applied from the transaction file, so once a transaction has been
+ * committed it can't be committed again (until it's reset). Has no effect on
+ * lingering transactions.
+ *
+ * @see jopen(), jtrans_new()
+ * @ingroup basic */
+#define J_INCREMENTAL	64
+
+/** Don't gather commit statistics, to save the little time it takes. They
+ * will stay as they were when the flag is given to jtrans_new().
+ *
+ * @see jopen(), jtrans_new(), jfs_stats()
+ * @ingroup basic */
+#define J_NOSTATS	128
+
+/* 256 is reserved for future public use */
 
 /** Marks a file as read-only.
  *
@@ -490,6 +941,57 @@ FILE *jfsopen(jfs_t *stream, const char *mode);
 #define J_ROLLBACKING	4096
 
 
+/*
+ * jfs_linger_limit() flags
+ */
+
+/** Fail with EAGAIN instead of waiting when the limit is reached. Used in
+ * jfs_linger_limit().
+ *
+ * @see jfs_linger_limit()
+ * @ingroup basic */
+#define J_NONBLOCK	1
+
+
+/*
+ * jtrans_add_wv() flags
+ */
+
+/** Do not copy the buffers. Used in jtrans_add_wv().
+ *
+ * @see jtrans_add_wv()
+ * @ingroup basic */
+#define J_NOCOPY	1
+
+
+/*
+ * jfs_sync_mode() modes
+ */
+
+/** Write the transaction files and then fsync() them, the default.
+ *
+ * @see jfs_sync_mode()
+ * @ingroup basic */
+#define J_SYNC_FSYNC	0
+
+/** Sync the transaction files with their last write.
+ *
+ * @see jfs_sync_mode()
+ * @ingroup basic */
+#define J_SYNC_DSYNC	1
+
+
+/*
+ * jfs_pool_config() flags
+ */
+
+/** Back large buffers with huge pages. Used in jfs_pool_config().
+ *
+ * @see jfs_pool_config()
+ * @ingroup basic */
+#define J_HUGEPAGES	1
+
+
 /*
  * jfsck() flags
  */
@@ -0,0 +1,191 @@
+/*
+ * Size-classed buffer pool, used for the operations' data and previous data
+ */
+
+#include <stdlib.h>	/* malloc() and friends */
+#include <pthread.h>	/* pthread_mutex_*() */
+
+#include "common.h"
+#include "libjio.h"
+#include "compat.h"
+
+
+/* Buffers are rounded up to a power of two, and each size (a class) has its
+ * own free list, linked through the first word of the buffers. The way a
+ * buffer is allocated depends only on its size, so buffers can be released
+ * without knowing which pool they came from, and moved between pools. */
+
+/** Size of the given class */
+#define class_size(c) ((size_t) 1 << ((c) + POOL_MIN_SHIFT))
+
+/** Find the smallest class that can hold size bytes, or -1 if it's too big
+ * to be pooled */
+static int size_class(size_t size)
+{
+	int c;
+
+	for (c = 0; c < POOL_NCLASSES; c++) {
+		if (size <= class_size(c))
+			return c;
+	}
+
+	return -1;
+}
+
+/** Allocate a new buffer of the given (real) size */
+static void *buf_alloc(struct jpool *pool, size_t size)
+{
+	if (size >= POOL_MMAP_SIZE && size <= class_size(POOL_NCLASSES - 1))
+		return anon_alloc(size, pool->flags & J_HUGEPAGES);
+
+	return malloc(size);
+}
+
+/** Release a buffer allocated by buf_alloc() */
+static void buf_release(void *buf, size_t size)
+{
+	if (size >= POOL_MMAP_SIZE && size <= class_size(POOL_NCLASSES - 1))
+		anon_free(buf, size);
+	else
+		free(buf);
+}
+
+/* Initialize a pool, with the default retention limit */
+void pool_init(struct jpool *pool)
+{
+	int c;
+
+	pthread_mutex_init(&(pool->lock), NULL);
+	for (c = 0; c < POOL_NCLASSES; c++)
+		pool->free[c] = NULL;
+	pool->max_bytes = POOL_DEFAULT_MAX;
+	pool->flags = 0;
+	pool->gets = pool->hits = pool->puts = pool->drops = 0;
+	pool->kept = 0;
+	pool->kept_bytes = 0;
+}
+
+/** Release the kept buffers until they add up to at most max bytes. Must be
+ * called with the pool locked. */
+static void pool_trim(struct jpool *pool, size_t max)
+{
+	int c;
+	void *buf;
+
+	/* start with the largest ones, which are the most expensive to keep */
+	for (c = POOL_NCLASSES - 1; c >= 0; c--) {
+		while (pool->kept_bytes > max && pool->free[c] != NULL) {
+			buf = pool->free[c];
+			pool->free[c] = *(void **) buf;
+			pool->kept--;
+			pool->kept_bytes -= class_size(c);
+			buf_release(buf, class_size(c));
+		}
+	}
+}
+
+/* Release all the buffers kept in the pool */
+void pool_destroy(struct jpool *pool)
+{
+	pthread_mutex_lock(&(pool->lock));
+	pool_trim(pool, 0);
+	pthread_mutex_unlock(&(pool->lock));
+	pthread_mutex_destroy(&(pool->lock));
+}
+
+/* Get a buffer of at least size bytes; its real size is stored in
+ * *realsize, and must be given back to pool_put(). Returns NULL on error. */
+void *pool_get(struct jpool *pool, size_t size, size_t *realsize)
+{
+	int c;
+	void *buf;
+
+	c = size_class(size);
+	if (c < 0) {
+		*realsize = size;
+		return malloc(size);
+	}
+
+	pthread_mutex_lock(&(pool->lock));
+	pool->gets++;
+	buf = pool->free[c];
+	if (buf != NULL) {
+		pool->free[c] = *(void **) buf;
+		pool->hits++;
+		pool->kept--;
+		pool->kept_bytes -= class_size(c);
+	}
+	pthread_mutex_unlock(&(pool->lock));
+
+	if (buf == NULL)
+		buf = buf_alloc(pool, class_size(c));
+
+	*realsize = class_size(c);
+	return buf;
+}
+
+/* Give back a buffer obtained from pool_get(). The pool may be NULL, in which
+ * case the buffer is released right away. */
+void pool_put(struct jpool *pool, void *buf, size_t realsize)
+{
+	int c;
+
+	if (buf == NULL)
+		return;
+
+	c = size_class(realsize);
+	if (pool == NULL || c < 0 || class_size(c) != realsize) {
+		buf_release(buf, realsize);
+		return;
+	}
+
+	pthread_mutex_lock(&(pool->lock));
+	pool->puts++;
+	if (pool->kept_bytes + realsize > pool->max_bytes) {
+		pool->drops++;
+		pthread_mutex_unlock(&(pool->lock));
+		buf_release(buf, realsize);
+		return;
+	}
+
+	*(void **) buf = pool->free[c];
+	pool->free[c] = buf;
+	pool->kept++;
+	pool->kept_bytes += realsize;
+	pthread_mutex_unlock(&(pool->lock));
+}
+
+
+/*
+ * Public API
+ */
+
+/* Configure the file's buffer pool */
+int jfs_pool_config(struct jfs *fs, size_t max_bytes, unsigned int flags)
+{
+	if (flags & ~J_HUGEPAGES)
+		return -1;
+
+	pthread_mutex_lock(&(fs->pool.lock));
+	fs->pool.max_bytes = max_bytes;
+	fs->pool.flags = flags;
+	pool_trim(&(fs->pool), max_bytes);
+	pthread_mutex_unlock(&(fs->pool.lock));
+
+	return 0;
+}
+
+/* Get the file's buffer pool statistics */
+int jfs_pool_stats(struct jfs *fs, struct jpool_stats *stats)
+{
+	pthread_mutex_lock(&(fs->pool.lock));
+	stats->gets = fs->pool.gets;
+	stats->hits = fs->pool.hits;
+	stats->puts = fs->pool.puts;
+	stats->drops = fs->pool.drops;
+	stats->kept = fs->pool.kept;
+	stats->kept_bytes = fs->pool.kept_bytes;
+	pthread_mutex_unlock(&(fs->pool.lock));
+
+	return 0;
+}
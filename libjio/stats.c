@@ -0,0 +1,169 @@
+/*
+ * Commit statistics: latency histograms of the commit phases, and counters
+ *
+ * They're gathered for each commit in a struct jstats_acc without any
+ * locking, and added to the ones of the file all at once by stats_merge(),
+ * so the commits only take the statistics' lock once.
+ */
+
+#include <string.h>	/* memset() */
+#include <time.h>	/* clock_gettime() */
+#include <pthread.h>	/* pthread_mutex_*() */
+
+#include "common.h"
+#include "libjio.h"
+#include "compat.h"
+#include "trace.h"
+
+
+/* Initialize the statistics */
+void stats_init(struct jstats_data *stats)
+{
+	pthread_mutex_init(&(stats->lock), NULL);
+	memset(&(stats->st), 0, sizeof(stats->st));
+}
+
+/* Release the statistics */
+void stats_destroy(struct jstats_data *stats)
+{
+	pthread_mutex_destroy(&(stats->lock));
+}
+
+/* Prepare to gather the statistics of a commit of the given file made with
+ * the given flags, unless they include J_NOSTATS */
+void stats_acc_init(struct jstats_acc *acc, struct jfs *fs,
+		unsigned int flags)
+{
+	memset(acc, 0, sizeof(*acc));
+	acc->fs = fs;
+	acc->on = !(flags & J_NOSTATS);
+}
+
+/* Get the time a phase starts at, to give to stats_phase() when it ends */
+void stats_start(struct jstats_acc *acc, enum jstats_phase phase,
+		struct timespec *start)
+{
+	trace2(phase__start, acc->fs, phase);
+	if (acc->on)
+		clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+/** Clear the gathered statistics */
+static void acc_clear(struct jstats_acc *acc)
+{
+	struct jfs *fs = acc->fs;
+	int on = acc->on;
+
+	memset(acc, 0, sizeof(*acc));
+	acc->fs = fs;
+	acc->on = on;
+}
+
+/** Find the histogram bucket for the given latency, see struct jstats */
+static int bucket(unsigned long long usecs)
+{
+	int b;
+
+	for (b = 0; usecs > 0 && b < J_STATS_BUCKETS - 1; b++)
+		usecs >>= 1;
+
+	return b;
+}
+
+/* Record the latency of a phase that started at start; if it's recorded
+ * more than once, the latencies are added up */
+void stats_phase(struct jstats_acc *acc, enum jstats_phase phase,
+		const struct timespec *start)
+{
+	struct timespec now;
+	long long usecs = 0;
+
+	if (acc->on) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		usecs = (now.tv_sec - start->tv_sec) * 1000000LL +
+			(now.tv_nsec - start->tv_nsec) / 1000;
+		if (usecs < 0)
+			usecs = 0;
+
+		acc->usecs[phase] += usecs;
+		acc->phases |= 1 << phase;
+	}
+
+	trace3(phase__end, acc->fs, phase, usecs);
+}
+
+/* Count a committed transaction with the given number of operations */
+void stats_commit(struct jstats_acc *acc, unsigned int ops)
+{
+	acc->commits++;
+	acc->ops += ops;
+}
+
+/* Count the bytes of a committed transaction file */
+void stats_journaled(struct jstats_acc *acc, size_t bytes)
+{
+	acc->bytes_journaled += bytes;
+}
+
+/* Count a transaction rolled back */
+void stats_rollback(struct jstats_acc *acc)
+{
+	acc->rollbacks++;
+}
+
+/* Move the statistics in src to dst, so they're merged along with it */
+void stats_add(struct jstats_acc *dst, struct jstats_acc *src)
+{
+	int i;
+
+	for (i = 0; i < J_STATS_PHASES; i++)
+		dst->usecs[i] += src->usecs[i];
+	dst->phases |= src->phases;
+	dst->commits += src->commits;
+	dst->ops += src->ops;
+	dst->bytes_journaled += src->bytes_journaled;
+	dst->rollbacks += src->rollbacks;
+
+	acc_clear(src);
+}
+
+/* Add the gathered statistics to the ones of the file, and clear them */
+void stats_merge(struct jstats_acc *acc)
+{
+	int i;
+	struct jfs *fs = acc->fs;
+
+	if (!acc->on || (acc->phases == 0 && acc->commits == 0 &&
+				acc->bytes_journaled == 0 &&
+				acc->rollbacks == 0))
+		return;
+
+	pthread_mutex_lock(&(fs->stats.lock));
+	for (i = 0; i < J_STATS_PHASES; i++) {
+		if (acc->phases & (1 << i))
+			fs->stats.st.phases[i][bucket(acc->usecs[i])]++;
+	}
+	fs->stats.st.commits += acc->commits;
+	fs->stats.st.ops += acc->ops;
+	fs->stats.st.bytes_journaled += acc->bytes_journaled;
+	fs->stats.st.rollbacks += acc->rollbacks;
+	pthread_mutex_unlock(&(fs->stats.lock));
+
+	acc_clear(acc);
+}
+
+/*
+ * Public API
+ */
+
+/* Get the file's commit statistics */
+int jfs_stats(struct jfs *fs, struct jstats *stats, int reset)
+{
+	pthread_mutex_lock(&(fs->stats.lock));
+	*stats = fs->stats.st;
+	if (reset)
+		memset(&(fs->stats.st), 0, sizeof(fs->stats.st));
+	pthread_mutex_unlock(&(fs->stats.lock));
+
+	return 0;
+}
@@ -0,0 +1,36 @@
+/*
+ * Static tracing probes
+ *
+ * When TRACE_ENABLE is defined (see the TRACE option in the Makefile), the
+ * probes are USDT ones from sys/sdt.h, under the "libjio" provider, which
+ * can be attached to with SystemTap, DTrace, bpftrace, perf and the like
+ * without rebuilding. They are only a nop instruction and a note in the
+ * binary while nobody is attached. Otherwise they're not compiled in at all.
+ *
+ * The probe names use a double underscore, which DTrace shows as a dash
+ * ("commit__start" becomes "commit-start").
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#ifdef TRACE_ENABLE
+
+#include <sys/sdt.h>
+
+#define trace1(name, a1) DTRACE_PROBE1(libjio, name, a1)
+#define trace2(name, a1, a2) DTRACE_PROBE2(libjio, name, a1, a2)
+#define trace3(name, a1, a2, a3) DTRACE_PROBE3(libjio, name, a1, a2, a3)
+#define trace4(name, a1, a2, a3, a4) \
+	DTRACE_PROBE4(libjio, name, a1, a2, a3, a4)
+
+#else
+
+#define trace1(name, a1)
+#define trace2(name, a1, a2)
+#define trace3(name, a1, a2, a3)
+#define trace4(name, a1, a2, a3, a4)
+
+#endif /* TRACE_ENABLE */
+
+#endif /* _TRACE_H */
@@ -21,17 +21,124 @@
 #include "compat.h"
 #include "journal.h"
 #include "trans.h"
+#include "trace.h"
 
 
 /*
  * Transaction functions
  */
 
+/*
+ * Per-thread cache of freed transactions, so they can be reused by
+ * jtrans_new() along with the memory they had grown
+ */
+
+struct trans_cache {
+	unsigned int count;
+	struct jtrans *ts[TRANS_CACHE_SIZE];
+};
+
+static pthread_key_t trans_cache_key;
+static pthread_once_t trans_cache_once = PTHREAD_ONCE_INIT;
+static int trans_cache_ok = 0;
+
+static void trans_destroy(struct jtrans *ts, struct jpool *pool);
+
+static void trans_cache_destroy(void *p)
+{
+	struct trans_cache *cache = p;
+
+	while (cache->count > 0) {
+		cache->count--;
+		trans_destroy(cache->ts[cache->count], NULL);
+	}
+	free(cache);
+}
+
+static void trans_cache_init(void)
+{
+	trans_cache_ok = pthread_key_create(&trans_cache_key,
+			trans_cache_destroy) == 0;
+}
+
+/** Get the calling thread's cache, creating it if asked to. Returns NULL if
+ * there isn't one. */
+static struct trans_cache *get_trans_cache(int create)
+{
+	struct trans_cache *cache;
+
+	pthread_once(&trans_cache_once, trans_cache_init);
+	if (!trans_cache_ok)
+		return NULL;
+
+	cache = pthread_getspecific(trans_cache_key);
+	if (cache == NULL && create) {
+		cache = malloc(sizeof(struct trans_cache));
+		if (cache == NULL)
+			return NULL;
+		cache->count = 0;
+
+		if (pthread_setspecific(trans_cache_key, cache) != 0) {
+			free(cache);
+			return NULL;
+		}
+	}
+
+	return cache;
+}
+
+
+/*
+ * Transaction functions
+ */
+
+/** Add a transaction to the list of its file's transactions */
+static void trans_link(struct jtrans *ts)
+{
+	struct jfs *fs = ts->fs;
+
+	pthread_mutex_lock(&(fs->translock));
+	ts->prev = NULL;
+	ts->next = fs->trans;
+	if (fs->trans != NULL)
+		fs->trans->prev = ts;
+	fs->trans = ts;
+	pthread_mutex_unlock(&(fs->translock));
+}
+
+/** Remove a transaction from the list of its file's transactions */
+static void trans_unlink(struct jtrans *ts)
+{
+	struct jfs *fs = ts->fs;
+
+	pthread_mutex_lock(&(fs->translock));
+	if (ts->prev != NULL)
+		ts->prev->next = ts->next;
+	else
+		fs->trans = ts->next;
+	if (ts->next != NULL)
+		ts->next->prev = ts->prev;
+	pthread_mutex_unlock(&(fs->translock));
+}
+
 /* Initialize a transaction structure */
 struct jtrans *jtrans_new(struct jfs *fs, unsigned int flags)
 {
 	pthread_mutexattr_t attr;
 	struct jtrans *ts;
+	struct trans_cache *cache;
+
+	/* reuse a transaction freed by this thread if we can, they have
+	 * been reset already */
+	cache = get_trans_cache(0);
+	if (cache != NULL && cache->count > 0) {
+		cache->count--;
+		ts = cache->ts[cache->count];
+		ts->fs = fs;
+		ts->flags = fs->flags | flags;
+		trans_link(ts);
+		return ts;
+	}
 
 	ts = malloc(sizeof(struct jtrans));
 	if (ts == NULL)
@@ -41,41 +148,181 @@ struct jtrans *jtrans_new(struct jfs *fs, unsigned int flags)
 	ts->id = 0;
 	ts->flags = fs->flags | flags;
 	ts->op = NULL;
+	ts->last_op = NULL;
+	ts->batches = NULL;
+	ts->spare_ops = NULL;
+	ts->spare_batches = NULL;
+	ts->chunks = NULL;
 	ts->numops_r = 0;
 	ts->numops_w = 0;
 	ts->len_w = 0;
+	ts->numops_fd = 0;
+	ts->jop = NULL;
 
 	pthread_mutexattr_init(&attr);
 	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL);
 	pthread_mutex_init(&(ts->lock), &attr);
 	pthread_mutexattr_destroy(&attr);
 
+	trans_link(ts);
+
 	return ts;
 }
 
-/* Free the contents of a transaction structure */
-void jtrans_free(struct jtrans *ts)
+/** Give the buffers of a list of operations linked by their next field back
+ * to the pool (which may be NULL); the operations themselves live in chunks
+ * or batches */
+static void free_ops(struct operation *op, struct jpool *pool)
 {
-	struct operation *tmpop;
-
-	ts->fs = NULL;
-
-	while (ts->op != NULL) {
-		tmpop = ts->op->next;
+	for (; op != NULL; op = op->next) {
+		pool_put(pool, op->own, op->ownsize);
+		pool_put(pool, op->pown, op->pownsize);
+	}
+}
 
-		if (ts->op->buf && ts->op->direction == D_WRITE)
-			free(ts->op->buf);
-		if (ts->op->pdata)
-			free(ts->op->pdata);
-		free(ts->op);
+/** Free a list of batches */
+static void free_batches(struct op_batch *batch)
+{
+	struct op_batch *tmpbatch;
 
-		ts->op = tmpop;
+	while (batch != NULL) {
+		tmpbatch = batch->next;
+		free(batch);
+		batch = tmpbatch;
 	}
+}
+
+/** Free a transaction and everything in it, giving the buffers back to the
+ * pool (which may be NULL) */
+static void trans_destroy(struct jtrans *ts, struct jpool *pool)
+{
+	free_ops(ts->op, pool);
+	free_ops(ts->spare_ops, pool);
+	free_batches(ts->batches);
+	free_batches(ts->spare_batches);
+	free_batches(ts->chunks);
 	pthread_mutex_destroy(&(ts->lock));
 
 	free(ts);
 }
 
+/** Remove all the operations from a transaction, keeping them and their
+ * buffers for reuse, and giving the ones that can't be kept back to the pool
+ * (which may be NULL). The transaction file, if any, is left alone. */
+static void trans_clear(struct jtrans *ts, struct jpool *pool)
+{
+	struct operation *op, *tmpop;
+	struct op_batch *batch;
+
+	/* keep the operations and their buffers for the next ones, except
+	 * for the batched ones, which live inside their batch; we go
+	 * backwards so they're reused in the same order */
+	for (op = ts->last_op; op != NULL; op = tmpop) {
+		tmpop = op->prev;
+
+		if (op->batched) {
+			pool_put(pool, op->pown, op->pownsize);
+			continue;
+		}
+
+		op->buf = NULL;
+		op->prev = NULL;
+		op->next = ts->spare_ops;
+		ts->spare_ops = op;
+	}
+	ts->op = NULL;
+	ts->last_op = NULL;
+
+	while (ts->batches != NULL) {
+		batch = ts->batches;
+		ts->batches = batch->next;
+		batch->next = ts->spare_batches;
+		ts->spare_batches = batch;
+	}
+
+	ts->id = 0;
+	ts->flags = ts->flags & ~(J_COMMITTED | J_ROLLBACKED | J_ROLLBACKING);
+	ts->numops_r = 0;
+	ts->numops_w = 0;
+	ts->len_w = 0;
+	ts->numops_fd = 0;
+}
+
+/* Reset a transaction so it can be used again */
+void jtrans_reset(struct jtrans *ts)
+{
+	pthread_mutex_lock(&(ts->lock));
+
+	trans_clear(ts, &(ts->fs->pool));
+
+	/* a transaction file that was never committed is useless */
+	if (ts->jop != NULL) {
+		journal_free(ts->jop, 1);
+		ts->jop = NULL;
+	}
+
+	pthread_mutex_unlock(&(ts->lock));
+}
+
+/** How much memory does a reset transaction keep for reuse? */
+static size_t trans_kept_mem(struct jtrans *ts)
+{
+	size_t mem = 0;
+	struct operation *op;
+	struct op_batch *batch;
+
+	for (op = ts->spare_ops; op != NULL; op = op->next)
+		mem += op->ownsize + op->pownsize;
+	for (batch = ts->spare_batches; batch != NULL; batch = batch->next)
+		mem += sizeof(struct op_batch) + batch->size;
+	for (batch = ts->chunks; batch != NULL; batch = batch->next)
+		mem += sizeof(struct op_batch) + batch->size;
+
+	return mem;
+}
+
+/* Free the contents of a transaction structure */
+void jtrans_free(struct jtrans *ts)
+{
+	struct jfs *fs = ts->fs;
+	struct trans_cache *cache;
+
+	/* the file was closed already (see jclose(), which detaches its
+	 * transactions), so we can't use its pool, nor cache the transaction
+	 * to be reused */
+	if (fs == NULL) {
+		trans_destroy(ts, NULL);
+		return;
+	}
+
+	trans_unlink(ts);
+	trans_clear(ts, &(fs->pool));
+
+	/* this is not a disk operation, so a transaction file that was never
+	 * committed is left for jclose() to remove */
+	if (ts->jop != NULL) {
+		pthread_mutex_lock(&(fs->translock));
+		ts->jop->next = fs->stale_jops;
+		fs->stale_jops = ts->jop;
+		pthread_mutex_unlock(&(fs->translock));
+		ts->jop = NULL;
+	}
+
+	/* keep it in the thread's cache if there is room, and it's not
+	 * holding on to too much memory; cached transactions don't keep any
+	 * reference to the file */
+	ts->fs = NULL;
+	cache = get_trans_cache(1);
+	if (cache != NULL && cache->count < TRANS_CACHE_SIZE &&
+			trans_kept_mem(ts) <= TRANS_CACHE_MEM) {
+		cache->ts[cache->count] = ts;
+		cache->count++;
+		return;
+	}
+
+	trans_destroy(ts, &(fs->pool));
+}
+
 /** Lock/unlock the ranges of the file covered by the transaction. mode must
  * be either F_LOCKW or F_UNLOCK. Returns 0 on success, -1 on error. */
 static int lock_file_ranges(struct jtrans *ts, int mode)
@@ -133,143 +380,791 @@ static int operation_read_prev(struct jtrans *ts, struct operation *op)
 {
 	ssize_t rv;
 
-	op->pdata = malloc(op->len);
-	if (op->pdata == NULL)
+	/* small data is kept inline; otherwise we use our own buffer, which
+	 * may be left from a previous use of the operation, or comes from the
+	 * pool */
+	if (op->len <= OP_INLINE_SIZE) {
+		op->pdata = op->inline_pdata;
+	} else {
+		if (op->pownsize < op->len) {
+			pool_put(&(ts->fs->pool), op->pown, op->pownsize);
+			op->pownsize = 0;
+			op->pown = pool_get(&(ts->fs->pool), op->len,
+					&(op->pownsize));
+			if (op->pown == NULL) {
+				op->pownsize = 0;
+				return -1;
+			}
+		}
+		op->pdata = op->pown;
+	}
+
+	rv = spread(ts->fs->fd, op->pdata, op->len,
+			op->offset);
+	if (rv < 0)
 		return -1;
 
-	rv = spread(ts->fs->fd, op->pdata, op->len,
-			op->offset);
-	if (rv < 0) {
-		free(op->pdata);
-		op->pdata = NULL;
-		return -1;
-	}
+	op->plen = op->len;
+	if (rv < op->len) {
+		/* we are extending the file! */
+		/* ftruncate(ts->fs->fd, op->offset + op->len); */
+		op->plen = rv;
+	}
+
+	return 0;
+}
+
+/** Get an operation for the transaction from the spare ones, allocating a
+ * new chunk of them if there are none left. Must be called with the
+ * transaction's lock held. */
+static struct operation *get_op(struct jtrans *ts)
+{
+	int i;
+	struct operation *op;
+	struct op_batch *chunk;
+
+	if (ts->spare_ops == NULL) {
+		chunk = malloc(sizeof(struct op_batch) +
+				OP_CHUNK * sizeof(struct operation));
+		if (chunk == NULL)
+			return NULL;
+
+		chunk->size = OP_CHUNK * sizeof(struct operation);
+		chunk->next = ts->chunks;
+		ts->chunks = chunk;
+
+		for (i = OP_CHUNK - 1; i >= 0; i--) {
+			op = &(chunk->ops[i]);
+			op->own = NULL;
+			op->ownsize = 0;
+			op->pown = NULL;
+			op->pownsize = 0;
+			op->next = ts->spare_ops;
+			ts->spare_ops = op;
+		}
+	}
+
+	op = ts->spare_ops;
+	ts->spare_ops = op->next;
+	return op;
+}
+
+/** Add an operation at the end of the transaction's list. Must be called
+ * with the transaction's lock held. */
+static void append_op(struct jtrans *ts, struct operation *op)
+{
+	op->next = NULL;
+	op->prev = ts->last_op;
+	if (ts->last_op == NULL)
+		ts->op = op;
+	else
+		ts->last_op->next = op;
+	ts->last_op = op;
+}
+
+/** Should the write operations being added to the transaction be written to
+ * the transaction file right away? Only if it's J_INCREMENTAL, and all the
+ * previous write operations went there too. Must be called with the
+ * transaction's lock held. */
+static int is_incremental(struct jtrans *ts)
+{
+	if (!(ts->flags & J_INCREMENTAL) || (ts->flags & J_LINGER))
+		return 0;
+
+	return ts->jop != NULL || ts->numops_w == 0;
+}
+
+/** Get the transaction file of an incremental transaction, creating it if
+ * needed. Must be called with the transaction's lock held. Returns NULL on
+ * error. */
+static struct journal_op *incremental_jop(struct jtrans *ts)
+{
+	if (ts->jop == NULL) {
+		ts->jop = journal_new(ts->fs, ts->flags, 0);
+		if (ts->jop == NULL)
+			return NULL;
+
+		/* the data will be applied from it */
+		ts->jop->keep_cache = 1;
+	}
+
+	return ts->jop;
+}
+
+/** Common function to add an operation to a transaction */
+static int jtrans_add_common(struct jtrans *ts, const void *buf, size_t count,
+		off_t offset, enum op_direction direction)
+{
+	int journaled = 0;
+	struct operation *op;
+	struct journal_op *jop;
+	struct journal_mark mark;
+
+	op = NULL;
+
+	pthread_mutex_lock(&(ts->lock));
+
+	/* Writes are not allowed in read-only mode, they fail early */
+	if ((ts->flags & J_RDONLY) && direction == D_WRITE)
+		goto error;
+
+	if (count == 0)
+		goto error;
+
+	if (direction == D_WRITE && count > MAX_OPSIZE)
+		goto error;
+
+	if ((long long) ts->len_w + count > MAX_TSIZE)
+		goto error;
+
+	op = get_op(ts);
+	if (op == NULL)
+		goto error;
+
+	if (direction == D_WRITE && is_incremental(ts)) {
+		/* the data goes straight to the transaction file, and will be
+		 * applied from there */
+		jop = incremental_jop(ts);
+		if (jop == NULL)
+			goto error;
+
+		journal_mark(jop, &mark);
+		if (journal_add_op(jop, (unsigned char *) buf, count,
+					offset) != 0) {
+			journal_rewind(jop, &mark);
+			goto error;
+		}
+
+		op->buf = NULL;
+		op->joffset = jop->last_data;
+		journaled = 1;
+
+		ts->numops_w++;
+		ts->len_w += count;
+	} else if (direction == D_WRITE) {
+		/* small data is kept inline; otherwise we use our own buffer,
+		 * which may be left from a previous use of the operation, or
+		 * comes from the pool */
+		if (count <= OP_INLINE_SIZE) {
+			op->buf = op->inline_buf;
+		} else {
+			if (op->ownsize < count) {
+				pool_put(&(ts->fs->pool), op->own,
+						op->ownsize);
+				op->ownsize = 0;
+				op->own = pool_get(&(ts->fs->pool), count,
+						&(op->ownsize));
+				if (op->own == NULL) {
+					op->ownsize = 0;
+					goto error;
+				}
+			}
+			op->buf = op->own;
+		}
+
+		ts->numops_w++;
+		ts->len_w += count;
+	} else {
+		ts->numops_r++;
+	}
+
+	append_op(ts, op);
+
+	pthread_mutex_unlock(&(ts->lock));
+
+	op->len = count;
+	op->offset = offset;
+	op->plen = 0;
+	op->iov = NULL;
+	op->iovcnt = 0;
+	op->batched = 0;
+	op->srcfd = -1;
+	op->journaled = journaled;
+	op->locked = 0;
+	op->direction = direction;
+
+	if (direction == D_WRITE) {
+		if (!journaled)
+			memcpy(op->buf, buf, count);
+	} else {
+		/* this casts the const away, which is ugly but let us have a
+		 * common read/write path and avoid useless code repetition
+		 * just to handle it */
+		op->buf = (void *) buf;
+	}
+
+	return 0;
+
+error:
+	/* give the operation back, it wasn't added */
+	if (op) {
+		op->next = ts->spare_ops;
+		ts->spare_ops = op;
+	}
+
+	pthread_mutex_unlock(&(ts->lock));
+
+	return -1;
+}
+
+int jtrans_add_r(struct jtrans *ts, void *buf, size_t count, off_t offset)
+{
+	return jtrans_add_common(ts, buf, count, offset, D_READ);
+}
+
+int jtrans_add_w(struct jtrans *ts, const void *buf, size_t count,
+		off_t offset)
+{
+	return jtrans_add_common(ts, buf, count, offset, D_WRITE);
+}
+
+int jtrans_add_wv(struct jtrans *ts, const struct jio_wop *ops, size_t n,
+		unsigned int flags)
+{
+	int incremental;
+	size_t i, len, size;
+	unsigned char *data;
+	struct op_batch *batch, **prev;
+	struct operation *op;
+	struct journal_op *jop = NULL;
+	struct journal_mark mark;
+
+	if (n == 0)
+		return 0;
+
+	pthread_mutex_lock(&(ts->lock));
+
+	/* the same checks jtrans_add_w() does, for all of them up front so we
+	 * either add them all or none */
+	if (ts->flags & J_RDONLY)
+		goto error;
+
+	len = 0;
+	for (i = 0; i < n; i++) {
+		if (ops[i].len == 0 || ops[i].len > MAX_OPSIZE ||
+				ops[i].len > MAX_TSIZE - ts->len_w - len)
+			goto error;
+		len += ops[i].len;
+	}
+
+	/* incremental transactions don't keep the data */
+	incremental = is_incremental(ts);
+	if (incremental) {
+		jop = incremental_jop(ts);
+		if (jop == NULL)
+			goto error;
+		flags = flags | J_NOCOPY;
+	}
+
+	/* a single allocation for all the operations and, if we have to copy
+	 * it, their data; or a spare one that is big enough */
+	size = n * sizeof(struct operation) + ((flags & J_NOCOPY) ? 0 : len);
+	for (prev = &(ts->spare_batches); *prev != NULL;
+			prev = &((*prev)->next)) {
+		if ((*prev)->size >= size)
+			break;
+	}
+
+	if (*prev != NULL) {
+		batch = *prev;
+		*prev = batch->next;
+	} else {
+		batch = malloc(sizeof(struct op_batch) + size);
+		if (batch == NULL)
+			goto error;
+		batch->size = size;
+	}
+
+	batch->next = ts->batches;
+	ts->batches = batch;
+	data = (unsigned char *) (batch->ops + n);
+
+	for (i = 0; i < n; i++) {
+		op = &(batch->ops[i]);
+
+		if (flags & J_NOCOPY) {
+			op->buf = (void *) ops[i].buf;
+		} else {
+			memcpy(data, ops[i].buf, ops[i].len);
+			op->buf = data;
+			data += ops[i].len;
+		}
+
+		op->len = ops[i].len;
+		op->offset = ops[i].offset;
+		op->plen = 0;
+		op->pdata = NULL;
+		op->pown = NULL;
+		op->pownsize = 0;
+		op->own = NULL;
+		op->ownsize = 0;
+		op->iov = NULL;
+		op->iovcnt = 0;
+		op->batched = 1;
+		op->srcfd = -1;
+		op->journaled = 0;
+		op->locked = 0;
+		op->direction = D_WRITE;
+	}
+
+	/* write them all to the transaction file, or none */
+	if (incremental) {
+		journal_mark(jop, &mark);
+		for (i = 0; i < n; i++) {
+			op = &(batch->ops[i]);
+			if (journal_add_op(jop, op->buf, op->len,
+						op->offset) != 0) {
+				journal_rewind(jop, &mark);
+				ts->batches = batch->next;
+				batch->next = ts->spare_batches;
+				ts->spare_batches = batch;
+				goto error;
+			}
+
+			op->buf = NULL;
+			op->joffset = jop->last_data;
+			op->journaled = 1;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		append_op(ts, &(batch->ops[i]));
+
+	ts->numops_w += n;
+	ts->len_w += len;
+
+	pthread_mutex_unlock(&(ts->lock));
+	return 0;
+
+error:
+	pthread_mutex_unlock(&(ts->lock));
+	return -1;
+}
+
+int jtrans_add_w_fd(struct jtrans *ts, int srcfd, off_t srcoff, size_t len,
+		off_t dstoff)
+{
+	struct operation *op;
+	struct journal_op *jop;
+	struct journal_mark mark;
+
+	pthread_mutex_lock(&(ts->lock));
+
+	/* the same checks jtrans_add_w() does */
+	if ((ts->flags & J_RDONLY) || srcfd < 0 || len == 0 ||
+			len > MAX_OPSIZE)
+		goto error;
+
+	if ((long long) ts->len_w + len > MAX_TSIZE)
+		goto error;
+
+	op = get_op(ts);
+	if (op == NULL)
+		goto error;
+
+	/* there is no buffer, the data is read from srcfd when it's
+	 * journaled (right now for incremental transactions), and applied
+	 * from the transaction file */
+	op->journaled = 0;
+	if (is_incremental(ts)) {
+		jop = incremental_jop(ts);
+		if (jop == NULL)
+			goto op_error;
+
+		journal_mark(jop, &mark);
+		if (journal_add_fd(jop, srcfd, srcoff, len, dstoff) != 0) {
+			journal_rewind(jop, &mark);
+			goto op_error;
+		}
+
+		op->joffset = jop->last_data;
+		op->journaled = 1;
+	}
+
+	op->buf = NULL;
+	op->len = len;
+	op->offset = dstoff;
+	op->plen = 0;
+	op->iov = NULL;
+	op->iovcnt = 0;
+	op->batched = 0;
+	op->srcfd = srcfd;
+	op->srcoff = srcoff;
+	op->locked = 0;
+	op->direction = D_WRITE;
+
+	append_op(ts, op);
+
+	ts->numops_w++;
+	ts->numops_fd++;
+	ts->len_w += len;
+
+	pthread_mutex_unlock(&(ts->lock));
+	return 0;
+
+op_error:
+	/* give the operation back, it wasn't added */
+	op->next = ts->spare_ops;
+	ts->spare_ops = op;
+
+error:
+	pthread_mutex_unlock(&(ts->lock));
+	return -1;
+}
+
+/** Get the file's end of file hint */
+off_t eof_hint_get(struct jfs *fs)
+{
+	off_t eof;
+
+	pthread_mutex_lock(&(fs->eoflock));
+	eof = fs->eof_hint;
+	pthread_mutex_unlock(&(fs->eoflock));
+
+	return eof;
+}
+
+/** Update the file's end of file hint; if raise_only is set, only if the new
+ * end is beyond the current one, which is what writes need */
+void eof_hint_set(struct jfs *fs, off_t eof, int raise_only)
+{
+	pthread_mutex_lock(&(fs->eoflock));
+	if (!raise_only || eof > fs->eof_hint)
+		fs->eof_hint = eof;
+	pthread_mutex_unlock(&(fs->eoflock));
+}
+
+/** Give the kernel the advice about the ranges of the operations in the
+ * given directions (a mask of D_READ and D_WRITE) that begin before eof.
+ * Operations that are close together get a single call covering all of
+ * them. */
+static void advise_ranges(struct jtrans *ts, int directions, off_t eof,
+		int advice)
+{
+	off_t start, end;
+	struct operation *op;
+
+	start = end = 0;
+	for (op = ts->op; op != NULL; op = op->next) {
+		if (!(op->direction & directions))
+			continue;
+		if (op->offset >= eof)
+			continue;
+
+		if (end > start && op->offset >= start &&
+				op->offset <= end + READAHEAD_GAP) {
+			if (op->offset + op->len > end)
+				end = op->offset + op->len;
+			continue;
+		}
+
+		if (end > start)
+			posix_fadvise(ts->fs->fd, start, end - start, advice);
+		start = op->offset;
+		end = op->offset + op->len;
+	}
+
+	if (end > start)
+		posix_fadvise(ts->fs->fd, start, end - start, advice);
+}
+
+/** Tell the kernel about the data the commit is going to read from the
+ * file: the ranges of the read operations and, unless J_NOROLLBACK is set,
+ * of the write operations. The ones beyond the end of the file are skipped
+ * because there is nothing to read there. */
+static void readahead_hint(struct jtrans *ts)
+{
+	int directions = D_READ | D_WRITE;
+
+	if (ts->flags & J_NOROLLBACK)
+		directions = D_READ;
+
+	/* it's only a hint, so a stale eof doesn't do any harm */
+	advise_ranges(ts, directions, eof_hint_get(ts->fs),
+			POSIX_FADV_WILLNEED);
+}
+
+/** Are the lingering transactions over the limits set by jfs_linger_limit()?
+ * Must be called with fs' ltlock held. */
+int linger_full(struct jfs *fs)
+{
+	if (fs->ltrans_max_len && fs->ltrans_len >= fs->ltrans_max_len)
+		return 1;
+	if (fs->ltrans_max_count && fs->ltrans_count >= fs->ltrans_max_count)
+		return 1;
+	return 0;
+}
+
+/** Reserve room for a new lingering transaction of len bytes, waiting until
+ * there is some. The wakeups come from jsync() as it frees them, and from the
+ * commits that give their room back; if there is no autosync thread to call
+ * jsync() for us, we call it ourselves. The room is counted in ltrans_len and
+ * ltrans_count right away, so concurrent commits can't all pass the check,
+ * and must be given back with linger_release() if the transaction doesn't
+ * make it to the list. Returns 0 on success, or -1 on error (with errno set
+ * to EAGAIN if the file is in non-blocking mode and we would have had to
+ * wait, or to the error of the jsync() we were waiting for). */
+static int linger_reserve(struct jfs *fs, size_t len)
+{
+	unsigned int nerrors;
+
+	pthread_mutex_lock(&(fs->ltlock));
+	nerrors = fs->ltrans_nerrors;
+	while (linger_full(fs)) {
+		if (fs->ltrans_limit_flags & J_NONBLOCK) {
+			autosync_check(fs);
+			pthread_mutex_unlock(&(fs->ltlock));
+			errno = EAGAIN;
+			return -1;
+		}
+
+		/* with nothing to free yet, the room is taken by commits in
+		 * progress, and they will wake us up */
+		if (fs->as_cfg == NULL && fs->ltrans != NULL) {
+			pthread_mutex_unlock(&(fs->ltlock));
+			if (jsync(fs) != 0)
+				return -1;
+			pthread_mutex_lock(&(fs->ltlock));
+			continue;
+		}
+
+		autosync_check(fs);
+		pthread_cond_wait(&(fs->ltcond), &(fs->ltlock));
+
+		if (fs->ltrans_nerrors != nerrors) {
+			errno = fs->ltrans_error;
+			pthread_mutex_unlock(&(fs->ltlock));
+			return -1;
+		}
+	}
+
+	fs->ltrans_len += len;
+	fs->ltrans_count++;
+	pthread_mutex_unlock(&(fs->ltlock));
+
+	return 0;
+}
+
+/** Give back the room reserved with linger_reserve() */
+static void linger_release(struct jfs *fs, size_t len)
+{
+	pthread_mutex_lock(&(fs->ltlock));
+	fs->ltrans_len -= len;
+	fs->ltrans_count--;
+	pthread_cond_broadcast(&(fs->ltcond));
+	pthread_mutex_unlock(&(fs->ltlock));
+}
+
+/** Can the transaction be committed with commit_append()? It can if it's
+ * made only of writes that go one right after the other, starting at the
+ * current end of the file, and it's not lingering (since the data must be
+ * synced before the commit returns). Must be called with the ranges locked,
+ * and on success the current end of the file is stored in *eof. */
+static int is_append(struct jtrans *ts, off_t *eof)
+{
+	off_t end;
+	struct stat sinfo;
+	struct operation *op;
+
+	if (!(ts->flags & J_ORDERED) || (ts->flags & J_LINGER) ||
+			ts->numops_r > 0 || ts->numops_fd > 0 ||
+			ts->len_w == 0 || ts->jop != NULL)
+		return 0;
+
+	if (fstat(ts->fs->fd, &sinfo) != 0)
+		return 0;
 
-	op->plen = op->len;
-	if (rv < op->len) {
-		/* we are extending the file! */
-		/* ftruncate(ts->fs->fd, op->offset + op->len); */
-		op->plen = rv;
+	end = sinfo.st_size;
+	for (op = ts->op; op != NULL; op = op->next) {
+		if (op->offset != end)
+			return 0;
+		end += op->len;
 	}
 
-	return 0;
+	*eof = sinfo.st_size;
+	return 1;
 }
 
-/** Common function to add an operation to a transaction */
-static int jtrans_add_common(struct jtrans *ts, const void *buf, size_t count,
-		off_t offset, enum op_direction direction)
+/** Commit a transaction that only appends data to the file, which must have
+ * been checked with is_append(). There is no previous data to protect, so
+ * instead of journaling the data we only journal the intent of appending it,
+ * and then write the data (only once) and sync it. If we crash before the
+ * intent is removed, jfsck() undoes the append with journal_undo_append(),
+ * which is also used here if the commit fails. The ranges must be locked.
+ * The statistics are gathered in acc. Returns the same as do_commit(). */
+static ssize_t commit_append(struct jtrans *ts, off_t eof,
+		struct jstats_acc *acc)
 {
-	struct operation *op, *tmpop;
-
-	op = tmpop = NULL;
-
-	pthread_mutex_lock(&(ts->lock));
+	ssize_t r, retval = -1;
+	struct operation *op;
+	struct journal_intent intent;
+	struct timespec start;
+	jop_t *jop;
 
-	/* Writes are not allowed in read-only mode, they fail early */
-	if ((ts->flags & J_RDONLY) && direction == D_WRITE)
-		goto error;
+	intent.type = JOURNAL_INTENT_APPEND;
+	intent.oldlen = eof;
+	intent.newlen = eof + ts->len_w;
 
-	if (count == 0)
-		goto error;
+	stats_start(acc, J_PHASE_JWRITE, &start);
+	jop = journal_new(ts->fs, ts->flags, 1);
+	if (jop == NULL)
+		return -1;
+	ts->id = jop->id;
 
-	if ((long long) ts->len_w + count > MAX_TSIZE)
-		goto error;
+	if (journal_add_intent(jop, &intent) != 0)
+		goto unlink_exit;
+	stats_phase(acc, J_PHASE_JWRITE, &start);
 
-	op = malloc(sizeof(struct operation));
-	if (op == NULL)
-		goto error;
+	journal_pre_commit(jop);
+	if (journal_commit(jop) != 0)
+		goto unlink_exit;
 
-	if (direction == D_WRITE) {
-		op->buf = malloc(count);
-		if (op->buf == NULL)
-			goto error;
+	fiu_exit_on("jio/commit/append_intent");
 
-		ts->numops_w++;
-	} else {
-		ts->numops_r++;
-	}
+	stats_start(acc, J_PHASE_APPLY, &start);
+	for (op = ts->op; op != NULL; op = op->next) {
+		/* there was nothing there before, jtrans_rollback() will
+		 * truncate the file back */
+		op->plen = 0;
+		op->pdata = NULL;
 
-	/* add op to the end of the linked list */
-	op->next = NULL;
-	if (ts->op == NULL) {
-		ts->op = op;
-		op->prev = NULL;
-	} else {
-		for (tmpop = ts->op; tmpop->next != NULL; tmpop = tmpop->next)
-			;
-		tmpop->next = op;
-		op->prev = tmpop;
+		if (op->iov)
+			r = spwritev(ts->fs->fd, op->iov, op->iovcnt,
+					op->offset);
+		else
+			r = spwrite(ts->fs->fd, op->buf, op->len, op->offset);
+		if (r != op->len)
+			goto truncate_exit;
 	}
+	stats_phase(acc, J_PHASE_APPLY, &start);
 
-	pthread_mutex_unlock(&(ts->lock));
-
-	op->len = count;
-	op->offset = offset;
-	op->plen = 0;
-	op->pdata = NULL;
-	op->locked = 0;
-	op->direction = direction;
+	eof_hint_set(ts->fs, intent.newlen, 1);
 
-	if (direction == D_WRITE) {
-		memcpy(op->buf, buf, count);
+	/* fdatasync() also syncs the new size of the file */
+	stats_start(acc, J_PHASE_DATASYNC, &start);
+	if (fdatasync(ts->fs->fd) != 0)
+		goto truncate_exit;
+	stats_phase(acc, J_PHASE_DATASYNC, &start);
 
-		if (!(ts->flags & J_NOROLLBACK)) {
-			/* jtrans_commit() will want to read the current data,
-			 * so we tell the kernel about that */
-			posix_fadvise(ts->fs->fd, offset, count,
-					POSIX_FADV_WILLNEED);
-		}
-	} else {
-		/* this casts the const away, which is ugly but let us have a
-		 * common read/write path and avoid useless code repetition
-		 * just to handle it */
-		op->buf = (void *) buf;
+	fiu_exit_on("jio/commit/append_data");
 
-		/* if there are no overlapping writes, jtrans_commit() will
-		 * want to read the data from the disk; and if there are we
-		 * will already have submitted a request and one more won't
-		 * hurt */
-		posix_fadvise(ts->fs->fd, offset, count, POSIX_FADV_WILLNEED);
-	}
+	if (ts->flags & J_DROPCACHE)
+		advise_ranges(ts, D_WRITE, intent.newlen, POSIX_FADV_DONTNEED);
 
-	return 0;
+	ts->flags = ts->flags | J_COMMITTED;
+	stats_commit(acc, ts->numops_r + ts->numops_w);
+	retval = 1;
+	goto unlink_exit;
 
-error:
-	pthread_mutex_unlock(&(ts->lock));
+truncate_exit:
+	/* undo it the same way jfsck() would */
+	if (journal_undo_append(ts->fs->fd, &intent) == 0 &&
+			fdatasync(ts->fs->fd) == 0) {
+		ts->flags = ts->flags | J_ROLLBACKED;
+		stats_rollback(acc);
+	} else
+		retval = -2;
 
-	if (op && direction == D_WRITE)
-		free(op->buf);
-	free(op);
+unlink_exit:
+	/* like in do_commit(), the intent is only removed if the data is
+	 * safe */
+	stats_add(&(jop->stats), acc);
+	r = journal_free(jop, (ts->flags & (J_COMMITTED | J_ROLLBACKED)) ?
+			1 : 0);
+	if (r != 0)
+		retval = -2;
 
-	return -1;
+	return retval;
 }
 
-int jtrans_add_r(struct jtrans *ts, void *buf, size_t count, off_t offset)
+/** Write the data of an operation streamed from a file (which has no buffer)
+ * by reading it back from the transaction file, a window at a time. Returns
+ * the number of bytes written, or -1 on error. */
+static ssize_t apply_from_journal(struct jtrans *ts, jop_t *jop,
+		struct operation *op)
 {
-	return jtrans_add_common(ts, buf, count, offset, D_READ);
+	ssize_t rv = -1;
+	size_t done, count, bufsize;
+	unsigned char *buf;
+
+	buf = pool_get(&(ts->fs->pool), JOURNAL_READ_WINDOW, &bufsize);
+	if (buf == NULL)
+		return -1;
+
+	for (done = 0; done < op->len; done += count) {
+		count = op->len - done;
+		if (count > bufsize)
+			count = bufsize;
+
+		if (spread(jop->fd, buf, count, op->joffset + done) != count)
+			goto exit;
+		if (spwrite(ts->fs->fd, buf, count, op->offset + done)
+				!= count)
+			goto exit;
+	}
+
+	rv = op->len;
+
+exit:
+	pool_put(&(ts->fs->pool), buf, bufsize);
+	return rv;
 }
 
-int jtrans_add_w(struct jtrans *ts, const void *buf, size_t count,
-		off_t offset)
+/** Write the data of a write operation to the file. Big operations are
+ * copied from the transaction file inside the kernel (which can share the
+ * blocks, on filesystems that support it), falling back to writing them from
+ * memory if that's not possible. Sets *copied if the data was copied inside
+ * the kernel. Returns the number of bytes written, or -1 on error. */
+static ssize_t apply_op(struct jtrans *ts, jop_t *jop, struct operation *op,
+		int *copied)
 {
-	return jtrans_add_common(ts, buf, count, offset, D_WRITE);
-}
+	int only_journal;
+
+	/* the data of operations streamed from a file, and of the ones of
+	 * incremental transactions, is only in the transaction file */
+	only_journal = op->srcfd >= 0 || op->journaled;
+
+	if (jop && jop->keep_cache &&
+			(op->len >= COPY_RANGE_MIN || only_journal) &&
+			copy_range(jop->fd, op->joffset, ts->fs->fd,
+				op->offset, op->len) == op->len) {
+		*copied = 1;
+		return op->len;
+	}
 
+	if (only_journal)
+		return apply_from_journal(ts, jop, op);
 
-/* Commit a transaction */
-ssize_t jtrans_commit(struct jtrans *ts)
+	if (op->iov)
+		return spwritev(ts->fs->fd, op->iov, op->iovcnt, op->offset);
+
+	return spwrite(ts->fs->fd, op->buf, op->len, op->offset);
+}
+
+/** Commit a transaction, without taking its lock; used by jtrans_commit()
+ * and jtrans_commit_single() */
+static ssize_t do_commit(struct jtrans *ts)
 {
 	ssize_t r, retval = -1;
 	struct operation *op;
 	struct jlinger *linger;
 	jop_t *jop = NULL;
 	size_t written = 0;
+	int copied = 0;
+	int untouched = 1;
+	off_t eof;
+	int reserved = 0;
+	struct timespec start;
+	struct jstats_acc acc;
 
-	pthread_mutex_lock(&(ts->lock));
+	stats_acc_init(&acc, ts->fs, ts->flags);
 
 	/* clear the flags */
 	ts->flags = ts->flags & ~J_COMMITTED;
 	ts->flags = ts->flags & ~J_ROLLBACKED;
+	ts->id = 0;
+
+	trace3(commit__start, ts, ts->numops_r + ts->numops_w, ts->len_w);
 
 	if (ts->numops_r + ts->numops_w == 0)
 		goto exit;
@@ -278,6 +1173,26 @@ ssize_t jtrans_commit(struct jtrans *ts)
 	if (ts->numops_w && (ts->flags & J_RDONLY))
 		goto exit;
 
+	/* the data of incremental transactions is gone along with their
+	 * transaction file once they're committed */
+	if (ts->jop == NULL) {
+		for (op = ts->op; op != NULL; op = op->next) {
+			if (op->journaled)
+				goto exit;
+		}
+	}
+
+	/* reserve room for lingering transactions (waiting for it if there
+	 * are limits) before locking, so we don't hold anybody else back
+	 * meanwhile; rollbacks don't wait, as the transaction they undo holds
+	 * the file's ranges locked */
+	if (ts->numops_w && (ts->flags & J_LINGER) &&
+			!(ts->flags & J_ROLLBACKING)) {
+		if (linger_reserve(ts->fs, ts->len_w) != 0)
+			goto exit;
+		reserved = 1;
+	}
+
 	/* Lock all the regions we're going to work with; otherwise there
 	 * could be another transaction trying to write the same spots and we
 	 * could end up with interleaved writes, that could break atomicity
@@ -285,34 +1200,72 @@ ssize_t jtrans_commit(struct jtrans *ts)
 	 * Note we do this before creating a new transaction, so we know it's
 	 * not possible to have two overlapping transactions on disk at the
 	 * same time. */
+	stats_start(&acc, J_PHASE_LOCK, &start);
 	if (lock_file_ranges(ts, F_LOCKW) != 0)
 		goto unlock_exit;
+	stats_phase(&acc, J_PHASE_LOCK, &start);
+
+	/* appends have nothing to read, and don't need their data journaled */
+	if (is_append(ts, &eof)) {
+		retval = commit_append(ts, eof, &acc);
+		goto unlock_exit;
+	}
+
+	/* the reads will happen after the journal is written, which gives
+	 * the kernel time to bring the data in */
+	readahead_hint(ts);
 
 	/* create and fill the transaction file only if we have at least one
-	 * write operation */
-	if (ts->numops_w) {
-		jop = journal_new(ts->fs, ts->flags);
+	 * write operation, and it wasn't filled as they were added */
+	stats_start(&acc, J_PHASE_JWRITE, &start);
+	if (ts->jop != NULL) {
+		jop = ts->jop;
+		ts->jop = NULL;
+	} else if (ts->numops_w) {
+		jop = journal_new(ts->fs, ts->flags, 0);
 		if (jop == NULL)
 			goto unlock_exit;
 	}
+	if (jop)
+		ts->id = jop->id;
 
 	for (op = ts->op; op != NULL; op = op->next) {
-		if (op->direction == D_READ)
+		if (op->direction == D_READ || op->journaled)
 			continue;
 
-		r = journal_add_op(jop, op->buf, op->len, op->offset);
+		if (op->srcfd >= 0)
+			r = journal_add_fd(jop, op->srcfd, op->srcoff,
+					op->len, op->offset);
+		else if (op->iov)
+			r = journal_add_opv(jop, op->iov, op->iovcnt,
+					op->len, op->offset);
+		else
+			r = journal_add_op(jop, op->buf, op->len, op->offset);
 		if (r != 0)
 			goto unlink_exit;
 
+		/* big operations, and the ones streamed from a file, are
+		 * applied from the transaction file, so we keep it cached
+		 * until then */
+		op->joffset = jop->last_data;
+		if (op->srcfd >= 0 || (have_copy_range &&
+					op->len >= COPY_RANGE_MIN))
+			jop->keep_cache = 1;
+
 		fiu_exit_on("jio/commit/tf_opdata");
 	}
 
-	if (jop)
+	if (jop) {
 		journal_pre_commit(jop);
+		stats_phase(&acc, J_PHASE_JWRITE, &start);
+	}
 
 	fiu_exit_on("jio/commit/tf_data");
 
-	if (!(ts->flags & J_NOROLLBACK)) {
+	/* operations streamed from a file have no previous data, as it
+	 * could be too big to keep in memory */
+	if (!(ts->flags & J_NOROLLBACK) && ts->numops_fd == 0 && jop) {
+		stats_start(&acc, J_PHASE_READPREV, &start);
 		for (op = ts->op; op != NULL; op = op->next) {
 			if (op->direction == D_READ)
 				continue;
@@ -321,8 +1274,13 @@ ssize_t jtrans_commit(struct jtrans *ts)
 			 if (r < 0)
 				 goto unlink_exit;
 		}
+		stats_phase(&acc, J_PHASE_READPREV, &start);
 	}
 
+	/* up to here, a failure leaves an incomplete transaction file and the
+	 * file untouched */
+	untouched = 0;
+
 	if (jop) {
 		r = journal_commit(jop);
 		if (r < 0)
@@ -331,6 +1289,8 @@ ssize_t jtrans_commit(struct jtrans *ts)
 
 	/* now that we have a safe transaction file, let's apply it */
 	written = 0;
+	eof = 0;
+	stats_start(&acc, J_PHASE_APPLY, &start);
 	for (op = ts->op; op != NULL; op = op->next) {
 		if (op->direction == D_READ) {
 			r = spread(ts->fs->fd, op->buf, op->len, op->offset);
@@ -342,15 +1302,17 @@ ssize_t jtrans_commit(struct jtrans *ts)
 
 		/* from now on, write ops (which are more interesting) */
 
-		r = spwrite(ts->fs->fd, op->buf, op->len, op->offset);
+		r = apply_op(ts, jop, op, &copied);
 		if (r != op->len)
 			goto rollback_exit;
 
 		written += r;
+		if (op->offset + op->len > eof)
+			eof = op->offset + op->len;
 
 		if (have_sync_range && !(ts->flags & J_LINGER)) {
-			r = sync_range_submit(ts->fs->fd, op->len,
-					op->offset);
+			r = sync_range_submit(ts->fs->fd, op->offset,
+					op->len);
 			if (r != 0)
 				goto rollback_exit;
 		}
@@ -358,8 +1320,14 @@ ssize_t jtrans_commit(struct jtrans *ts)
 		fiu_exit_on("jio/commit/wrote_op");
 	}
 
+	eof_hint_set(ts->fs, eof, 1);
+	stats_phase(&acc, J_PHASE_APPLY, &start);
+
 	fiu_exit_on("jio/commit/wrote_all_ops");
 
+	if (jop && jop->keep_cache)
+		posix_fadvise(jop->fd, 0, 0, POSIX_FADV_DONTNEED);
+
 	if (jop && (ts->flags & J_LINGER)) {
 		struct jlinger *lp;
 
@@ -368,6 +1336,7 @@ ssize_t jtrans_commit(struct jtrans *ts)
 			goto rollback_exit;
 
 		linger->jop = jop;
+		linger->len = ts->len_w;
 		linger->next = NULL;
 
 		pthread_mutex_lock(&(ts->fs->ltlock));
@@ -382,21 +1351,33 @@ ssize_t jtrans_commit(struct jtrans *ts)
 			lp->next = linger;
 		}
 
-		ts->fs->ltrans_len += written;
+		/* the room was reserved before, except for rollbacks */
+		if (!reserved) {
+			ts->fs->ltrans_len += linger->len;
+			ts->fs->ltrans_count++;
+		}
+		reserved = 0;
+
 		autosync_check(ts->fs);
 
+		/* waiters without an autosync thread can jsync() it now */
+		pthread_cond_broadcast(&(ts->fs->ltcond));
 		pthread_mutex_unlock(&(ts->fs->ltlock));
 
 		/* Leave the journal_free() up to jsync() */
 		jop = NULL;
 	} else if (jop) {
-		if (have_sync_range) {
+		/* data copied with copy_range() may have been reflinked, and
+		 * then sync_file_range() writes no extent metadata, so only
+		 * fdatasync() makes it durable */
+		stats_start(&acc, J_PHASE_DATASYNC, &start);
+		if (have_sync_range && !copied) {
 			for (op = ts->op; op != NULL; op = op->next) {
 				if (op->direction == D_READ)
 					continue;
 
-				r = sync_range_wait(ts->fs->fd, op->len,
-						op->offset);
+				r = sync_range_wait(ts->fs->fd, op->offset,
+						op->len);
 				if (r != 0)
 					goto rollback_exit;
 			}
@@ -404,10 +1385,18 @@ ssize_t jtrans_commit(struct jtrans *ts)
 			if (fdatasync(ts->fs->fd) != 0)
 				goto rollback_exit;
 		}
+		stats_phase(&acc, J_PHASE_DATASYNC, &start);
+
+		/* the data is on disk, so its pages can be dropped without
+		 * having to wait */
+		if (ts->flags & J_DROPCACHE)
+			advise_ranges(ts, D_WRITE, eof_hint_get(ts->fs),
+					POSIX_FADV_DONTNEED);
 	}
 
 	/* mark the transaction as committed */
 	ts->flags = ts->flags | J_COMMITTED;
+	stats_commit(&acc, ts->numops_r + ts->numops_w);
 
 	retval = 1;
 
@@ -445,10 +1434,15 @@ unlink_exit:
 	 * will be marked as J_COMMITTED to indicate that the data was
 	 * effectively written to disk. */
 	if (jop) {
-		/* Note we only unlink if we've written down the real data, or
-		 * at least rolled it back properly */
+		/* Note we only unlink if we've written down the real data,
+		 * or at least rolled it back properly, or never got to touch
+		 * it */
 		int data_is_safe = (ts->flags & J_COMMITTED) ||
-			(ts->flags & J_ROLLBACKED);
+			(ts->flags & J_ROLLBACKED) || untouched;
+
+		/* our statistics are merged along with the transaction
+		 * file's */
+		stats_add(&(jop->stats), &acc);
 		r = journal_free(jop, data_is_safe ? 1 : 0);
 		if (r != 0)
 			retval = -2;
@@ -463,17 +1457,109 @@ unlock_exit:
 	lock_file_ranges(ts, F_UNLOCK);
 
 exit:
-	pthread_mutex_unlock(&(ts->lock));
+	if (reserved)
+		linger_release(ts->fs, ts->len_w);
 
+	/* only the statistics of lingering transactions are left here */
+	stats_merge(&acc);
+
+	trace4(commit__end, ts, ts->id, retval, ts->len_w);
 	return retval;
 }
 
+/* Commit a transaction */
+ssize_t jtrans_commit(struct jtrans *ts)
+{
+	ssize_t rv;
+
+	pthread_mutex_lock(&(ts->lock));
+	rv = do_commit(ts);
+	pthread_mutex_unlock(&(ts->lock));
+
+	return rv;
+}
+
+/** Commit a transaction made of a single write operation, whose data is
+ * gathered from the given buffers. It's equivalent to jtrans_new() +
+ * jtrans_add_w() + jtrans_commit() + jtrans_free(), but the transaction
+ * lives in the stack, nobody else can see it so it needs no locking, and the
+ * data is journaled and applied straight from the caller's buffers. Used by
+ * the UNIX API. Returns the same as jtrans_commit(). */
+ssize_t jtrans_commit_single(struct jfs *fs, const struct iovec *iov,
+		int iovcnt, off_t offset)
+{
+	int i;
+	ssize_t rv;
+	size_t count;
+	struct jtrans ts;
+	struct operation op;
+
+	count = 0;
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > MAX_TSIZE - count)
+			return -1;
+		count += iov[i].iov_len;
+	}
+
+	/* the same checks jtrans_add_w() does */
+	if ((fs->flags & J_RDONLY) || count == 0 || count > MAX_OPSIZE)
+		return -1;
+
+	/* the buffers are never written to nor freed, we just cast the const
+	 * away to fit in the operation; a single buffer is handled as usual */
+	op.buf = NULL;
+	op.iov = iov;
+	op.iovcnt = iovcnt;
+	op.batched = 0;
+	if (iovcnt == 1) {
+		op.buf = iov[0].iov_base;
+		op.iov = NULL;
+		op.iovcnt = 0;
+	}
+	op.len = count;
+	op.offset = offset;
+	op.srcfd = -1;
+	op.journaled = 0;
+	op.plen = 0;
+	op.pdata = NULL;
+	op.pown = NULL;
+	op.pownsize = 0;
+	op.own = NULL;
+	op.ownsize = 0;
+	op.locked = 0;
+	op.direction = D_WRITE;
+	op.prev = NULL;
+	op.next = NULL;
+
+	ts.fs = fs;
+	ts.id = 0;
+	ts.flags = fs->flags;
+	ts.op = &op;
+	ts.last_op = &op;
+	ts.batches = NULL;
+	ts.spare_ops = NULL;
+	ts.spare_batches = NULL;
+	ts.chunks = NULL;
+	ts.numops_r = 0;
+	ts.numops_w = 1;
+	ts.len_w = count;
+	ts.numops_fd = 0;
+	ts.jop = NULL;
+
+	rv = do_commit(&ts);
+
+	pool_put(&(fs->pool), op.pown, op.pownsize);
+
+	return rv;
+}
+
 /* Rollback a transaction */
 ssize_t jtrans_rollback(struct jtrans *ts)
 {
 	ssize_t rv;
 	struct jtrans *newts;
-	struct operation *op, *curop, *lop;
+	struct operation *op, *curop;
+	struct jstats_acc acc;
 
 	newts = jtrans_new(ts->fs, 0);
 	if (newts == NULL)
@@ -483,18 +1569,16 @@ ssize_t jtrans_rollback(struct jtrans *ts)
 	newts->numops_r = 0;
 	newts->numops_w = 0;
 	newts->len_w = 0;
+	newts->numops_fd = 0;
+	newts->jop = NULL;
 
-	if (ts->op == NULL || ts->flags & J_NOROLLBACK) {
+	if (ts->op == NULL || ts->flags & J_NOROLLBACK || ts->numops_fd) {
 		rv = -1;
 		goto exit;
 	}
 
-	/* find the last operation */
-	for (op = ts->op; op->next != NULL; op = op->next)
-		;
-
-	/* and traverse the list backwards, skipping read operations */
-	for ( ; op != NULL; op = op->prev) {
+	/* traverse the list backwards, skipping read operations */
+	for (op = ts->last_op; op != NULL; op = op->prev) {
 		if (op->direction == D_READ)
 			continue;
 
@@ -512,7 +1596,7 @@ ssize_t jtrans_rollback(struct jtrans *ts)
 		}
 
 		/* manually add the operation to the new transaction */
-		curop = malloc(sizeof(struct operation));
+		curop = get_op(newts);
 		if (curop == NULL) {
 			rv = -1;
 			goto exit;
@@ -522,38 +1606,30 @@ ssize_t jtrans_rollback(struct jtrans *ts)
 		curop->len = op->plen;
 		curop->buf = op->pdata;
 		curop->plen = op->plen;
-		curop->pdata = op->pdata;
+		curop->iov = NULL;
+		curop->iovcnt = 0;
+		curop->batched = 0;
+		curop->srcfd = -1;
+		curop->journaled = 0;
 		curop->direction = op->direction;
 		curop->locked = 0;
 
 		newts->numops_w++;
 		newts->len_w += curop->len;
 
-		/* add the new transaction to the list */
-		if (newts->op == NULL) {
-			newts->op = curop;
-			curop->prev = NULL;
-			curop->next = NULL;
-		} else {
-			for (lop = newts->op; lop->next != NULL; lop = lop->next)
-				;
-			lop->next = curop;
-			curop->prev = lop;
-			curop->next = NULL;
-		}
+		append_op(newts, curop);
 	}
 
 	rv = jtrans_commit(newts);
+	if (rv >= 0) {
+		stats_acc_init(&acc, ts->fs, ts->flags);
+		stats_rollback(&acc);
+		stats_merge(&acc);
+	}
 
 exit:
-	/* Free the transaction, taking care to set buf to NULL first since
-	 * points to the same address as pdata, which would otherwise make
-	 * jtrans_free() attempt to free it twice. We leave the data at
-	 * curop->pdata since it is freed unconditionally, while the action
-	 * on curop->buf depends on the direction of the transaction. */
-	for (curop = newts->op; curop != NULL; curop = curop->next) {
-		curop->buf = NULL;
-	}
+	/* the operations' buf point to our pdata, but they don't own it so
+	 * it's safe to free the transaction */
 	jtrans_free(newts);
 
 	return rv;
@@ -564,12 +1640,13 @@ exit:
  * Basic operations
  */
 
-/* Open a file */
-struct jfs *jopen(const char *name, int flags, int mode, unsigned int jflags)
+/** Open a file, with its own journal or with the shared journal at
+ * shared_jdir if it's not NULL; used by jopen() and jopen_shared() */
+static struct jfs *do_jopen(const char *name, int flags, int mode,
+		unsigned int jflags, const char *shared_jdir)
 {
-	int jfd, rv;
-	unsigned int t;
-	char jdir[PATH_MAX], jlockfile[PATH_MAX];
+	int rv;
+	char jdir[PATH_MAX], path[PATH_MAX];
 	struct stat sinfo;
 	pthread_mutexattr_t attr;
 	struct jfs *fs;
@@ -583,6 +1660,12 @@ struct jfs *jopen(const char *name, int flags, int mode, unsigned int jflags)
 	fs->jdir = NULL;
 	fs->jdirfd = -1;
 	fs->jmap = MAP_FAILED;
+	fs->fanout = 0;
+	fs->fanout_fds = NULL;
+	fs->trans = NULL;
+	fs->stale_jops = NULL;
+	fs->shared = NULL;
+	fs->shared_name = NULL;
 	fs->as_cfg = NULL;
 
 	/* we provide either read-only or read-write access, because when we
@@ -603,6 +1686,13 @@ struct jfs *jopen(const char *name, int flags, int mode, unsigned int jflags)
 	fs->open_flags = flags;
 	fs->ltrans = NULL;
 	fs->ltrans_len = 0;
+	fs->ltrans_count = 0;
+	fs->ltrans_error = 0;
+	fs->ltrans_nerrors = 0;
+	fs->ltrans_max_len = 0;
+	fs->ltrans_max_count = 0;
+	fs->ltrans_limit_flags = 0;
+	fs->sync_mode = J_SYNC_FSYNC;
 
 	/* Note on fs->lock usage: this lock is used only to protect the file
 	 * pointer. This means that it must only be held while performing
@@ -616,27 +1706,63 @@ struct jfs *jopen(const char *name, int flags, int mode, unsigned int jflags)
 	 * it here. If performance is essential, the jpread/jpwrite functions
 	 * should be used, just as real life.
 	 * About fs->ltlock, it's used to protect the lingering transactions
-	 * list, fs->ltrans. */
+	 * list, fs->ltrans, and fs->ltcond is used to wait on it. */
 	pthread_mutexattr_init(&attr);
 	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL);
 	pthread_mutex_init( &(fs->lock), &attr);
 	pthread_mutex_init( &(fs->ltlock), &attr);
+	pthread_mutex_init( &(fs->tidlock), &attr);
+	pthread_mutex_init( &(fs->jsetup_lock), &attr);
+	pthread_mutex_init( &(fs->translock), &attr);
+	pthread_mutex_init( &(fs->eoflock), &attr);
 	pthread_mutexattr_destroy(&attr);
+	pthread_cond_init(&(fs->ltcond), NULL);
+	pool_init(&(fs->pool));
+	stats_init(&(fs->stats));
 
 	fs->fd = open(name, flags, mode);
 	if (fs->fd < 0)
 		goto error_exit;
 
+	if (fstat(fs->fd, &sinfo) != 0)
+		goto error_exit;
+	fs->eof_hint = sinfo.st_size;
+
 	/* nothing else to do for read-only access */
 	if (jflags & J_RDONLY) {
 		return fs;
 	}
 
-	if (!get_jdir(name, jdir))
+	if (shared_jdir != NULL) {
+		/* the transactions in a shared journal are tagged with the
+		 * identity of the file, so jfsck() can tell them apart; sinfo
+		 * still has the fstat() from above */
+		fs->dev = sinfo.st_dev;
+		fs->ino = sinfo.st_ino;
+
+		if (realpath(name, path) == NULL)
+			goto error_exit;
+		fs->shared_name = strdup(path);
+		if (fs->shared_name == NULL)
+			goto error_exit;
+
+		fs->shared = jshared_get(shared_jdir);
+		if (fs->shared == NULL)
+			goto error_exit;
+
+		/* use the path every file sharing the journal agrees on */
+		strcpy(jdir, fs->shared->jdir);
+	} else if (!get_jdir(name, jdir)) {
+		goto error_exit;
+	}
+
+	/* the journal is set up by journal_setup() on the first transaction,
+	 * here we only check that the journal directory, if it exists, is
+	 * really a directory (or a symlink to one) */
+	rv = stat(jdir, &sinfo);
+	if (rv < 0 && errno != ENOENT)
 		goto error_exit;
-	mkdir(jdir, 0750);
-	rv = lstat(jdir, &sinfo);
-	if (rv < 0 || !S_ISDIR(sinfo.st_mode))
+	if (rv == 0 && !S_ISDIR(sinfo.st_mode))
 		goto error_exit;
 
 	fs->jdir = malloc(strlen(jdir) + 1);
@@ -644,37 +1770,13 @@ struct jfs *jopen(const char *name, int flags, int mode, unsigned int jflags)
 		goto error_exit;
 	strcpy(fs->jdir, jdir);
 
-	/* open the directory, we will use it to flush transaction files'
-	 * metadata in jtrans_commit() */
-	fs->jdirfd = open(jdir, O_RDONLY);
-	if (fs->jdirfd < 0)
-		goto error_exit;
-
-	snprintf(jlockfile, PATH_MAX, "%s/lock", jdir);
-	jfd = open(jlockfile, O_RDWR | O_CREAT, 0600);
-	if (jfd < 0)
-		goto error_exit;
-
-	fs->jfd = jfd;
-
-	/* initialize the lock file by writing the first tid to it, but only
-	 * if its empty, otherwise there is a race if two processes call
-	 * jopen() simultaneously and both initialize the file */
-	plockf(jfd, F_LOCKW, 0, 0);
-	lstat(jlockfile, &sinfo);
-	if (sinfo.st_size != sizeof(unsigned int)) {
-		t = 0;
-		rv = spwrite(jfd, &t, sizeof(t), 0);
-		if (rv != sizeof(t)) {
+	/* if the journal has transactions pending (maybe left over by a
+	 * crash, waiting for jfsck()), set it up right away like we always
+	 * used to, so we fail here if it can't be used */
+	if (rv == 0 && journal_pending(fs)) {
+		if (journal_setup(fs) != 0)
 			goto error_exit;
-		}
 	}
-	plockf(jfd, F_UNLOCK, 0, 0);
-
-	fs->jmap = (unsigned int *) mmap(NULL, sizeof(unsigned int),
-			PROT_READ | PROT_WRITE, MAP_SHARED, jfd, 0);
-	if (fs->jmap == MAP_FAILED)
-		goto error_exit;
 
 	return fs;
 
@@ -686,6 +1788,24 @@ error_exit:
 	return NULL;
 }
 
+/* Open a file */
+struct jfs *jopen(const char *name, int flags, int mode, unsigned int jflags)
+{
+	return do_jopen(name, flags, mode, jflags, NULL);
+}
+
+/* Open a file using a shared journal */
+struct jfs *jopen_shared(const char *name, int flags, int mode,
+		unsigned int jflags, const char *jdir)
+{
+	if (jdir == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return do_jopen(name, flags, mode, jflags, jdir);
+}
+
 /* Sync a file */
 int jsync(struct jfs *fs)
 {
@@ -695,28 +1815,199 @@ int jsync(struct jfs *fs)
 	if (fs->fd < 0)
 		return -1;
 
+	trace1(jsync__start, fs);
+
+	/* lingering transactions may have been applied with copy_range(),
+	 * so this has to be a full fdatasync() and never a ranged sync (see
+	 * do_commit()) */
 	rv = fdatasync(fs->fd);
-	if (rv != 0)
-		return rv;
 
 	/* note the jops will be in order, so if we crash or fail in the
 	 * middle of this, there will be no problem applying the remaining
 	 * transactions */
 	pthread_mutex_lock(&(fs->ltlock));
-	while (fs->ltrans != NULL) {
+	while (rv == 0 && fs->ltrans != NULL) {
 		fiu_exit_on("jio/jsync/pre_unlink");
-		if (journal_free(fs->ltrans->jop, 1) != 0) {
-			pthread_mutex_unlock(&(fs->ltlock));
-			return -1;
-		}
+		rv = journal_free(fs->ltrans->jop, 1);
+		if (rv != 0)
+			break;
 
 		ltmp = fs->ltrans->next;
+		fs->ltrans_len -= fs->ltrans->len;
+		fs->ltrans_count--;
 		free(fs->ltrans);
 		fs->ltrans = ltmp;
 	}
 
-	fs->ltrans_len = 0;
+	/* wake up the waiters even on errors, they will want to see them
+	 * (the ones waiting for the autosync thread would wait forever
+	 * otherwise) */
+	if (rv != 0) {
+		fs->ltrans_error = errno;
+		fs->ltrans_nerrors++;
+	}
+	pthread_cond_broadcast(&(fs->ltcond));
 	pthread_mutex_unlock(&(fs->ltlock));
+
+	rv = rv == 0 ? 0 : -1;
+	trace2(jsync__end, fs, rv);
+	return rv;
+}
+
+/* Replace the whole contents of the file */
+ssize_t jreplace(struct jfs *fs, const void *buf, size_t count)
+{
+	int fd, dirfd, flags;
+	ssize_t retval = -1;
+	off_t pos;
+	char tmpname[PATH_MAX];
+	char *dirt;
+	struct stat sinfo;
+	struct journal_intent intent;
+	jop_t *jop;
+
+	/* the transactions of a shared journal are tied to the inode, which
+	 * we are about to change */
+	if ((fs->flags & J_RDONLY) || fs->shared != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* lingering transactions must reach the old file first, otherwise
+	 * jfsck() could apply them over the new one */
+	if (jsync(fs) != 0)
+		return -1;
+
+	/* like jtruncate(), we lock the whole file but that doesn't protect
+	 * us from other threads using it */
+	if (!(fs->flags & J_NOLOCK) && plockf(fs->fd, F_LOCKW, 0, 0) == -1)
+		return -1;
+
+	if (fstat(fs->fd, &sinfo) != 0)
+		goto unlock_exit;
+
+	/* journal the intent first, so if we crash from now on jfsck() will
+	 * remove the temporary file; the file itself is only changed by the
+	 * rename(), which is atomic */
+	jop = journal_new(fs, fs->flags, 1);
+	if (jop == NULL)
+		goto unlock_exit;
+
+	intent.type = JOURNAL_INTENT_REPLACE;
+	intent.oldlen = sinfo.st_size;
+	intent.newlen = count;
+	if (journal_add_intent(jop, &intent) != 0)
+		goto journal_exit;
+
+	journal_pre_commit(jop);
+	if (journal_commit(jop) != 0)
+		goto journal_exit;
+
+	fiu_exit_on("jio/replace/intent");
+
+	/* the temporary file is opened the same way as the file was, so we
+	 * can use it in its place once it's renamed */
+	if (!get_jrfile(fs->name, jop->id, tmpname))
+		goto journal_exit;
+	flags = (fs->open_flags & ~O_EXCL) | O_CREAT | O_TRUNC;
+	fd = open(tmpname, flags, sinfo.st_mode & 07777);
+	if (fd < 0)
+		goto journal_exit;
+
+	/* open() applies the umask to the mode */
+	if (fchmod(fd, sinfo.st_mode & 07777) != 0)
+		goto tmp_exit;
+
+	if (spwrite(fd, buf, count, 0) != count)
+		goto tmp_exit;
+	if (fsync(fd) != 0)
+		goto tmp_exit;
+
+	fiu_exit_on("jio/replace/tmp_data");
+
+	if (rename(tmpname, fs->name) != 0)
+		goto tmp_exit;
+
+	/* make the rename durable before removing the intent */
+	dirt = strdup(fs->name);
+	if (dirt == NULL)
+		goto swap;
+	dirfd = open(dirname(dirt), O_RDONLY);
+	free(dirt);
+	if (dirfd < 0)
+		goto swap;
+	if (fsync(dirfd) != 0) {
+		close(dirfd);
+		goto swap;
+	}
+	close(dirfd);
+
+	fiu_exit_on("jio/replace/renamed");
+	retval = count;
+
+swap:
+	/* from now on, fs->fd refers to the new file; this also releases our
+	 * lock on the old one */
+	pthread_mutex_lock(&(fs->lock));
+	pos = lseek(fs->fd, 0, SEEK_CUR);
+	if (dup2(fd, fs->fd) < 0) {
+		/* the file has been replaced, but we can't use it */
+		retval = -1;
+	} else {
+		lseek(fs->fd, pos, SEEK_SET);
+		eof_hint_set(fs, count, 0);
+		if (fstat(fs->fd, &sinfo) == 0) {
+			fs->dev = sinfo.st_dev;
+			fs->ino = sinfo.st_ino;
+		}
+	}
+	pthread_mutex_unlock(&(fs->lock));
+	close(fd);
+
+	/* if the rename couldn't be synced, the intent must stay, as it's
+	 * still unknown whether the file will be replaced or not */
+	if (journal_free(jop, retval >= 0) != 0)
+		retval = -1;
+
+	return retval;
+
+tmp_exit:
+	close(fd);
+	unlink(tmpname);
+
+journal_exit:
+	journal_free(jop, 1);
+
+unlock_exit:
+	if (!(fs->flags & J_NOLOCK))
+		plockf(fs->fd, F_UNLOCK, 0, 0);
+
+	return retval;
+}
+
+/* Limit the lingering transactions */
+int jfs_linger_limit(struct jfs *fs, size_t max_bytes, unsigned int max_count,
+		unsigned int flags)
+{
+	pthread_mutex_lock(&(fs->ltlock));
+	fs->ltrans_max_len = max_bytes;
+	fs->ltrans_max_count = max_count;
+	fs->ltrans_limit_flags = flags;
+
+	/* the limits may have been raised, let the waiters check again */
+	pthread_cond_broadcast(&(fs->ltcond));
+	pthread_mutex_unlock(&(fs->ltlock));
+
+	return 0;
+}
+
+/* Set how the transaction files are synced */
+int jfs_sync_mode(struct jfs *fs, unsigned int mode)
+{
+	if (mode != J_SYNC_FSYNC && mode != J_SYNC_DSYNC)
+		return -1;
+
+	fs->sync_mode = mode;
 	return 0;
 }
 
@@ -724,6 +2015,7 @@ int jsync(struct jfs *fs)
 int jmove_journal(struct jfs *fs, const char *newpath)
 {
 	int ret;
+	unsigned int i;
 	char *oldpath, jlockfile[PATH_MAX], oldjlockfile[PATH_MAX];
 
 	/* we try to be sure that all lingering transactions have been
@@ -733,6 +2025,16 @@ int jmove_journal(struct jfs *fs, const char *newpath)
 	 * of operation around when he calls this function */
 	jsync(fs);
 
+	/* shared journals can't be moved from a single file */
+	if (fs->shared) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* the journal may not have been set up yet */
+	if (journal_setup(fs) != 0)
+		return -1;
+
 	oldpath = fs->jdir;
 	snprintf(oldjlockfile, PATH_MAX, "%s/lock", fs->jdir);
 
@@ -756,8 +2058,24 @@ int jmove_journal(struct jfs *fs, const char *newpath)
 		if (ret < 0)
 			goto exit;
 
-		/* remove the journal directory, if possible */
+		/* remove the journal directory, if possible, along with the
+		 * fan-out subdirectories; the destination keeps its own
+		 * layout */
 		unlink(oldjlockfile);
+		if (fs->fanout) {
+			snprintf(oldjlockfile, PATH_MAX, "%s/fanout", oldpath);
+			unlink(oldjlockfile);
+			for (i = 0; i < JOURNAL_FANOUT; i++) {
+				snprintf(oldjlockfile, PATH_MAX, "%s/%u",
+						oldpath, i);
+				rmdir(oldjlockfile);
+			}
+		}
+		snprintf(jlockfile, PATH_MAX, "%s/fanout", newpath);
+		fs->fanout = access(jlockfile, F_OK) == 0;
+		journal_close_fanout(fs->fanout_fds);
+		fs->fanout_fds = NULL;
+
 		ret = rmdir(oldpath);
 		if (ret == -1) {
 			/* we couldn't remove it, something went wrong
@@ -777,6 +2095,8 @@ exit:
 int jclose(struct jfs *fs)
 {
 	int ret;
+	struct jtrans *ts;
+	struct journal_op *jop;
 
 	ret = 0;
 
@@ -786,9 +2106,42 @@ int jclose(struct jfs *fs)
 	if (! (fs->flags & J_RDONLY)) {
 		if (jsync(fs))
 			ret = -1;
-		if (fs->jfd < 0 || close(fs->jfd))
+	}
+
+	/* detach the transactions that weren't freed yet, so jtrans_free()
+	 * doesn't use the file after this; their uncommitted transaction
+	 * files are removed along with the stale ones */
+	pthread_mutex_lock(&(fs->translock));
+	for (ts = fs->trans; ts != NULL; ts = ts->next) {
+		pthread_mutex_lock(&(ts->lock));
+		if (ts->jop != NULL) {
+			ts->jop->next = fs->stale_jops;
+			fs->stale_jops = ts->jop;
+			ts->jop = NULL;
+		}
+		ts->fs = NULL;
+		pthread_mutex_unlock(&(ts->lock));
+	}
+	fs->trans = NULL;
+
+	while (fs->stale_jops != NULL) {
+		jop = fs->stale_jops;
+		fs->stale_jops = jop->next;
+		if (journal_free(jop, 1))
+			ret = -1;
+	}
+	pthread_mutex_unlock(&(fs->translock));
+
+	if (fs->shared) {
+		/* the descriptors belong to the shared journal */
+		if (jshared_put(fs->shared))
+			ret = -1;
+	} else {
+		if (fs->jfd >= 0 && close(fs->jfd))
+			ret = -1;
+		if (fs->jdirfd >= 0 && close(fs->jdirfd))
 			ret = -1;
-		if (fs->jdirfd < 0 || close(fs->jdirfd))
+		if (journal_close_fanout(fs->fanout_fds))
 			ret = -1;
 		if (fs->jmap != MAP_FAILED)
 			munmap(fs->jmap, sizeof(unsigned int));
@@ -801,9 +2154,18 @@ int jclose(struct jfs *fs)
 		free(fs->name);
 	if (fs->jdir)
 		free(fs->jdir);
+	if (fs->shared_name)
+		free(fs->shared_name);
 
 	pthread_mutex_destroy(&(fs->lock));
 	pthread_mutex_destroy(&(fs->ltlock));
+	pthread_mutex_destroy(&(fs->tidlock));
+	pthread_mutex_destroy(&(fs->jsetup_lock));
+	pthread_mutex_destroy(&(fs->translock));
+	pthread_mutex_destroy(&(fs->eoflock));
+	pthread_cond_destroy(&(fs->ltcond));
+	pool_destroy(&(fs->pool));
+	stats_destroy(&(fs->stats));
 
 	free(fs);
 
@@ -3,6 +3,7 @@
 #define _TRANS_H
 
 struct operation;
+struct journal_op;
 
 /** A transaction */
 struct jtrans {
@@ -24,11 +25,41 @@ struct jtrans {
 	/** Sum of the lengths of the write operations */
 	size_t len_w;
 
+	/** Number of write operations added by jtrans_add_w_fd(), which have
+	 * no previous data and so can't be rolled back */
+	unsigned int numops_fd;
+
+	/** Transaction file the write operations are written to as they're
+	 * added (with J_INCREMENTAL), or NULL */
+	struct journal_op *jop;
+
 	/** Lock that protects the list of operations */
 	pthread_mutex_t lock;
 
 	/** List of operations */
 	struct operation *op;
+
+	/** Last operation of the list */
+	struct operation *last_op;
+
+	/** Memory of the operations added by jtrans_add_wv() */
+	struct op_batch *batches;
+
+	/** Operations kept by jtrans_reset() for reuse, along with their
+	 * buffers */
+	struct operation *spare_ops;
+
+	/** Batches kept by jtrans_reset() for reuse */
+	struct op_batch *spare_batches;
+
+	/** Memory of the other operations, which are allocated OP_CHUNK at a
+	 * time so they're close together */
+	struct op_batch *chunks;
+
+	/** Neighbours in the list of transactions of the file (see struct
+	 * jfs), while it's open */
+	struct jtrans *prev;
+	struct jtrans *next;
 };
 
 /** Possible operation directions */
@@ -51,26 +82,85 @@ struct operation {
 	/** Data buffer */
 	void *buf;
 
+	/** Buffer owned by the operation, which buf points to for writes;
+	 * it's kept across jtrans_reset() */
+	void *own;
+
+	/** Size of own */
+	size_t ownsize;
+
+	/** Buffers to gather the data from instead of buf, if not NULL (only
+	 * if direction == D_WRITE); they're owned by the caller */
+	const struct iovec *iov;
+
+	/** Number of buffers in iov */
+	int iovcnt;
+
+	/** File to stream the data from instead of buf, if >= 0 (only if
+	 * direction == D_WRITE), and where in it; see jtrans_add_w_fd() */
+	int srcfd;
+	off_t srcoff;
+
+	/** Was it added by jtrans_add_wv()? Then buf points inside its
+	 * op_batch, or to the caller's memory */
+	int batched;
+
 	/** Direction */
 	enum op_direction direction;
 
+	/** Where the data was saved in the transaction file (only if
+	 * direction == D_WRITE, and it's big enough to be applied from
+	 * there, see apply_op()) */
+	off_t joffset;
+
+	/** Was the data saved in the transaction file when the operation was
+	 * added (see J_INCREMENTAL)? Then it's only there, and buf is NULL */
+	int journaled;
+
 	/** Previous data length (only if direction == D_WRITE) */
 	size_t plen;
 
 	/** Previous data (only if direction == D_WRITE) */
 	void *pdata;
 
+	/** Buffer owned by the operation, which pdata points to if the
+	 * previous data doesn't fit inline; it's kept across jtrans_reset() */
+	void *pown;
+
+	/** Size of pown */
+	size_t pownsize;
+
 	/** Previous operation */
 	struct operation *prev;
 
 	/** Next operation */
 	struct operation *next;
+
+	/** Small data, to avoid allocating a buffer for it */
+	unsigned char inline_buf[OP_INLINE_SIZE];
+
+	/** Small previous data, to avoid allocating a buffer for it */
+	unsigned char inline_pdata[OP_INLINE_SIZE];
+};
+
+/** Memory shared by the operations added together by jtrans_add_wv(),
+ * followed by the operations themselves and, unless J_NOCOPY was given, the
+ * data. Also used to allocate the other operations in chunks. */
+struct op_batch {
+	/** Next batch of the transaction */
+	struct op_batch *next;
+
+	/** Bytes available for the operations and data */
+	size_t size;
+
+	/** The operations */
+	struct operation ops[];
 };
 
 /* lingered transaction */
-struct journal_op;
 struct jlinger {
 	struct journal_op *jop;
+	size_t len;
 	struct jlinger *next;
 };
 
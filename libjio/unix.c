@@ -8,9 +8,11 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "libjio.h"
 #include "common.h"
+#include "compat.h"
 #include "trans.h"
 
 
@@ -72,6 +74,25 @@ ssize_t jreadv(struct jfs *fs, const struct iovec *vector, int count)
 	return rv;
 }
 
+/* preadv() wrapper */
+ssize_t jpreadv(struct jfs *fs, const struct iovec *vector, int count,
+		off_t offset)
+{
+	int i;
+	ssize_t rv;
+	size_t len;
+
+	len = 0;
+	for (i = 0; i < count; i++)
+		len += vector[i].iov_len;
+
+	plockf(fs->fd, F_LOCKR, offset, len);
+	rv = vector_pread(fs->fd, vector, count, offset);
+	plockf(fs->fd, F_UNLOCK, offset, len);
+
+	return rv;
+}
+
 
 /*
  * write() family wrappers
@@ -82,11 +103,10 @@ ssize_t jwrite(struct jfs *fs, const void *buf, size_t count)
 {
 	ssize_t rv;
 	off_t pos;
-	struct jtrans *ts;
+	struct iovec iov;
 
-	ts = jtrans_new(fs, 0);
-	if (ts == NULL)
-		return -1;
+	iov.iov_base = (void *) buf;
+	iov.iov_len = count;
 
 	pthread_mutex_lock(&(fs->lock));
 
@@ -95,21 +115,13 @@ ssize_t jwrite(struct jfs *fs, const void *buf, size_t count)
 	else
 		pos = lseek(fs->fd, 0, SEEK_CUR);
 
-	rv = jtrans_add_w(ts, buf, count, pos);
-	if (rv < 0)
-		goto exit;
-
-	rv = jtrans_commit(ts);
+	rv = jtrans_commit_single(fs, &iov, 1, pos);
 
 	if (rv >= 0)
 		lseek(fs->fd, count, SEEK_CUR);
 
-exit:
-
 	pthread_mutex_unlock(&(fs->lock));
 
-	jtrans_free(ts);
-
 	return (rv >= 0) ? count : rv;
 }
 
@@ -117,66 +129,81 @@ exit:
 ssize_t jpwrite(struct jfs *fs, const void *buf, size_t count, off_t offset)
 {
 	ssize_t rv;
-	struct jtrans *ts;
+	struct iovec iov;
 
-	ts = jtrans_new(fs, 0);
-	if (ts == NULL)
-		return -1;
+	iov.iov_base = (void *) buf;
+	iov.iov_len = count;
+
+	rv = jtrans_commit_single(fs, &iov, 1, offset);
 
-	rv = jtrans_add_w(ts, buf, count, offset);
-	if (rv < 0)
-		goto exit;
+	return (rv >= 0) ? count : rv;
+}
 
-	rv = jtrans_commit(ts);
+/** Return the total length of the given buffers, or -1 (with errno set to
+ * EINVAL, like writev() does) if there are too many or their lengths overflow
+ * an ssize_t */
+static ssize_t iov_sum(const struct iovec *vector, int count)
+{
+	int i;
+	size_t sum;
 
-exit:
-	jtrans_free(ts);
+	if (count < 0 || count > IOV_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	return (rv >= 0) ? count : rv;
+	sum = 0;
+	for (i = 0; i < count; i++) {
+		if (vector[i].iov_len > SSIZE_MAX - sum) {
+			errno = EINVAL;
+			return -1;
+		}
+		sum += vector[i].iov_len;
+	}
+
+	return sum;
 }
 
 /* writev() wrapper */
 ssize_t jwritev(struct jfs *fs, const struct iovec *vector, int count)
 {
-	int i;
-	size_t sum;
-	ssize_t rv;
-	off_t ipos, t;
-	struct jtrans *ts;
+	ssize_t sum, rv;
+	off_t pos;
 
-	ts = jtrans_new(fs, 0);
-	if (ts == NULL)
+	/* the buffers are contiguous in the file, so they're written as a
+	 * single operation */
+	sum = iov_sum(vector, count);
+	if (sum < 0)
 		return -1;
 
 	pthread_mutex_lock(&(fs->lock));
 
 	if (fs->open_flags & O_APPEND)
-		ipos = lseek(fs->fd, 0, SEEK_END);
+		pos = lseek(fs->fd, 0, SEEK_END);
 	else
-		ipos = lseek(fs->fd, 0, SEEK_CUR);
-
-	t = ipos;
-
-	sum = 0;
-	for (i = 0; i < count; i++) {
-		rv = jtrans_add_w(ts, vector[i].iov_base,
-				vector[i].iov_len, t);
-		if (rv < 0)
-			goto exit;
-
-		sum += vector[i].iov_len;
-		t += vector[i].iov_len;
-	}
+		pos = lseek(fs->fd, 0, SEEK_CUR);
 
-	rv = jtrans_commit(ts);
+	rv = jtrans_commit_single(fs, vector, count, pos);
 
 	if (rv >= 0)
 		lseek(fs->fd, sum, SEEK_CUR);
 
-exit:
 	pthread_mutex_unlock(&(fs->lock));
 
-	jtrans_free(ts);
+	return (rv >= 0) ? sum : rv;
+}
+
+/* pwritev() wrapper */
+ssize_t jpwritev(struct jfs *fs, const struct iovec *vector, int count,
+		off_t offset)
+{
+	ssize_t sum, rv;
+
+	sum = iov_sum(vector, count);
+	if (sum < 0)
+		return -1;
+
+	rv = jtrans_commit_single(fs, vector, count, offset);
 
 	return (rv >= 0) ? sum : rv;
 }
@@ -191,6 +218,9 @@ int jtruncate(struct jfs *fs, off_t length)
 	rv = ftruncate(fs->fd, length);
 	plockf(fs->fd, F_UNLOCK, length, 0);
 
+	if (rv == 0)
+		eof_hint_set(fs, length, 0);
+
 	return rv;
 }
 
@@ -223,4 +223,83 @@ def test_f12():
 	assert content(n) == c
 	cleanup(n)
 
+def test_f13():
+	"fail jio/commit/append_data"
+	c = gencontent()
+
+	def f1(f, jf):
+		jf.write(c)
+		fiu.enable("jio/commit/append_data")
+		jf.write(c)
+
+	n = run_with_tmp(f1, libjio.J_ORDERED)
+	assert content(n) == c + c
+	fsck_verify(n, reapplied = 1)
+	assert content(n) == c
+	cleanup(n)
+
+def test_f14():
+	"fail jio/commit/append_intent"
+	c = gencontent()
+
+	def f1(f, jf):
+		jf.write(c)
+		fiu.enable("jio/commit/append_intent")
+		jf.write(c)
+
+	n = run_with_tmp(f1, libjio.J_ORDERED)
+	assert content(n) == c
+	fsck_verify(n, reapplied = 1)
+	assert content(n) == c
+	cleanup(n)
+
+def test_f15():
+	"fail jio/replace/tmp_data"
+	c = gencontent()
+
+	def f1(f, jf):
+		jf.write(c)
+		fiu.enable("jio/replace/tmp_data")
+		jf.replace(c[:100])
+
+	n = run_with_tmp(f1)
+	assert content(n) == c
+	fsck_verify(n, reapplied = 1)
+	assert content(n) == c
+	assert not [x for x in os.listdir(os.path.dirname(n))
+			if 'replace' in x]
+	cleanup(n)
+
+def test_f16():
+	"fail jio/replace/renamed"
+	c = gencontent()
+
+	def f1(f, jf):
+		jf.write(c)
+		fiu.enable("jio/replace/renamed")
+		jf.replace(c[:100])
+
+	n = run_with_tmp(f1)
+	assert content(n) == c[:100]
+	fsck_verify(n, reapplied = 1)
+	assert content(n) == c[:100]
+	cleanup(n)
+
+def test_f17():
+	"fail jio/commit/tf_sync with big operations"
+	c = gencontent(200 * 1024)
+
+	def f1(f, jf):
+		fiu.enable("jio/commit/tf_sync")
+		t = jf.new_trans()
+		t.add_w(c, 0)
+		t.add_w(c[:100], 300 * 1024)
+		t.commit()
+
+	n = run_with_tmp(f1)
+	assert content(n) == ''
+	fsck_verify(n, reapplied = 1)
+	assert content(n) == c + '\0' * (100 * 1024) + c[:100]
+	cleanup(n)
+
 
@@ -2,6 +2,7 @@
 
 # Normal tests.
 
+import errno
 import libjio
 from tf import *
 
@@ -444,3 +445,729 @@ def test_n24():
 	fsck_verify(n)
 	cleanup(n)
 
+
+def test_n25():
+	"shared autosync pool"
+	libjio.autosync_pool_start(2)
+
+	files = []
+	for i in range(5):
+		f, jf = bitmp(jflags = libjio.J_LINGER)
+		jf.autosync_start(60, 10)
+		files.append((f, jf))
+
+	for f, jf in files:
+		jf.write('x' * 200)
+
+	# the pool syncs them right away, as they're over the bytes limit;
+	# wait for it a bounded amount of time
+	for i in range(500):
+		if not [f for f, jf in files
+				if os.path.exists(transpath(f.name, 1))]:
+			break
+		time.sleep(0.01)
+	for f, jf in files:
+		assert content(f.name) == 'x' * 200
+		assert not os.path.exists(transpath(f.name, 1))
+
+	# only one autosync per file
+	try:
+		files[0][1].autosync_start(60, 10)
+	except IOError:
+		pass
+	else:
+		raise AssertionError
+
+	names = []
+	for f, jf in files:
+		jf.autosync_stop()
+		names.append(f.name)
+	del f, jf, files
+
+	libjio.autosync_pool_stop()
+
+	for n in names:
+		fsck_verify(n)
+		cleanup(n)
+
+def test_n26():
+	"lingering transactions limit"
+	c = gencontent(100)
+
+	f, jf = bitmp(jflags = libjio.J_LINGER)
+	n = f.name
+
+	# without autosync, commits over the limit jsync() by themselves
+	jf.linger_limit(0, 2)
+	jf.pwrite(c, 0)
+	jf.pwrite(c, 100)
+	assert os.path.exists(transpath(n, 2))
+	jf.pwrite(c, 200)
+	assert len(os.listdir(jiodir(n))) == 2
+	assert content(n) == c * 3
+
+	# in non-blocking mode, they fail instead
+	jf.linger_limit(150, 0, libjio.J_NONBLOCK)
+	jf.pwrite(c, 300)
+	try:
+		jf.pwrite(c, 400)
+	except IOError:
+		pass
+	else:
+		raise AssertionError
+	assert content(n) == c * 4
+
+	jf.jsync()
+	jf.pwrite(c, 400)
+	assert content(n) == c * 5
+	del jf
+
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n27():
+	"recover many lingering transactions"
+	c = gencontent(1000)
+
+	f, jf = bitmp(jflags = libjio.J_LINGER)
+	n = f.name
+
+	def f1(f, jf):
+		# overlapping transactions, so they depend on each other
+		for i in range(10):
+			t = jf.new_trans()
+			t.add_w(c[i * 50:], i * 50)
+			t.add_w(c[:100], 2000 + i * 100)
+			t.commit()
+		os._exit(0)
+
+	run_forked(f1, f, jf)
+	del jf
+
+	# simulate the data never reaching the disk
+	open(n, 'w').write('\0' * len(content(n)))
+
+	fsck_verify(n, reapplied = 10)
+	assert content(n) == c + '\0' * 1000 + c[:100] * 10
+	cleanup(n)
+
+def test_n28():
+	"recover a transaction bigger than the read window"
+	c1 = gencontent(600 * 1024)
+	c2 = gencontent(300 * 1024)
+
+	f, jf = bitmp(jflags = libjio.J_LINGER)
+	n = f.name
+
+	def f1(f, jf):
+		t = jf.new_trans()
+		t.add_w(c1, 0)
+		t.add_w(c2, 100 * 1024)
+		t.commit()
+		os._exit(0)
+
+	run_forked(f1, f, jf)
+	del jf
+
+	open(n, 'w').write('\0' * len(c1))
+
+	fsck_verify(n, reapplied = 1)
+	assert content(n) == c1[:100 * 1024] + c2 + c1[400 * 1024:]
+	cleanup(n)
+
+def test_n29():
+	"journal created on first write"
+	c = gencontent(100)
+
+	f, jf = bitmp()
+	n = f.name
+
+	jf.read(10)
+	assert not os.path.exists(jiodir(n))
+
+	jf.write(c)
+	assert os.path.isdir(jiodir(n))
+	del jf
+
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n30():
+	"shared journal"
+	c = gencontent(1000)
+	jdir = tmppath()
+
+	f1, jf1 = biopen(tmppath(), jflags = libjio.J_LINGER)
+	f2, jf2 = biopen(tmppath(), jflags = libjio.J_LINGER)
+	n1, n2 = f1.name, f2.name
+	del jf1, jf2
+
+	jf1 = libjio.open_shared(n1, jdir, os.O_RDWR, 0600, libjio.J_LINGER)
+	jf2 = libjio.open_shared(n2, jdir, os.O_RDWR, 0600, libjio.J_LINGER)
+
+	def f(jf1, jf2):
+		jf1.pwrite(c, 0)
+		jf2.pwrite(c, 100)
+		jf1.pwrite(c[:10], 0)
+		jf2.pwrite(c[:10], 0)
+		os._exit(0)
+
+	run_forked(f, jf1, jf2)
+	del jf1, jf2
+
+	assert not os.path.exists(jiodir(n1))
+	assert not os.path.exists(jiodir(n2))
+	assert len(os.listdir(jdir)) == 5
+
+	open(n1, 'w').write('\0' * 1000)
+	open(n2, 'w').write('\0' * 1100)
+
+	# checking a single file leaves the other's transactions alone
+	res = libjio.jfsck(n1, jdir)
+	assert res['total'] == res['reapplied'] == 2
+	assert content(n1) == c
+	assert len(os.listdir(jdir)) == 3
+
+	res = libjio.jfsck_shared(jdir, flags = libjio.J_CLEANUP)
+	assert res['total'] == res['reapplied'] == 2
+	assert content(n2) == c[:10] + '\0' * 90 + c
+	assert not os.path.exists(jdir)
+
+	cleanup(n1)
+	cleanup(n2)
+
+def test_n31():
+	"shared journal opened through different paths"
+	c = gencontent(1000)
+	jdir = tmppath()
+
+	f1, jf1 = biopen(tmppath())
+	f2, jf2 = biopen(tmppath())
+	f3, jf3 = biopen(tmppath())
+	n1, n2, n3 = f1.name, f2.name, f3.name
+	del jf1, jf2, jf3
+
+	nfds = len(os.listdir('/proc/self/fd'))
+
+	jf1 = libjio.open_shared(n1, jdir, os.O_RDWR)
+	jf2 = libjio.open_shared(n2, jdir + '/', os.O_RDWR)
+
+	# the directory is created on the first write
+	assert not os.path.exists(jdir)
+	jf1.pwrite(c, 0)
+	jf2.pwrite(c, 0)
+
+	link = tmppath()
+	os.symlink(jdir, link)
+	jf3 = libjio.open_shared(n3, os.path.relpath(link), os.O_RDWR)
+	jf3.pwrite(c, 0)
+
+	# they all use the same journal: its directory and lock file are
+	# opened only once
+	assert len(os.listdir('/proc/self/fd')) == nfds + 3 + 2
+
+	del jf1, jf2, jf3
+	os.unlink(link)
+	assert content(n1) == content(n2) == content(n3) == c
+	assert os.listdir(jdir) == ['lock']
+
+	res = libjio.jfsck_shared(jdir, flags = libjio.J_CLEANUP)
+	assert res['total'] == 0
+	assert not os.path.exists(jdir)
+
+	cleanup(n1)
+	cleanup(n2)
+	cleanup(n3)
+
+def test_n32():
+	"fan-out journal layout"
+	c = gencontent(1000)
+
+	f, jf = bitmp(jflags = libjio.J_LINGER | libjio.J_FANOUT)
+	n = f.name
+
+	def f1(f, jf):
+		for i in range(300):
+			jf.pwrite(c[:10], i * 10)
+		os._exit(0)
+
+	run_forked(f1, f, jf)
+	del jf
+
+	jd = jiodir(n)
+	assert os.path.exists(jd + '/fanout')
+	assert len(os.listdir(jd)) == 256 + 2
+	assert len(os.listdir(jd + '/44')) == 2
+
+	open(n, 'w').write('\0' * 3000)
+	fsck_verify(n, reapplied = 300)
+	assert content(n) == c[:10] * 300
+	cleanup(n)
+
+def test_n33():
+	"jpwritev and jpreadv"
+	c = gencontent(1000)
+	bufs = [c[i * 40:(i + 1) * 40] for i in range(25)]
+
+	f, jf = bitmp(jflags = libjio.J_LINGER)
+	n = f.name
+
+	def f1(f, jf):
+		jf.pwritev(bufs, 100)
+		os._exit(0)
+
+	run_forked(f1, f, jf)
+	del jf
+
+	open(n, 'w').write('\0' * 1100)
+	fsck_verify(n, reapplied = 1)
+	assert content(n) == '\0' * 100 + c
+
+	jf = libjio.open(n, os.O_RDWR)
+	jf.lseek(10, 0)
+	jf.pwritev(["hello ", "world"], 0)
+	l = [bytearray(".."), bytearray("." * 9)]
+	jf.preadv(l, 1)
+	assert l[0] == "el" and l[1] == "lo world" + '\0'
+	assert jf.lseek(0, 1) == 10
+	del jf
+
+	assert content(n)[:11] == "hello world"
+
+	# too many buffers are rejected before doing anything
+	jf = libjio.open(n, os.O_RDWR)
+	try:
+		jf.pwritev(["x"] * (os.sysconf('SC_IOV_MAX') + 1), 0)
+	except IOError, e:
+		assert e.errno == errno.EINVAL
+	else:
+		raise AssertionError
+	del jf
+
+	assert content(n)[:11] == "hello world"
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n34():
+	"jtrans_add_wv"
+	c = gencontent(1000)
+
+	f, jf = bitmp(jflags = libjio.J_LINGER)
+	n = f.name
+
+	def f1(f, jf):
+		t = jf.new_trans()
+		t.add_w(c[:10], 5000)
+		t.add_wv([(c[i * 10:(i + 1) * 10], i * 20) for i in range(100)])
+		t.add_wv([(c[:50], 3000), (c[50:100], 3030)])
+		t.commit()
+		os._exit(0)
+
+	run_forked(f1, f, jf)
+	del jf
+
+	open(n, 'w').write('\0' * 5010)
+	fsck_verify(n, reapplied = 1)
+
+	expected = list('\0' * 5010)
+	for i in range(100):
+		expected[i * 20:i * 20 + 10] = c[i * 10:(i + 1) * 10]
+	expected[3000:3050] = c[:50]
+	expected[3030:3080] = c[50:100]
+	expected[5000:5010] = c[:10]
+	assert content(n) == ''.join(expected)
+	cleanup(n)
+
+def test_n35():
+	"reuse a transaction with reset"
+	c = gencontent(1000)
+
+	f, jf = bitmp()
+	n = f.name
+
+	t = jf.new_trans()
+	t.add_w(c[:100], 0)
+	t.add_w(c[:10], 500)
+	assert t.commit() == 1
+	for i in range(10):
+		t.reset()
+		t.add_w(c[i * 50:i * 50 + 200], 100 + i * 10)
+		t.add_wv([(c[:5], 900 + i * 5)])
+		assert t.commit() == 1
+
+	# the freed transactions are reused by new ones
+	for i in range(10):
+		t = jf.new_trans()
+		t.add_w(c[i * 10:(i + 1) * 10], 1000 + i * 10)
+		t.commit()
+		del t
+
+	expected = list(c[:100] + '\0' * 400 + c[:10] + '\0' * 390 +
+			c[:5] * 10 + '\0' * 50 + c[:100])
+	for i in range(10):
+		expected[100 + i * 10:300 + i * 10] = c[i * 50:i * 50 + 200]
+	assert content(n) == ''.join(expected)
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n36():
+	"buffer pool reuse and limits"
+	c = gencontent(8 * 1024)
+	big = gencontent(3 * 1024 * 1024)
+
+	f, jf = bitmp()
+	n = f.name
+
+	jf.pool_config(64 * 1024 * 1024, libjio.J_HUGEPAGES)
+	for i in range(10):
+		jf.pwrite(c, i * 1024)
+	t = jf.new_trans()
+	t.add_w(big, 0)
+	t.commit()
+	del t
+	jf.pwrite(big, 1024)
+
+	st = jf.pool_stats()
+	assert st['hits'] > 0
+	assert st['kept'] > 0
+	assert st['kept_bytes'] >= 4 * 1024 * 1024
+
+	jf.pool_config(0)
+	st = jf.pool_stats()
+	assert st['kept'] == 0 and st['kept_bytes'] == 0
+	jf.pwrite(c, 0)
+	assert jf.pool_stats()['drops'] > 0
+
+	assert content(n) == c + big[7 * 1024:]
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n37():
+	"drop the written data from the cache"
+	c = gencontent(200 * 1024)
+
+	f, jf = bitmp(jflags = libjio.J_DROPCACHE)
+	n = f.name
+
+	jf.write(c)
+	t = jf.new_trans()
+	t.add_w(c[:1000], 1000)
+	t.add_w(c[:1000], 300 * 1024)
+	t.commit()
+	del t
+
+	t = jf.new_trans(libjio.J_DROPCACHE)
+	t.add_w(c[:10], 5)
+	t.commit()
+	del t
+
+	assert content(n) == c[:5] + c[:10] + c[15:1000] + c[:1000] + \
+			c[2000:] + '\0' * (100 * 1024) + c[:1000]
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n38():
+	"journal sync modes"
+	c = gencontent(10 * 1024)
+
+	f, jf = bitmp()
+	n = f.name
+
+	jf.sync_mode(libjio.J_SYNC_DSYNC)
+	jf.pwrite(c, 0)
+	t = jf.new_trans()
+	t.add_w(c[:100], 20 * 1024)
+	t.add_w(c[:5000], 100)
+	t.commit()
+	del t
+	jf.sync_mode(libjio.J_SYNC_FSYNC)
+	jf.pwrite(c[:10], 5)
+
+	try:
+		jf.sync_mode(5)
+	except IOError:
+		pass
+	else:
+		raise AssertionError
+
+	assert content(n) == c[:5] + c[:10] + c[15:100] + c[:5000] + \
+			c[5100:] + '\0' * (10 * 1024) + c[:100]
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n39():
+	"ordered mode appends"
+	c = gencontent(10 * 1024)
+
+	f, jf = bitmp(jflags = libjio.J_ORDERED)
+	n = f.name
+
+	jf.write(c)
+	jf.pwrite(c[:100], 10 * 1024)
+	t = jf.new_trans()
+	t.add_w(c[:1000], 10 * 1024 + 100)
+	t.add_w(c[:10], 10 * 1024 + 1100)
+	t.commit()
+	del t
+
+	# not an append, so it goes through the journal as usual
+	t = jf.new_trans()
+	t.add_w(c[:10], 5)
+	t.add_w(c[:10], 20 * 1024)
+	t.commit()
+	del t
+
+	assert content(n) == c[:5] + c[:10] + c[15:] + c[:100] + c[:1000] + \
+			c[:10] + '\0' * (10 * 1024 - 1110) + c[:10]
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n40():
+	"append intent replayed along with a later write past it"
+	f, jf = bitmp(jflags = libjio.J_LINGER)
+	n = f.name
+	c = gencontent(1000)
+	d = gencontent(512 * 1024)
+
+	# a lingering write, which we move to id 2, past the append below
+	jf.pwrite(d, 3000)
+	t = TransFile(transpath(n, 1))
+	del jf
+
+	t.id = 2
+	t.path = transpath(n, 2)
+	t.fix_checksum()
+	t.save()
+
+	# an append from 1000 to 2000 that was interrupted half way
+	t = TransFile()
+	t.path = transpath(n, 1)
+	t.ver = 3
+	t.id = 1
+	t.ops = [attrdict(tlen = 20, offset = 1000,
+		payload = struct.pack("!IQQ", 1, 1000, 2000))]
+	t.numops = 1
+	t.fix_checksum()
+	t.save()
+
+	open(n, 'w').write(c + 'x' * 500)
+
+	# undoing the append must not cut the write off
+	fsck_verify(n, reapplied = 2)
+	assert content(n) == c + '\0' * 2000 + d
+	cleanup(n)
+
+def test_n41():
+	"replace the whole file"
+	c = gencontent(10 * 1024)
+
+	f, jf = bitmp()
+	n = f.name
+
+	jf.write(c)
+	os.chmod(n, 0640)
+	assert jf.replace(c[:3000]) == 3000
+	assert content(n) == c[:3000]
+	assert os.stat(n).st_mode & 0777 == 0640
+	assert not [x for x in os.listdir(os.path.dirname(n))
+			if 'replace' in x]
+
+	# the file offset is kept, and the new file is used from now on
+	jf.write(c[:10])
+	jf.pwrite(c[:10], 5)
+	assert jf.pread(20, 0) == c[:5] + c[:10] + c[15:20]
+
+	assert content(n) == c[:5] + c[:10] + c[15:3000] + \
+			'\0' * (10 * 1024 - 3000) + c[:10]
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n42():
+	"big operations applied from the journal"
+	c = gencontent(300 * 1024)
+
+	f, jf = bitmp()
+	n = f.name
+
+	jf.write(c)
+	t = jf.new_trans()
+	t.add_w(c[:100 * 1024], 50)
+	t.add_w(c[:10], 200 * 1024)
+	t.add_w(c[:70 * 1024], 350 * 1024)
+	t.commit()
+	assert content(n) == c[:50] + c[:100 * 1024] + \
+			c[100 * 1024 + 50:200 * 1024] + c[:10] + \
+			c[200 * 1024 + 10:] + '\0' * (50 * 1024) + \
+			c[:70 * 1024]
+	t.rollback()
+	del t
+
+	assert content(n) == c + '\0' * (50 * 1024)
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n43():
+	"add_w_fd"
+	c = gencontent(600 * 1024)
+
+	src = open(tmppath(), 'w+')
+	src.write(c)
+	src.flush()
+
+	f, jf = bitmp()
+	n = f.name
+
+	jf.write(c[:1000])
+	t = jf.new_trans()
+	t.add_w_fd(src, 100, 500 * 1024, 500)
+	t.add_w(c[:10], 20)
+	t.add_w_fd(src.fileno(), 0, 100, 600 * 1024)
+	t.commit()
+
+	try:
+		t.rollback()
+	except IOError:
+		pass
+	else:
+		raise AssertionError
+	del t
+
+	# the source must have all the data
+	t = jf.new_trans()
+	t.add_w_fd(src, 500 * 1024, 200 * 1024, 0)
+	try:
+		t.commit()
+	except IOError:
+		pass
+	else:
+		raise AssertionError
+	del t
+
+	assert content(n) == c[:20] + c[:10] + c[30:500] + \
+			c[100:500 * 1024 + 100] + '\0' * (100 * 1024 - 500) + \
+			c[:100]
+	fsck_verify(n)
+	cleanup(n)
+	os.unlink(src.name)
+
+def test_n44():
+	"add_w_fd bigger than an operation can be"
+	src = open(tmppath(), 'w+')
+	f, jf = bitmp()
+	n = f.name
+
+	t = jf.new_trans()
+	try:
+		t.add_w_fd(src, 0, 4 * 1024 * 1024 * 1024, 0)
+	except IOError:
+		pass
+	else:
+		raise AssertionError
+	del t
+
+	assert content(n) == ''
+	fsck_verify(n)
+	cleanup(n)
+	os.unlink(src.name)
+
+def test_n45():
+	"incremental transactions"
+	c = gencontent(300 * 1024)
+
+	src = open(tmppath(), 'w+')
+	src.write(c)
+	src.flush()
+
+	f, jf = bitmp(jflags = libjio.J_INCREMENTAL)
+	n = f.name
+
+	jf.write(c[:1000])
+	buf = bytearray(0 for i in range(30))
+
+	t = jf.new_trans()
+	t.add_w(c[:10], 20)
+	assert len(os.listdir(jiodir(n))) == 2
+	t.add_wv([(c[:5], 0), (c[5:100 * 1024], 1000)])
+	t.add_r(buf, 0)
+	t.add_w_fd(src, 0, 50 * 1024, 200 * 1024)
+	assert content(n) == c[:1000]
+	t.commit()
+	del t
+
+	c2 = c[:20] + c[:10] + c[30:1000] + c[5:100 * 1024] + \
+			'\0' * (100 * 1024 - 995) + c[:50 * 1024]
+	assert buf == c[:20] + c[:10]
+	assert content(n) == c2
+	assert len(os.listdir(jiodir(n))) == 1
+
+	# the data is gone once committed, until the transaction is reset
+	t = jf.new_trans()
+	t.add_w(c[:2000], 100)
+	t.commit()
+	assert content(n) == c2[:100] + c[:2000] + c2[2100:]
+	t.rollback()
+	assert content(n) == c2
+	try:
+		t.commit()
+	except IOError:
+		pass
+	else:
+		raise AssertionError
+
+	t.reset()
+	t.add_w(c[:2000], 100)
+	t.commit()
+	assert content(n) == c2[:100] + c[:2000] + c2[2100:]
+
+	# transaction files of the ones that are never committed are removed
+	# when the file is closed
+	t.reset()
+	t.add_w(c[:10], 0)
+	assert len(os.listdir(jiodir(n))) == 2
+	del t
+	assert len(os.listdir(jiodir(n))) == 2
+
+	del jf
+	assert len(os.listdir(jiodir(n))) == 1
+	fsck_verify(n)
+	cleanup(n)
+	os.unlink(src.name)
+
+def test_n46():
+	"commit statistics"
+	f, jf = bitmp()
+	n = f.name
+	c = gencontent(1000)
+
+	jf.pwrite(c, 0)
+	t = jf.new_trans()
+	t.add_w(c, 0)
+	t.add_w(c, 2000)
+	t.commit()
+	t.rollback()
+	del t
+
+	st = jf.stats(True)
+	assert st['commits'] == 3
+	assert st['ops'] == 5
+	assert st['rollbacks'] == 1
+	assert st['bytes_journaled'] > 4 * len(c)
+	for name, hist in st['phases'].items():
+		assert len(hist) == 32
+		assert sum(hist) == 3, name
+
+	# it was reset, and transactions can skip them
+	t = jf.new_trans(libjio.J_NOSTATS)
+	t.add_w(c, 0)
+	t.commit()
+	del t
+
+	st = jf.stats()
+	assert st['commits'] == st['ops'] == st['rollbacks'] == 0
+	assert st['bytes_journaled'] == 0
+	for hist in st['phases'].values():
+		assert sum(hist) == 0
+
+	del jf
+	fsck_verify(n)
+	cleanup(n)
@@ -23,6 +23,8 @@ DOHS = 12	# disk op header size
 DTS = 8		# disk trailer size
 
 
+_tmppath_count = [0]
+
 def tmppath():
 	"""Returns a temporary path. We could use os.tmpnam() if it didn't
 	print a warning, or os.tmpfile() if it allowed us to get its name.
@@ -33,7 +35,12 @@ def tmppath():
 	now_s = str(int(now))
 	now_f = str((now - int(now)) * 10000)
 	now_str = "%s.%s" % (now_s[-5:], now_f[:now_f.find('.')])
-	return tmpdir + '/jiotest.%s.%s' % (now_str, os.getpid())
+
+	# the time alone is not enough to avoid collisions between calls
+	# made in quick succession
+	_tmppath_count[0] += 1
+	return tmpdir + '/jiotest.%s.%s.%d' % (now_str, os.getpid(),
+			_tmppath_count[0])
 
 
 def run_forked(f, *args, **kwargs):
@@ -210,11 +217,32 @@ class TransFile (object):
 		fd.write(struct.pack("!IQ", 0, 0))
 		fd.write(struct.pack("!II", self.numops, self.checksum))
 
+	def fix_checksum(self):
+		"Recalculates the checksum, like libjio does."
+		buf = struct.pack("!HHI", self.ver, self.flags, self.id)
+		for o in self.ops:
+			buf += struct.pack("!IQ", o.tlen, o.offset,)
+			buf += o.payload
+		buf += struct.pack("!IQ", 0, 0)
+		self.checksum = crc32c(buf)
+
 	def __repr__(self):
 		return '<TransFile %s: id:%d f:%s n:%d ops:%s>' % \
 			(self.path, self.id, hex(self.flags), self.numops,
 					self.ops)
 
+def crc32c(buf):
+	"CRC32c of the given buffer, like libjio's checksum_buf()."
+	crc = 0xFFFFFFFF
+	for c in buf:
+		crc ^= ord(c)
+		for i in range(8):
+			if crc & 1:
+				crc = (crc >> 1) ^ 0x82F63B78
+			else:
+				crc = crc >> 1
+	return crc ^ 0xFFFFFFFF
+
 
 def gen_ret_seq(seq):
 	"""Returns a function that each time it is called returns a value of
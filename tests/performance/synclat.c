@@ -0,0 +1,133 @@
+
+/*
+ * synclat.c - A program to compare the commit latency of the journal sync
+ * modes (see jfs_sync_mode()) on the local disk.
+ *
+ * For each mode, it writes the given number of blocks using jpwrite(), one
+ * transaction each, timing every commit, and then prints the average and
+ * some percentiles of the latency, in microseconds.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <string.h>
+#include <libjio.h>
+
+#define FILENAME "test_file"
+
+
+static void help(void)
+{
+	printf("Use: synclat count blocksize\n");
+	printf("\n");
+	printf(" - count: how many blocks to write with each mode\n");
+	printf(" - blocksize: size of blocks written, in KB\n");
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *) a, y = *(const long *) b;
+
+	return (x > y) - (x < y);
+}
+
+static int run(const char *name, unsigned int mode, long count,
+		ssize_t blocksize, void *buf, long *lat)
+{
+	long i;
+	double total;
+	struct timeval tv1, tv2;
+	struct jfsck_result ckres;
+	jfs_t *fs;
+
+	fs = jopen(FILENAME, O_RDWR | O_CREAT | O_TRUNC, 0600, 0);
+	if (fs == NULL) {
+		perror("jopen()");
+		return -1;
+	}
+
+	if (jfs_sync_mode(fs, mode) != 0) {
+		fprintf(stderr, "mode %s not supported\n", name);
+		jclose(fs);
+		return -1;
+	}
+
+	total = 0;
+	for (i = 0; i < count; i++) {
+		gettimeofday(&tv1, NULL);
+		if (jpwrite(fs, buf, blocksize, i * blocksize) != blocksize) {
+			perror("jpwrite()");
+			jclose(fs);
+			return -1;
+		}
+		gettimeofday(&tv2, NULL);
+
+		lat[i] = (tv2.tv_sec - tv1.tv_sec) * 1000000 +
+			(tv2.tv_usec - tv1.tv_usec);
+		total += lat[i];
+	}
+
+	jclose(fs);
+
+	jfsck(FILENAME, NULL, &ckres, J_CLEANUP);
+	if (ckres.total != 0) {
+		fprintf(stderr, "There were %d errors during the test\n",
+				ckres.total);
+		return -1;
+	}
+
+	qsort(lat, count, sizeof(long), cmp_long);
+	printf("%s %ld %zd %.0f %ld %ld %ld %ld\n", name, count, blocksize,
+			total / count, lat[0], lat[count / 2],
+			lat[count * 99 / 100], lat[count - 1]);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int rv;
+	long count, *lat;
+	ssize_t blocksize;
+	void *buf;
+
+	if (argc != 3) {
+		help();
+		return 1;
+	}
+
+	count = atol(argv[1]);
+	blocksize = atoi(argv[2]) * 1024;
+	if (count <= 0 || blocksize <= 0) {
+		help();
+		return 1;
+	}
+
+	buf = malloc(blocksize);
+	lat = malloc(sizeof(long) * count);
+	if (buf == NULL || lat == NULL) {
+		perror("malloc()");
+		return 1;
+	}
+	memset(buf, 5, blocksize);
+
+	printf("# mode count blocksize avg min p50 p99 max (usecs)\n");
+
+	rv = 0;
+	if (run("fsync", J_SYNC_FSYNC, count, blocksize, buf, lat) != 0)
+		rv = 1;
+	if (run("dsync", J_SYNC_DSYNC, count, blocksize, buf, lat) != 0)
+		rv = 1;
+
+	unlink(FILENAME);
+	free(lat);
+	free(buf);
+
+	return rv;
+}
+